@@ -0,0 +1,191 @@
+#include "cdjpeg.h"
+#include "cdjapi.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "batch_io.h"
+#include "file_io.h"
+#include "worker_pool.h"
+
+static bool read_file(const char *path, std::vector<unsigned char> &data)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok)
+    {
+        data.resize((size_t)st.st_size);
+        size_t offset = 0;
+        while (offset < data.size())
+        {
+            ssize_t ret = read(fd, data.data() + offset, data.size() - offset);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                ok = false;
+                break;
+            }
+            if (ret == 0)
+            {
+                data.resize(offset); // truncated while reading
+                break;
+            }
+            offset += ret;
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+BatchFileProcessor::BatchFileProcessor(const char *const *inputs, const char *const *outputs, size_t count, int output_policy, unsigned concurrency, unsigned io_threads)
+    : inputs(inputs), outputs(outputs), count(count), output_policy(output_policy), io_threads(io_threads > 0 ? io_threads : 1),
+      max_transforms(concurrency > 0 ? concurrency : WorkerPool::shared().thread_count()),
+      // enough to keep every transform busy while the next files are read and the previous ones are written
+      max_in_flight(max_transforms * 2 + this->io_threads)
+{
+}
+
+jpeg_batch_stats BatchFileProcessor::run(const Transform &transform, const Done &done)
+{
+    struct Output
+    {
+        size_t index;
+        int code;
+        std::vector<unsigned char> data;
+    };
+    struct State
+    {
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::atomic<size_t> next{0};
+        size_t in_flight = 0;
+        size_t transforming = 0;
+        size_t finished = 0;
+        std::deque<Output> writes; // transformed files waiting for the writers
+        jpeg_batch_stats stats = {};
+    } state;
+
+    auto finish = [&](size_t index, int code, int64_t size)
+    {
+        done(index, code, size);
+        std::lock_guard<std::mutex> lock(state.mtx);
+        if (size >= 0)
+        {
+            state.stats.files_succeeded++;
+            state.stats.bytes_written += size;
+        }
+        else
+        {
+            state.stats.files_failed++;
+        }
+        state.in_flight--;
+        state.finished++;
+        state.cv.notify_all();
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    // Readers: take the files in order and hand them to the worker pool while the budget allows
+    for (unsigned i = 0; i < io_threads; i++)
+    {
+        threads.emplace_back([&]()
+                             {
+            size_t index;
+            while ((index = state.next++) < count)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(state.mtx);
+                    state.cv.wait(lock, [&]()
+                                  { return state.in_flight < max_in_flight; });
+                    state.in_flight++;
+                }
+                auto input = std::make_shared<std::vector<unsigned char>>();
+                if (!read_file(inputs[index], *input))
+                {
+                    debug_printf("batch: can't read %s\n", inputs[index]);
+                    finish(index, EXIT_FAILURE, -1);
+                    continue;
+                }
+                {
+                    std::unique_lock<std::mutex> lock(state.mtx);
+                    state.stats.bytes_read += input->size();
+                    state.cv.wait(lock, [&]()
+                                  { return state.transforming < max_transforms; });
+                    state.transforming++;
+                }
+                WorkerPool::shared().post([&, index, input]()
+                                          {
+                    Output out;
+                    out.index = index;
+                    out.code = transform(index, input->data(), input->size(), out.data);
+                    input->clear();
+                    input->shrink_to_fit();
+                    {
+                        std::lock_guard<std::mutex> lock(state.mtx);
+                        state.transforming--;
+                        state.cv.notify_all();
+                    }
+                    if (out.code != 0 && out.code != EXIT_WARNING)
+                    {
+                        finish(index, out.code, -1);
+                        return;
+                    }
+                    std::lock_guard<std::mutex> lock(state.mtx);
+                    state.writes.push_back(std::move(out));
+                    state.cv.notify_all(); });
+            } });
+    }
+    // Writers: write the transformed files as soon as they are ready
+    for (unsigned i = 0; i < io_threads; i++)
+    {
+        threads.emplace_back([&]()
+                             {
+            for (;;)
+            {
+                Output out;
+                {
+                    std::unique_lock<std::mutex> lock(state.mtx);
+                    state.cv.wait(lock, [&]()
+                                  { return !state.writes.empty() || state.finished == count; });
+                    if (state.writes.empty())
+                        return;
+                    out = std::move(state.writes.front());
+                    state.writes.pop_front();
+                }
+                if (replace_file(outputs[out.index], out.data.data(), out.data.size(), output_policy))
+                {
+                    finish(out.index, out.code, (int64_t)out.data.size());
+                }
+                else
+                {
+                    debug_printf("batch: can't write to %s\n", outputs[out.index]);
+                    finish(out.index, EXIT_FAILURE, -1);
+                }
+            } });
+    }
+    for (auto &t : threads)
+        t.join();
+
+    state.stats.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    const double seconds = state.stats.elapsed_us / 1e6;
+    debug_printf("batch: %d files (%d failed), %.1f MB read, %.1f MB written in %.2f s; %.1f files/s, %.1f MB/s\n",
+                 state.stats.files_succeeded + state.stats.files_failed, state.stats.files_failed,
+                 state.stats.bytes_read / 1e6, state.stats.bytes_written / 1e6, seconds,
+                 seconds > 0 ? count / seconds : 0.0, seconds > 0 ? state.stats.bytes_read / 1e6 / seconds : 0.0);
+    return state.stats;
+}
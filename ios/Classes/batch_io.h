@@ -0,0 +1,69 @@
+#ifndef _batch_io_h_
+#define _batch_io_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+    // Aggregate result of a batch; the layout is shared with _JpegBatchStats on the Dart side.
+    typedef struct jpeg_batch_stats
+    {
+        int files_succeeded;
+        int files_failed;
+        int64_t bytes_read;
+        int64_t bytes_written;
+        int64_t elapsed_us; // wall clock time of the whole batch
+    } jpeg_batch_stats;
+
+    // Result of a file in the summary of jpegtran_manifest; the layout is shared with _JpegBatchFileSummary on the Dart
+    // side.
+    typedef struct jpeg_batch_file_summary
+    {
+        int code;           // exit code; 0 or EXIT_WARNING if the output is written
+        int reserved;
+        int64_t bytes_in;   // 0 if the input can't be read
+        int64_t bytes_out;  // 0 if failed
+        int64_t elapsed_us; // from the start of the transform to the end of the write
+    } jpeg_batch_file_summary;
+
+#if defined(__cplusplus)
+}
+
+#include <functional>
+#include <vector>
+
+// File-to-file batch pipeline: the I/O threads read the inputs ahead and write the outputs behind while the worker pool
+// transforms the files already on memory, so that the storage and the CPUs are kept busy at the same time.
+// At most max_in_flight files are held on memory (read but not written yet) and at most max_transforms of them are
+// transformed at the same time.
+class BatchFileProcessor
+{
+public:
+    // Transforms the input on memory into output; returns the exit code (0 or EXIT_WARNING to write the output).
+    typedef std::function<int(size_t index, const unsigned char *input, size_t size, std::vector<unsigned char> &output)> Transform;
+    // Called once for each file on any thread; size is the output size, or -1 if the file failed.
+    typedef std::function<void(size_t index, int code, int64_t size)> Done;
+
+    // concurrency is the number of the files transformed at the same time; 0 means as many as the worker pool threads.
+    BatchFileProcessor(const char *const *inputs, const char *const *outputs, size_t count, int output_policy, unsigned concurrency = 0, unsigned io_threads = 4);
+
+    // Processes all the files and returns the aggregate result.
+    jpeg_batch_stats run(const Transform &transform, const Done &done);
+
+private:
+    const char *const *inputs;
+    const char *const *outputs;
+    const size_t count;
+    const int output_policy;
+    const unsigned io_threads;
+    const size_t max_transforms;
+    const size_t max_in_flight;
+};
+
+#endif
+
+#endif /* _batch_io_h_ */
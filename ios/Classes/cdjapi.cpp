@@ -63,6 +63,31 @@ void notify_progress_v(void *context, int pass, int totalPass, void *address)
     Dart_PostCObject_DL(dart_port, &arr);
 }
 
+void notify_chunk(void *context, int pass, int index, const void *data, size_t size)
+{
+    if (!dart_port)
+        return;
+    Dart_CObject prog[4];
+    prog[0].type = Dart_CObject_kInt64;
+    prog[0].value.as_int64 = (int64_t)context;
+    prog[1].type = Dart_CObject_kInt32;
+    prog[1].value.as_int32 = pass;
+    prog[2].type = Dart_CObject_kInt32;
+    prog[2].value.as_int32 = index;
+    // The data is copied into the message; the caller can reuse the buffer immediately
+    prog[3].type = Dart_CObject_kTypedData;
+    prog[3].value.as_typed_data.type = Dart_TypedData_kUint8;
+    prog[3].value.as_typed_data.length = (intptr_t)size;
+    prog[3].value.as_typed_data.values = (uint8_t *)data;
+
+    Dart_CObject *objs[] = {&prog[0], &prog[1], &prog[2], &prog[3]};
+    Dart_CObject arr;
+    arr.type = Dart_CObject_kArray;
+    arr.value.as_array.length = 4;
+    arr.value.as_array.values = objs;
+    Dart_PostCObject_DL(dart_port, &arr);
+}
+
 void jt_exit(int code)
 {
     throw code;
@@ -21,6 +21,7 @@ extern "C"
     void debug_printf(const char *format, ...);
     void notify_progress(void *context, int pass, int totalPass, size_t percentage);
     void notify_progress_v(void *context, int pass, int totalPass, void *address);
+    void notify_chunk(void *context, int pass, int index, const void *data, size_t size);
     void jt_exit(int code);
 
 #if defined(__cplusplus)
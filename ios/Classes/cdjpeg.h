@@ -163,10 +163,13 @@ extern "C"
     PROGRESS_PASS_EXITCODE = -1,
     PROGRESS_PASS_OUTPUT_FILESIZE = -2,
     PROGRESS_PASS_VECTOR_PTR = -3,
+    PROGRESS_PASS_CHUNK = -4, // used with notify_chunk; totalPass is the chunk index
+    PROGRESS_PASS_SPILL = -5, // jpegtran -maxmemory; totalPass is the number of the arrays spilled to the file and percentage is their size
     // Special totalPass values to indicate the result status used with PROGRESS_PASS_OUTPUT_FILESIZE
     // e.g. post_progress_monitor(cinfo, PROGRESS_PASS_OUTPUT_FILESIZE, PROGRESS_TPASS_OPTIMIZED, size);
     PROGRESS_TPASS_OPTIMIZED = 1,
     PROGRESS_TPASS_ORIGINAL = 2,
+    PROGRESS_TPASS_RECOMPRESSED = 3, // decoded and encoded again (jpeg_recompress)
   };
 
   EXTERN(boolean)
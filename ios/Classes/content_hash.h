@@ -0,0 +1,72 @@
+#ifndef _content_hash_h_
+#define _content_hash_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <string>
+
+// Fast non-cryptographic 64-bit hash to find identical image content and encode parameters on memory; the matches
+// should be confirmed (or a mismatch be harmless) because collisions can be constructed. The persistent cache is keyed
+// by Sha256 instead. The digest depends on the sequence of update calls, not only on the concatenated bytes.
+class ContentHash
+{
+public:
+    explicit ContentHash(uint64_t seed = 0) : lanes{seed, seed ^ 1, seed ^ 2, seed ^ 3}, total(0) {}
+
+    void update(const void *data, size_t size)
+    {
+        const unsigned char *p = (const unsigned char *)data;
+        size_t i = 0;
+        // 4 independent lanes to keep the multipliers busy
+        for (; i + 32 <= size; i += 32)
+        {
+            for (int k = 0; k < 4; k++)
+                lanes[k] = mix(lanes[k], load64(p + i + k * 8));
+        }
+        for (; i + 8 <= size; i += 8)
+            lanes[0] = mix(lanes[0], load64(p + i));
+        uint64_t tail = 0;
+        memcpy(&tail, p + i, size - i);
+        lanes[1] = mix(lanes[1], tail ^ ((uint64_t)(size - i) << 56));
+        total += size;
+    }
+
+    void update_int(uint64_t v)
+    {
+        lanes[2] = mix(lanes[2], v);
+        total += 8;
+    }
+
+    void update_string(const std::string &s)
+    {
+        update(s.data(), s.size());
+        update_int(s.size());
+    }
+
+    uint64_t digest64() const
+    {
+        return mix(mix(mix(mix(lanes[0], lanes[1]), lanes[2]), lanes[3]), total);
+    }
+
+private:
+    uint64_t lanes[4];
+    uint64_t total;
+
+    static inline uint64_t load64(const unsigned char *p)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        return v;
+    }
+
+    static inline uint64_t mix(uint64_t h, uint64_t v)
+    {
+        h ^= v * 0x9e3779b97f4a7c15ULL;
+        h = (h << 31) | (h >> 33);
+        return h * 0xff51afd7ed558ccdULL;
+    }
+};
+
+#endif /* _content_hash_h_ */
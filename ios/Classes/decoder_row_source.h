@@ -0,0 +1,30 @@
+#ifndef _decoder_row_source_h_
+#define _decoder_row_source_h_
+
+#include <stdio.h>
+#include <vector>
+
+#include "jpeglib.h"
+#include "row_source.h"
+
+// Rows decoded from a JPEG on demand; the decompressor should be started by jpeg_start_decompress.
+class DecoderRowSource : public RowSource
+{
+public:
+    explicit DecoderRowSource(j_decompress_ptr cinfo)
+        : RowSource(cinfo->output_width, cinfo->output_height, cinfo->output_components), cinfo(cinfo),
+          row((size_t)cinfo->output_width * cinfo->output_components) {}
+
+    const unsigned char *next_row() override
+    {
+        JSAMPROW p = row.data();
+        jpeg_read_scanlines(cinfo, &p, 1);
+        return row.data();
+    }
+
+private:
+    j_decompress_ptr cinfo;
+    std::vector<unsigned char> row;
+};
+
+#endif /* _decoder_row_source_h_ */
@@ -0,0 +1,65 @@
+#ifndef _encoded_data_h_
+#define _encoded_data_h_
+
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <memory>
+#include <vector>
+
+// Encoded JPEG data handed to Dart; the storage depends on where the data comes from.
+class EncodedData
+{
+public:
+    virtual ~EncodedData() {}
+    virtual const unsigned char *data() const = 0;
+    virtual size_t size() const = 0;
+};
+
+// Encoded data shared by reference count among the requests which receive the same result.
+typedef std::shared_ptr<const EncodedData> SharedBuffer;
+
+// Data on memory produced by the encoder.
+class VectorEncodedData : public EncodedData
+{
+public:
+    explicit VectorEncodedData(std::vector<unsigned char> &&buffer) : buffer(std::move(buffer)) {}
+
+    const unsigned char *data() const override { return buffer.data(); }
+    size_t size() const override { return buffer.size(); }
+
+private:
+    std::vector<unsigned char> buffer;
+};
+
+// Read-only mapping of a file; the data stays valid even if the file is removed.
+class MappedEncodedData : public EncodedData
+{
+public:
+    // Maps the whole file; returns NULL on failure or if the file is empty. fd can be closed after the call.
+    static std::shared_ptr<MappedEncodedData> map(int fd)
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0)
+            return NULL;
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+        return std::shared_ptr<MappedEncodedData>(new MappedEncodedData(p, (size_t)st.st_size));
+    }
+
+    ~MappedEncodedData() { munmap(addr, length); }
+
+    const unsigned char *data() const override { return (const unsigned char *)addr; }
+    size_t size() const override { return length; }
+
+private:
+    MappedEncodedData(void *addr, size_t length) : addr(addr), length(length) {}
+
+    void *addr;
+    size_t length;
+};
+
+#endif /* _encoded_data_h_ */
@@ -0,0 +1,128 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+// Destination manager that streams the encoded data to a file descriptor in fixed-size chunks
+// as the encoder emits them; the memory usage is constant regardless of the output size.
+struct fd_dest_mgr
+{
+public:
+    enum
+    {
+        // Flags for policy; they can be combined.
+        FD_DEST_POLICY_NONE = 0,
+        FD_DEST_POLICY_DONTNEED = 1, // drop the written pages from the page cache after each chunk
+        FD_DEST_POLICY_DATASYNC = 2, // flush the file data to the storage on term_destination
+    };
+
+    static const size_t DEFAULT_CHUNK_SIZE = 1024 * 1024;
+    static const size_t CHUNK_ALIGNMENT = 4096;
+
+    // WARNING: fd is not closed by the manager; it should be kept open until jpeg_finish_compress.
+    static void init(j_compress_ptr cinfo, int fd, size_t chunk_size = DEFAULT_CHUNK_SIZE, int policy = FD_DEST_POLICY_NONE)
+    {
+        if (cinfo->dest == NULL)
+        { /* first time for this JPEG object? */
+            cinfo->dest = (jpeg_destination_mgr *)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT, sizeof(fd_dest_mgr));
+        }
+        else if (cinfo->dest->init_destination != init_fd_destination)
+        {
+            throw JERR_BUFFER_SIZE;
+        }
+
+        fd_dest_mgr *dest = (fd_dest_mgr *)cinfo->dest;
+        dest->pub.init_destination = init_fd_destination;
+        dest->pub.empty_output_buffer = empty_fd_output_buffer;
+        dest->pub.term_destination = term_fd_destination;
+        dest->fd = fd;
+        dest->chunk_size = chunk_size < CHUNK_ALIGNMENT ? CHUNK_ALIGNMENT : (chunk_size + CHUNK_ALIGNMENT - 1) & ~(CHUNK_ALIGNMENT - 1);
+        dest->policy = policy;
+        dest->buffer = NULL;
+        dest->written = 0;
+    }
+
+    // Total bytes written to the file descriptor so far.
+    static size_t bytes_written(j_compress_ptr cinfo)
+    {
+        fd_dest_mgr *dest = (fd_dest_mgr *)cinfo->dest;
+        return dest->written;
+    }
+
+    // Drops the written range of the file from the page cache (FD_DEST_POLICY_DONTNEED).
+    static void drop_cache(int fd, off_t offset, off_t len)
+    {
+#if defined(__APPLE__)
+        // Darwin has no posix_fadvise; F_NOCACHE disables caching for the following writes instead.
+        (void)offset;
+        (void)len;
+        fcntl(fd, F_NOCACHE, 1);
+#else
+        posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+#endif
+    }
+
+private:
+    struct jpeg_destination_mgr pub;
+    int fd;
+    size_t chunk_size;
+    int policy;
+    unsigned char *buffer;
+    size_t written;
+
+    static void init_fd_destination(j_compress_ptr cinfo)
+    {
+        // The chunk buffer is allocated on the image pool; it's released with the other per-image resources.
+        fd_dest_mgr *dest = (fd_dest_mgr *)cinfo->dest;
+        size_t raw = (size_t)(*cinfo->mem->alloc_large)((j_common_ptr)cinfo, JPOOL_IMAGE, dest->chunk_size + CHUNK_ALIGNMENT);
+        dest->buffer = (unsigned char *)((raw + CHUNK_ALIGNMENT - 1) & ~(CHUNK_ALIGNMENT - 1));
+        dest->written = 0;
+        dest->pub.next_output_byte = dest->buffer;
+        dest->pub.free_in_buffer = dest->chunk_size;
+    }
+
+    static void write_all(j_compress_ptr cinfo, const unsigned char *p, size_t size)
+    {
+        fd_dest_mgr *dest = (fd_dest_mgr *)cinfo->dest;
+        const off_t offset = (off_t)dest->written;
+        while (size > 0)
+        {
+            ssize_t ret = write(dest->fd, p, size);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                ERREXIT(cinfo, JERR_FILE_WRITE);
+            }
+            p += ret;
+            size -= ret;
+            dest->written += ret;
+        }
+        if (dest->policy & FD_DEST_POLICY_DONTNEED)
+            drop_cache(dest->fd, offset, (off_t)(dest->written - offset));
+    }
+
+    static boolean empty_fd_output_buffer(j_compress_ptr cinfo)
+    {
+        fd_dest_mgr *dest = (fd_dest_mgr *)cinfo->dest;
+        write_all(cinfo, dest->buffer, dest->chunk_size);
+        dest->pub.next_output_byte = dest->buffer;
+        dest->pub.free_in_buffer = dest->chunk_size;
+        return TRUE;
+    }
+
+    static void term_fd_destination(j_compress_ptr cinfo)
+    {
+        fd_dest_mgr *dest = (fd_dest_mgr *)cinfo->dest;
+        write_all(cinfo, dest->buffer, dest->chunk_size - dest->pub.free_in_buffer);
+        dest->pub.free_in_buffer = dest->chunk_size;
+        if (dest->policy & FD_DEST_POLICY_DATASYNC)
+        {
+#if defined(__APPLE__)
+            if (fsync(dest->fd) != 0)
+#else
+            if (fdatasync(dest->fd) != 0)
+#endif
+                ERREXIT(cinfo, JERR_FILE_WRITE);
+        }
+    }
+};
@@ -0,0 +1,128 @@
+#include "cdjpeg.h"
+#include "cdjapi.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <atomic>
+
+#include "fd_dest_mgr.h"
+#include "file_io.h"
+
+bool write_fully(int fd, const unsigned char *p, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t ret = write(fd, p, size);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+std::string temp_path_for(const char *path)
+{
+    static std::atomic<unsigned> serial(0);
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", (int)getpid(), serial++);
+    return std::string(path) + suffix;
+}
+
+// Writes the data into the file at path created (or truncated) by open and applies the policy.
+static bool write_new_file(const char *path, const unsigned char *data, size_t size, int policy)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return false;
+    bool ok = write_fully(fd, data, size);
+    if (ok && (policy & fd_dest_mgr::FD_DEST_POLICY_DATASYNC))
+    {
+#if defined(__APPLE__)
+        ok = fsync(fd) == 0;
+#else
+        ok = fdatasync(fd) == 0;
+#endif
+    }
+    if (ok && (policy & fd_dest_mgr::FD_DEST_POLICY_DONTNEED))
+        fd_dest_mgr::drop_cache(fd, 0, (off_t)size);
+    if (close(fd) != 0)
+        ok = false;
+    if (!ok)
+        unlink(path);
+    return ok;
+}
+
+bool write_file(const char *path, const unsigned char *data, size_t size)
+{
+    return write_new_file(path, data, size, fd_dest_mgr::FD_DEST_POLICY_NONE);
+}
+
+bool replace_file(const char *path, const unsigned char *data, size_t size, int policy)
+{
+    const std::string tmp = temp_path_for(path);
+    if (!write_new_file(tmp.c_str(), data, size, policy))
+        return false;
+    if (rename(tmp.c_str(), path) != 0)
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+TempOutputFile::TempOutputFile(const char *path) : path(path), tmp(temp_path_for(path)), file(-1)
+{
+}
+
+TempOutputFile::~TempOutputFile()
+{
+    discard();
+}
+
+bool TempOutputFile::open()
+{
+    file = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (file < 0)
+    {
+        debug_printf("can't open %s for writing\n", tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+size_t TempOutputFile::size() const
+{
+    return file >= 0 ? (size_t)lseek(file, 0, SEEK_CUR) : 0;
+}
+
+bool TempOutputFile::commit()
+{
+    if (file < 0)
+        return false;
+    const bool closed = close(file) == 0;
+    file = -1;
+    if (!closed || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        debug_printf("can't write %s\n", path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+void TempOutputFile::discard()
+{
+    if (file < 0)
+        return;
+    close(file);
+    file = -1;
+    unlink(tmp.c_str());
+}
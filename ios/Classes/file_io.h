@@ -0,0 +1,51 @@
+#ifndef _file_io_h_
+#define _file_io_h_
+
+#include <stddef.h>
+
+#include <string>
+
+// Writes all the data to fd, retrying on EINTR and partial writes; returns false on failure.
+bool write_fully(int fd, const unsigned char *p, size_t size);
+
+// Unique temporary path next to path (on the same filesystem, so that it can be renamed to path).
+std::string temp_path_for(const char *path);
+
+// Writes the data into the file in place; returns false on failure (and the file is removed).
+bool write_file(const char *path, const unsigned char *data, size_t size);
+
+// Writes the data into a temporary file next to path and renames it to path, so the existing file (which may be the
+// input of the operation) is replaced only on success; returns false on failure.
+// policy is combination of fd_dest_mgr::FD_DEST_POLICY_* flags applied to the temporary file before the rename.
+bool replace_file(const char *path, const unsigned char *data, size_t size, int policy = 0);
+
+// Output file streamed into a temporary file next to the path; the path is replaced only by commit, so the readers
+// never see a truncated or partially written file and a failure leaves the existing file as it was.
+// The temporary file is removed unless committed.
+class TempOutputFile
+{
+public:
+    explicit TempOutputFile(const char *path);
+    ~TempOutputFile();
+
+    // Creates the temporary file; returns false on failure.
+    bool open();
+    int fd() const { return file; }
+    // Bytes written to the file so far (the current offset).
+    size_t size() const;
+
+    // Closes the file and renames it to the path; returns false on failure (and the temporary file is removed).
+    bool commit();
+    // Closes and removes the temporary file.
+    void discard();
+
+private:
+    std::string path;
+    std::string tmp;
+    int file;
+
+    TempOutputFile(const TempOutputFile &) = delete;
+    TempOutputFile &operator=(const TempOutputFile &) = delete;
+};
+
+#endif /* _file_io_h_ */
@@ -0,0 +1,214 @@
+#include "jpeg_cache.h"
+#include "cdjapi.h"
+#include "file_io.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <vector>
+
+static const char ENTRY_SUFFIX[] = ".jpg";
+
+JpegCache &JpegCache::shared()
+{
+    static JpegCache instance;
+    return instance;
+}
+
+void JpegCache::configure(const char *dir, uint64_t max_bytes)
+{
+    // Scan the entries left by the previous runs without the lock; the least recently used first
+    struct Found
+    {
+        std::string key;
+        uint64_t size;
+        struct timespec mtime;
+    };
+    std::vector<Found> found;
+    const std::string new_dir = dir ? dir : "";
+    if (!new_dir.empty())
+    {
+        mkdir(new_dir.c_str(), 0777);
+        if (DIR *d = opendir(new_dir.c_str()))
+        {
+            const size_t suffix_len = sizeof(ENTRY_SUFFIX) - 1;
+            while (struct dirent *e = readdir(d))
+            {
+                const size_t len = strlen(e->d_name);
+                if (len <= suffix_len || strcmp(e->d_name + len - suffix_len, ENTRY_SUFFIX) != 0)
+                    continue;
+                struct stat st;
+                if (stat((new_dir + "/" + e->d_name).c_str(), &st) != 0)
+                    continue;
+                Found entry;
+                entry.key.assign(e->d_name, len - suffix_len);
+                entry.size = (uint64_t)st.st_size;
+#if defined(__APPLE__)
+                entry.mtime = st.st_mtimespec;
+#else
+                entry.mtime = st.st_mtim;
+#endif
+                found.push_back(std::move(entry));
+            }
+            closedir(d);
+        }
+        std::sort(found.begin(), found.end(), [](const Found &a, const Found &b)
+                  { return a.mtime.tv_sec != b.mtime.tv_sec ? a.mtime.tv_sec < b.mtime.tv_sec : a.mtime.tv_nsec < b.mtime.tv_nsec; });
+    }
+
+    std::vector<std::string> victims;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->dir = new_dir;
+        this->max_bytes = max_bytes;
+        generation++;
+        entries.clear();
+        lru.clear();
+        total_bytes = 0;
+        for (const Found &entry : found)
+            touch(entry.key, entry.size);
+        if (!this->dir.empty())
+            victims = take_victims(); // the limit may be smaller than before
+    }
+    for (const std::string &path : victims)
+        unlink(path.c_str());
+}
+
+bool JpegCache::enabled()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return !dir.empty();
+}
+
+std::string JpegCache::path_for(const std::string &key, uint64_t *generation)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (generation)
+        *generation = this->generation;
+    if (dir.empty())
+        return std::string();
+    return path_of(key);
+}
+
+// The members below should be called with the mutex held.
+
+std::string JpegCache::path_of(const std::string &key) const
+{
+    return dir + "/" + key + ENTRY_SUFFIX;
+}
+
+// Marks the entry as the most recently used one, adding it if not tracked yet.
+void JpegCache::touch(const std::string &key, uint64_t size)
+{
+    auto it = entries.find(key);
+    if (it != entries.end())
+    {
+        total_bytes -= it->second.size;
+        lru.erase(it->second.lru);
+    }
+    else
+    {
+        it = entries.emplace(key, Entry()).first;
+    }
+    it->second.size = size;
+    it->second.lru = lru.insert(lru.end(), key);
+    total_bytes += size;
+}
+
+void JpegCache::remove(const std::string &key)
+{
+    auto it = entries.find(key);
+    if (it == entries.end())
+        return;
+    total_bytes -= it->second.size;
+    lru.erase(it->second.lru);
+    entries.erase(it);
+}
+
+// Untracks the least recently used entries over the limit and returns their paths to be removed without the lock.
+std::vector<std::string> JpegCache::take_victims()
+{
+    std::vector<std::string> paths;
+    while (total_bytes > max_bytes && !lru.empty())
+    {
+        const std::string key = lru.front();
+        paths.push_back(path_of(key));
+        remove(key);
+    }
+    return paths;
+}
+
+SharedBuffer JpegCache::lookup(const std::string &key)
+{
+    uint64_t gen;
+    const std::string path = path_for(key, &gen);
+    if (path.empty())
+        return NULL;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (gen == generation)
+            remove(key); // removed by someone else
+        return NULL;
+    }
+    futimens(fd, NULL); // the order is restored from the modification times by the next configure
+    SharedBuffer data = MappedEncodedData::map(fd);
+    close(fd);
+    if (data)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (gen == generation)
+                touch(key, data->size());
+        }
+        debug_printf("cache hit: %s\n", key.c_str());
+    }
+    return data;
+}
+
+void JpegCache::store(const std::string &key, const unsigned char *data, size_t size)
+{
+    uint64_t gen;
+    const std::string path = path_for(key, &gen);
+    if (path.empty())
+        return;
+    // Readers never see partially written entries
+    if (!replace_file(path.c_str(), data, size))
+    {
+        debug_printf("cache: can't write %s\n", path.c_str());
+        return;
+    }
+    std::vector<std::string> victims;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (gen != generation)
+            return;
+        touch(key, size);
+        victims = take_victims();
+    }
+    // The mapped entries are still valid after unlink
+    for (const std::string &victim : victims)
+        unlink(victim.c_str());
+}
+
+void JpegCache::store_file(const std::string &key, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    SharedBuffer data = MappedEncodedData::map(fd);
+    close(fd);
+    if (data)
+        store(key, data->data(), data->size());
+}
+
+/// Enables the persistent output cache on [dir] with the total size limit [max_bytes]; dir=NULL disables the cache.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_cache_configure(const char *dir, int64_t max_bytes)
+{
+    JpegCache::shared().configure(dir, max_bytes > 0 ? (uint64_t)max_bytes : 0);
+}
@@ -0,0 +1,59 @@
+#ifndef _jpeg_cache_h_
+#define _jpeg_cache_h_
+
+#include <stdint.h>
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "encoded_data.h"
+
+// Optional persistent cache of the compression/jpegtran outputs, keyed by the operation and the SHA-256 of the input
+// and the parameters; a hit is served without comparing the input, so the key should never collide.
+// Each entry is a file named after the key in the cache directory; the least recently used entries are removed
+// when the total size exceeds the limit. The sizes and the use order of the entries are tracked on memory; the
+// directory is scanned only by configure (the order is restored from the modification times). The cache is disabled
+// until configured with jpeg_cache_configure.
+class JpegCache
+{
+public:
+    static JpegCache &shared();
+
+    // dir=NULL (or empty) disables the cache.
+    void configure(const char *dir, uint64_t max_bytes);
+    bool enabled();
+
+    // Returns the cached output mapped on memory or NULL if not cached; a hit marks the entry as recently used.
+    SharedBuffer lookup(const std::string &key);
+
+    // Stores the output; errors are ignored because the cache is just an optimization.
+    void store(const std::string &key, const unsigned char *data, size_t size);
+    void store_file(const std::string &key, const char *path);
+
+private:
+    struct Entry
+    {
+        uint64_t size;
+        std::list<std::string>::iterator lru; // position in lru
+    };
+
+    // Guards the members; no file system operation is done while it's held
+    std::mutex mutex;
+    std::string dir;
+    uint64_t max_bytes = 0;
+    uint64_t generation = 0; // incremented by configure; the entries stored into the old directory are not tracked
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru; // keys from the least recently used
+    uint64_t total_bytes = 0;
+
+    std::string path_for(const std::string &key, uint64_t *generation = NULL);
+    std::string path_of(const std::string &key) const;
+    void touch(const std::string &key, uint64_t size);
+    void remove(const std::string &key);
+    std::vector<std::string> take_victims();
+};
+
+#endif /* _jpeg_cache_h_ */
@@ -11,6 +11,21 @@
 #include <memory>
 
 #include "vector_dest_mgr.h"
+#include "fd_dest_mgr.h"
+#include "port_dest_mgr.h"
+#include "jpegcompress.h"
+#include "row_source.h"
+#include "decoder_row_source.h"
+#include "jpegsegments.h"
+#include "worker_pool.h"
+#include "single_flight.h"
+#include "jpeg_cache.h"
+#include "file_io.h"
+#include "jpegprobe.h"
+#include "transupp.h"
+
+#include <algorithm>
+#include <atomic>
 
 static int comps[] = {
     -1,
@@ -32,134 +47,938 @@ static int comps[] = {
     1, // RGB565???
 };
 
-extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress(const unsigned char *p0, int width, int height, int stride, int input_cs, int quality, int dpi, void *context)
+int jpeg_compress_components(int input_cs)
 {
-    jpeg_compress_struct cinfo;
-    jpeg_error_mgr jsrcerr;
-    cinfo.err = debug_foward_error(&jsrcerr);
+    return input_cs > 0 && input_cs < (int)(sizeof(comps) / sizeof(comps[0])) ? comps[input_cs] : 0;
+}
 
-    jpeg_create_compress(&cinfo);
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress_options_init(jpeg_compress_options *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->quality = 75;
+    options->dpi = 96;
+    options->output = JPEG_COMPRESS_OUTPUT_VECTOR;
+    options->alpha_mode = JPEG_COMPRESS_ALPHA_IGNORE;
+    options->background = 0xffffff;
+}
 
-    cdjpeg_progress_mgr progress;
-    start_progress_monitor((j_common_ptr)&cinfo, &progress, context);
+// Determines the alpha position for the 4-byte RGB pixel layouts and places the background color (0xRRGGBB) on the layout;
+// returns false if the color space has no alpha (or padding) byte.
+static bool resolve_alpha_layout(int input_cs, int background, int &alpha_offset, unsigned char bg[4])
+{
+    const unsigned char r = (unsigned char)(background >> 16), g = (unsigned char)(background >> 8), b = (unsigned char)background;
+    switch (input_cs)
+    {
+    case JCS_EXT_RGBX:
+    case JCS_EXT_RGBA:
+        alpha_offset = 3, bg[0] = r, bg[1] = g, bg[2] = b, bg[3] = 255;
+        return true;
+    case JCS_EXT_BGRX:
+    case JCS_EXT_BGRA:
+        alpha_offset = 3, bg[0] = b, bg[1] = g, bg[2] = r, bg[3] = 255;
+        return true;
+    case JCS_EXT_XBGR:
+    case JCS_EXT_ABGR:
+        alpha_offset = 0, bg[0] = 255, bg[1] = b, bg[2] = g, bg[3] = r;
+        return true;
+    case JCS_EXT_XRGB:
+    case JCS_EXT_ARGB:
+        alpha_offset = 0, bg[0] = 255, bg[1] = r, bg[2] = g, bg[3] = b;
+        return true;
+    }
+    return false;
+}
 
-    std::vector<unsigned char> outbuffer;
-    try
+// Whether the transform swaps the width and the height.
+static bool transposes(int transform)
+{
+    return transform == JPEG_COMPRESS_TRANSFORM_TRANSPOSE || transform == JPEG_COMPRESS_TRANSFORM_TRANSVERSE ||
+           transform == JPEG_COMPRESS_TRANSFORM_ROT_90 || transform == JPEG_COMPRESS_TRANSFORM_ROT_270;
+}
+
+RowSource *new_memory_row_source(const unsigned char *p0, int width, int height, int stride, int input_cs, int transform)
+{
+    const int components = jpeg_compress_components(input_cs);
+    switch (transform)
     {
-        vector_dest_mgr::init(&cinfo, outbuffer);
+    case JPEG_COMPRESS_TRANSFORM_FLIP_H:
+        return new TransformedRowSource(p0, width, height, stride, components, false, true, false);
+    case JPEG_COMPRESS_TRANSFORM_FLIP_V:
+        return new TransformedRowSource(p0, width, height, stride, components, false, false, true);
+    case JPEG_COMPRESS_TRANSFORM_TRANSPOSE:
+        return new TransformedRowSource(p0, width, height, stride, components, true, false, false);
+    case JPEG_COMPRESS_TRANSFORM_TRANSVERSE:
+        return new TransformedRowSource(p0, width, height, stride, components, true, true, true);
+    case JPEG_COMPRESS_TRANSFORM_ROT_90:
+        return new TransformedRowSource(p0, width, height, stride, components, true, true, false);
+    case JPEG_COMPRESS_TRANSFORM_ROT_180:
+        return new TransformedRowSource(p0, width, height, stride, components, false, true, true);
+    case JPEG_COMPRESS_TRANSFORM_ROT_270:
+        return new TransformedRowSource(p0, width, height, stride, components, true, false, true);
+    }
+    return new MemoryRowSource(p0, width, height, stride, components);
+}
 
-        cinfo.image_width = (JDIMENSION)width;
-        cinfo.image_height = (JDIMENSION)height;
-        cinfo.input_components = comps[input_cs];
+// Resolves the output size of the downscaling; returns false if the size is invalid.
+// width/height are of the source pixels; the target size is of the image after options.transform.
+static bool resolve_target_size(int width, int height, const jpeg_compress_options &options, int &target_width, int &target_height)
+{
+    if (transposes(options.transform))
+        std::swap(width, height);
+    target_width = options.target_width;
+    target_height = options.target_height;
+    if (target_width <= 0 && target_height <= 0)
+    {
+        target_width = width;
+        target_height = height;
+    }
+    else if (target_width <= 0)
+        target_width = (int)((double)width * target_height / height + 0.5);
+    else if (target_height <= 0)
+        target_height = (int)((double)height * target_width / width + 0.5);
+    if (target_width < 1)
+        target_width = 1;
+    if (target_height < 1)
+        target_height = 1;
+    // only downscaling is supported
+    return target_width <= width && target_height <= height;
+}
 
-        jpeg_c_set_int_param(&cinfo, JINT_COMPRESS_PROFILE, JCP_MAX_COMPRESSION);
+// If options.single_pass is non-zero, the encoder is configured to produce baseline output with fixed Huffman tables, so that
+// the data is emitted to the destination while jpeg_write_scanlines runs rather than all at once on jpeg_finish_compress.
+void jpeg_compress_setup(j_compress_ptr cinfo, int width, int height, int input_cs, const jpeg_compress_options &options)
+{
+    cinfo->image_width = (JDIMENSION)width;
+    cinfo->image_height = (JDIMENSION)height;
+    cinfo->input_components = comps[input_cs];
 
-        cinfo.in_color_space = (J_COLOR_SPACE)input_cs;
-        jpeg_set_defaults(&cinfo);
-        cinfo.err->trace_level = 0;
+    jpeg_c_set_int_param(cinfo, JINT_COMPRESS_PROFILE, JCP_MAX_COMPRESSION);
 
-        jpeg_set_quality(&cinfo, quality, FALSE);
+    cinfo->in_color_space = (J_COLOR_SPACE)input_cs;
+    jpeg_set_defaults(cinfo);
+    cinfo->err->trace_level = 0;
 
-        cinfo.density_unit = 1; // dpi
-        cinfo.X_density = (UINT16)dpi;
-        cinfo.Y_density = (UINT16)dpi;
+    jpeg_set_quality(cinfo, options.quality, FALSE);
 
-        cinfo.write_JFIF_header = TRUE;
-        cinfo.write_Adobe_marker = FALSE;
+    if (options.single_pass)
+    {
+        cinfo->num_scans = 0;
+        cinfo->scan_info = NULL;
+        cinfo->optimize_coding = FALSE;
+        jpeg_c_set_bool_param(cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
+        jpeg_c_set_bool_param(cinfo, JBOOLEAN_TRELLIS_QUANT, FALSE);
+        jpeg_c_set_bool_param(cinfo, JBOOLEAN_TRELLIS_QUANT_DC, FALSE);
+    }
 
-        jpeg_start_compress(&cinfo, TRUE);
+    cinfo->density_unit = 1; // dpi
+    cinfo->X_density = (UINT16)options.dpi;
+    cinfo->Y_density = (UINT16)options.dpi;
 
-        for (int y = 0; y < height; y++)
+    cinfo->write_JFIF_header = TRUE;
+    cinfo->write_Adobe_marker = FALSE;
+}
+
+// Compresses the rows from src into the destination installed by init_dest; returns 0 on success or the exit code on failure.
+// cinfo is destroyed on return.
+template <typename DestInit>
+static int compress_image(j_compress_ptr cinfo, RowSource &src, int input_cs, const jpeg_compress_options &options, DestInit init_dest, j_decompress_ptr markers_from = NULL)
+{
+    try
+    {
+        init_dest(cinfo);
+        jpeg_compress_setup(cinfo, src.width, src.height, input_cs, options);
+
+        jpeg_start_compress(cinfo, TRUE);
+        if (markers_from)
+            jcopy_markers_execute(markers_from, cinfo, JCOPYOPT_ALL); // EXIF, ICC profile etc. of the source JPEG
+
+        for (int y = 0; y < src.height; y++)
         {
-            const unsigned char *pLine = p0 + stride * y;
-            jpeg_write_scanlines(&cinfo, (JSAMPARRAY)&pLine, 1);
+            const unsigned char *pLine = src.next_row();
+            jpeg_write_scanlines(cinfo, (JSAMPARRAY)&pLine, 1);
         }
+
+        jpeg_finish_compress(cinfo);
     }
     catch (int code)
     {
         debug_printf("Woops, exit_code=%d\n", code);
-        jpeg_destroy_compress(&cinfo);
-        post_progress_monitor((j_common_ptr)&cinfo, PROGRESS_PASS_EXITCODE, 0, code);
-        return;
+        jpeg_destroy_compress(cinfo);
+        return code;
     }
     catch (std::exception &e)
     {
         debug_printf("exception: %s\n", e.what());
-        jpeg_destroy_compress(&cinfo);
-        post_progress_monitor((j_common_ptr)&cinfo, PROGRESS_PASS_EXITCODE, 0, -1);
+        jpeg_destroy_compress(cinfo);
+        return -1;
+    }
+    jpeg_destroy_compress(cinfo);
+    return 0;
+}
+
+// Narrows the source size to the rectangle of options.crop_* and calculates the offset of the rectangle from p0;
+// returns false if the rectangle is not in the image.
+// Negative stride (bottom-up buffer with p0 pointing to the top row) works as is.
+static bool crop_rect(int &width, int &height, int stride, int input_cs, const jpeg_compress_options &options, ptrdiff_t &offset)
+{
+    offset = 0;
+    if (options.crop_x == 0 && options.crop_y == 0 && options.crop_width == 0 && options.crop_height == 0)
+        return true;
+    const int crop_width = options.crop_width > 0 ? options.crop_width : width - options.crop_x;
+    const int crop_height = options.crop_height > 0 ? options.crop_height : height - options.crop_y;
+    if (jpeg_compress_components(input_cs) == 0 || options.crop_x < 0 || options.crop_y < 0 || options.crop_width < 0 ||
+        options.crop_height < 0 || crop_width <= 0 || crop_height <= 0 || crop_width > width - options.crop_x ||
+        crop_height > height - options.crop_y)
+    {
+        debug_printf("crop rectangle (%d, %d) %dx%d is out of the image %dx%d.\n", options.crop_x, options.crop_y, crop_width, crop_height, width, height);
+        return false;
+    }
+    offset = (ptrdiff_t)stride * options.crop_y + (ptrdiff_t)options.crop_x * comps[input_cs];
+    width = crop_width;
+    height = crop_height;
+    return true;
+}
+
+// Narrows the source to the rectangle of options.crop_* by offsetting p0.
+static bool apply_crop(const unsigned char *&p0, int &width, int &height, int stride, int input_cs, const jpeg_compress_options &options)
+{
+    ptrdiff_t offset;
+    if (!crop_rect(width, height, stride, input_cs, options, offset))
+        return false;
+    p0 += offset;
+    return true;
+}
+
+static bool validate_parameters(int width, int height, int stride, int input_cs, const jpeg_compress_options &options)
+{
+    int target_width, target_height;
+    if (input_cs <= 0 || input_cs >= (int)(sizeof(comps) / sizeof(comps[0])) || width <= 0 || height <= 0)
+    {
+        debug_printf("invalid image size or color space.\n");
+        return false;
+    }
+    if ((stride < 0 ? -(ptrdiff_t)stride : (ptrdiff_t)stride) < (ptrdiff_t)width * comps[input_cs])
+    {
+        debug_printf("stride %d is too small for the width %d.\n", stride, width);
+        return false;
+    }
+    if (options.transform < JPEG_COMPRESS_TRANSFORM_NONE || options.transform > JPEG_COMPRESS_TRANSFORM_ROT_270)
+    {
+        debug_printf("invalid transform %d.\n", options.transform);
+        return false;
+    }
+    if (!resolve_target_size(width, height, options, target_width, target_height))
+    {
+        debug_printf("target size %dx%d exceeds the image size %dx%d.\n", target_width, target_height, width, height);
+        return false;
+    }
+    if (options.alpha_mode != JPEG_COMPRESS_ALPHA_IGNORE)
+    {
+        int alpha_offset;
+        unsigned char bg[4];
+        if ((options.alpha_mode != JPEG_COMPRESS_ALPHA_STRAIGHT && options.alpha_mode != JPEG_COMPRESS_ALPHA_PREMULTIPLIED) ||
+            !resolve_alpha_layout(input_cs, options.background, alpha_offset, bg))
+        {
+            debug_printf("alpha mode %d is not applicable to the color space %d.\n", options.alpha_mode, input_cs);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Appends the processing stages for the options on top of stages.back(); the last stage is the input of the encoder.
+void append_stages(std::vector<std::unique_ptr<RowSource>> &stages, int input_cs, const jpeg_compress_options &options, int target_width, int target_height)
+{
+    // Flattening is done before downscaling so that the colors of transparent pixels never bleed into the output.
+    int alpha_offset;
+    unsigned char bg[4];
+    if (options.alpha_mode != JPEG_COMPRESS_ALPHA_IGNORE && resolve_alpha_layout(input_cs, options.background, alpha_offset, bg))
+        stages.emplace_back(new FlattenAlphaRowSource(*stages.back(), alpha_offset, bg, options.alpha_mode == JPEG_COMPRESS_ALPHA_PREMULTIPLIED));
+
+    if (target_width != stages.back()->width || target_height != stages.back()->height)
+        stages.emplace_back(new AreaDownscaleRowSource(*stages.back(), target_width, target_height));
+}
+
+bool jpeg_compress_resolve_source(int &width, int &height, int stride, int input_cs, const jpeg_compress_options &options, ptrdiff_t &offset, int &target_width, int &target_height)
+{
+    if (!crop_rect(width, height, stride, input_cs, options, offset) || !validate_parameters(width, height, stride, input_cs, options))
+        return false;
+    resolve_target_size(width, height, options, target_width, target_height);
+    return true;
+}
+
+// Builds the source stages for the options and compresses the image into the destination installed by init_dest.
+// The parameters should be checked by validate_parameters in advance.
+template <typename DestInit>
+static int compress_pixels(j_compress_ptr cinfo, const unsigned char *p0, int width, int height, int stride, int input_cs, const jpeg_compress_options &options, DestInit init_dest)
+{
+    int target_width, target_height;
+    resolve_target_size(width, height, options, target_width, target_height);
+
+    std::vector<std::unique_ptr<RowSource>> stages;
+    stages.emplace_back(new_memory_row_source(p0, width, height, stride, input_cs, options.transform));
+    append_stages(stages, input_cs, options, target_width, target_height);
+    return compress_image(cinfo, *stages.back(), input_cs, options, init_dest);
+}
+
+// Runs encode with the destination for options.output; encode(init_dest) should compress the image into the destination
+// installed by init_dest and return the exit code.
+// The file/stream output size is posted by PROGRESS_PASS_OUTPUT_FILESIZE with totalPass=tpass, and the vector output is
+// returned in result. If original is specified and the output is larger than it, original is delivered instead and
+// tpass is changed to PROGRESS_TPASS_ORIGINAL (except for the stream output, which is already posted).
+template <typename Encode>
+static int encode_to_output(const jpeg_compress_options &options, void *context, int &tpass, SharedBuffer &result, const unsigned char *original, size_t original_size, Encode encode)
+{
+    int code;
+    if (options.output == JPEG_COMPRESS_OUTPUT_FILE)
+    {
+        // The output path (which may be the input itself) is replaced only on success
+        TempOutputFile file(options.output_path);
+        if (!file.open())
+            return EXIT_FAILURE;
+
+        code = encode([&](j_compress_ptr cinfo)
+                      { fd_dest_mgr::init(cinfo, file.fd(), fd_dest_mgr::DEFAULT_CHUNK_SIZE, options.output_policy); });
+        size_t size = code == 0 ? file.size() : 0;
+        if (code == 0 && original && size > original_size)
+        {
+            // Rewind the temporary file and put the original into it instead
+            code = lseek(file.fd(), 0, SEEK_SET) == 0 && ftruncate(file.fd(), 0) == 0 && write_fully(file.fd(), original, original_size) ? 0 : EXIT_FAILURE;
+            size = original_size;
+            tpass = PROGRESS_TPASS_ORIGINAL;
+        }
+        if (code == 0 && !file.commit())
+            code = EXIT_FAILURE;
+        if (code == 0)
+            notify_progress(context, PROGRESS_PASS_OUTPUT_FILESIZE, tpass, size);
+    }
+    else if (options.output == JPEG_COMPRESS_OUTPUT_STREAM)
+    {
+        std::vector<unsigned char> chunk;
+        size_t size = 0;
+        const size_t chunk_size = options.chunk_size > 0 ? (size_t)options.chunk_size : port_dest_mgr::DEFAULT_CHUNK_SIZE;
+        code = encode([&](j_compress_ptr cinfo)
+                      { port_dest_mgr::init(cinfo, context, chunk, chunk_size, &size); });
+        if (code == 0)
+            notify_progress(context, PROGRESS_PASS_OUTPUT_FILESIZE, tpass, size);
+    }
+    else
+    {
+        std::vector<unsigned char> outbuffer;
+        code = encode([&](j_compress_ptr cinfo)
+                      { vector_dest_mgr::init(cinfo, outbuffer); });
+        if (code == 0 && original && outbuffer.size() > original_size)
+        {
+            outbuffer.assign(original, original + original_size);
+            tpass = PROGRESS_TPASS_ORIGINAL;
+        }
+        if (code == 0)
+            result = std::make_shared<VectorEncodedData>(std::move(outbuffer));
+    }
+    return code;
+}
+
+// Builds the identity of a vector output request for SingleFlight.
+static void make_flight_key(FlightKey &key, const unsigned char *p0, int width, int height, int stride, int input_cs, const jpeg_compress_options &options)
+{
+    int target_width, target_height;
+    resolve_target_size(width, height, options, target_width, target_height);
+    key.p0 = p0;
+    key.width = width;
+    key.height = height;
+    key.stride = stride;
+    key.input_cs = input_cs;
+    key.row_bytes = (size_t)width * comps[input_cs];
+    key.key = options.dedupe_key ? options.dedupe_key : "";
+    key.params = {options.quality, options.dpi, options.single_pass ? 1 : 0, target_width, target_height, options.alpha_mode,
+                  options.alpha_mode != JPEG_COMPRESS_ALPHA_IGNORE ? options.background : 0, options.transform,
+                  options.crop_x, options.crop_y};
+    SingleFlight::compute_hash(key);
+}
+
+/// Compresses the image with [options]; the result is delivered as specified by options->output:
+/// - JPEG_COMPRESS_OUTPUT_VECTOR: the result handle is notified by PROGRESS_PASS_VECTOR_PTR; if identical requests
+///   (same pixels or options->dedupe_key, and same parameters) run concurrently, only one of them encodes the image and
+///   the others share its result.
+/// - JPEG_COMPRESS_OUTPUT_FILE: written into options->output_path without building the whole output on memory;
+///   the output file size is notified by PROGRESS_PASS_OUTPUT_FILESIZE.
+/// - JPEG_COMPRESS_OUTPUT_STREAM: posted to Dart by options->chunk_size bytes chunks (PROGRESS_PASS_CHUNK) as the encoder
+///   produces them; with options->single_pass, the chunks are posted during the encoding. The total size is notified by
+///   PROGRESS_PASS_OUTPUT_FILESIZE.
+/// If options->target_width/target_height is specified, the image is downscaled on the fly while encoding.
+/// If options->transform is specified, the image is rotated/mirrored on reading the pixels without making the transformed copy.
+/// If options->crop_* is specified, only the rectangle is encoded; the rows are addressed in place. [stride] may be negative
+/// for a bottom-up buffer, where p0 points to the top row (i.e. the last row on memory).
+/// If the persistent cache is enabled by jpeg_cache_configure, the vector and file outputs are served from the cache
+/// when the same image was compressed with the same parameters before.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress_ex(const unsigned char *p0, int width, int height, int stride, int input_cs, const jpeg_compress_options *options, void *context)
+{
+    if (!apply_crop(p0, width, height, stride, input_cs, *options) || !validate_parameters(width, height, stride, input_cs, *options))
+    {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, 0, EXIT_FAILURE);
+        return;
+    }
+
+    // The persistent cache is looked up by the same identity as the single-flight
+    FlightKey key;
+    std::string cache_key;
+    if (options->output == JPEG_COMPRESS_OUTPUT_VECTOR || (options->output == JPEG_COMPRESS_OUTPUT_FILE && JpegCache::shared().enabled()))
+    {
+        make_flight_key(key, p0, width, height, stride, input_cs, *options);
+        if (JpegCache::shared().enabled())
+            cache_key = "compress-" + SingleFlight::compute_digest(key);
+    }
+
+    auto encode = [&](SharedBuffer &result)
+    {
+        int tpass = PROGRESS_TPASS_OPTIMIZED;
+        return encode_to_output(*options, context, tpass, result, NULL, 0, [&](auto init_dest)
+                                {
+                                    jpeg_compress_struct cinfo;
+                                    jpeg_error_mgr jsrcerr;
+                                    cinfo.err = debug_foward_error(&jsrcerr);
+                                    jpeg_create_compress(&cinfo);
+                                    cdjpeg_progress_mgr progress;
+                                    start_progress_monitor((j_common_ptr)&cinfo, &progress, context);
+                                    return compress_pixels(&cinfo, p0, width, height, stride, input_cs, *options, init_dest); });
+    };
+
+    int code;
+    SharedBuffer result;
+    if (options->output == JPEG_COMPRESS_OUTPUT_FILE && !cache_key.empty() && (result = JpegCache::shared().lookup(cache_key)))
+    {
+        code = replace_file(options->output_path, result->data(), result->size()) ? 0 : EXIT_FAILURE;
+        if (code == 0)
+            notify_progress(context, PROGRESS_PASS_OUTPUT_FILESIZE, PROGRESS_TPASS_OPTIMIZED, result->size());
+    }
+    else if (options->output != JPEG_COMPRESS_OUTPUT_VECTOR)
+    {
+        code = encode(result);
+        if (code == 0 && !cache_key.empty())
+            JpegCache::shared().store_file(cache_key, options->output_path);
+    }
+    else
+    {
+        std::shared_ptr<SingleFlight::Flight> flight;
+        if (SingleFlight::shared().join(key, flight))
+        {
+            if (!cache_key.empty() && (result = JpegCache::shared().lookup(cache_key)))
+            {
+                code = 0;
+            }
+            else
+            {
+                code = encode(result);
+                if (code == 0 && !cache_key.empty())
+                    JpegCache::shared().store(cache_key, result->data(), result->size());
+            }
+            SingleFlight::shared().finish(flight, code, result);
+        }
+        else
+        {
+            debug_printf("waiting for the identical compression in flight.\n");
+            code = SingleFlight::wait(*flight, result);
+        }
+        if (code == 0)
+            notify_progress_v(context, PROGRESS_PASS_VECTOR_PTR, 0, new SharedBuffer(result));
+    }
+
+    if (code == 0)
+        debug_printf("compression succeeded.\n");
+    notify_progress(context, PROGRESS_PASS_EXITCODE, 0, code);
+}
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress(const unsigned char *p0, int width, int height, int stride, int input_cs, int quality, int dpi, void *context)
+{
+    jpeg_compress_options options;
+    jpeg_compress_options_init(&options);
+    options.quality = quality;
+    options.dpi = dpi;
+    jpeg_compress_ex(p0, width, height, stride, input_cs, &options, context);
+}
+
+/// Compresses the image directly into the file at [path] without building the whole output on memory.
+/// [policy] is combination of fd_dest_mgr::FD_DEST_POLICY_* flags.
+/// On success, the output file size is notified by PROGRESS_PASS_OUTPUT_FILESIZE.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress_file(const unsigned char *p0, int width, int height, int stride, int input_cs, int quality, int dpi, const char *path, int policy, void *context)
+{
+    jpeg_compress_options options;
+    jpeg_compress_options_init(&options);
+    options.quality = quality;
+    options.dpi = dpi;
+    options.output = JPEG_COMPRESS_OUTPUT_FILE;
+    options.output_path = path;
+    options.output_policy = policy;
+    jpeg_compress_ex(p0, width, height, stride, input_cs, &options, context);
+}
+
+// Compresses the image into the file at path synchronously without any notification (output/output_path of options are
+// ignored); returns the exit code. For the native modules that encode many images (e.g. tiles) by themselves.
+int jpeg_compress_to_path(const unsigned char *p0, int width, int height, int stride, int input_cs, const jpeg_compress_options *options, const char *path)
+{
+    if (!apply_crop(p0, width, height, stride, input_cs, *options) || !validate_parameters(width, height, stride, input_cs, *options))
+        return EXIT_FAILURE;
+    TempOutputFile file(path);
+    if (!file.open())
+        return EXIT_FAILURE;
+
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = debug_foward_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    int code = compress_pixels(&cinfo, p0, width, height, stride, input_cs, *options, [&](j_compress_ptr cinfo)
+                               { fd_dest_mgr::init(cinfo, file.fd(), fd_dest_mgr::DEFAULT_CHUNK_SIZE, options->output_policy); });
+    if (code == 0 && !file.commit())
+        code = EXIT_FAILURE;
+    return code;
+}
+
+/// Compresses the image and posts the encoded data to Dart by [chunk_size] bytes chunks (PROGRESS_PASS_CHUNK) as the encoder produces them.
+/// If [single_pass] is non-zero, baseline output is generated so that the chunks are posted during the encoding;
+/// otherwise the mozjpeg's multi-pass (progressive/optimized) output is posted at the end of the compression.
+/// On success, the total size is notified by PROGRESS_PASS_OUTPUT_FILESIZE.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress_stream(const unsigned char *p0, int width, int height, int stride, int input_cs, int quality, int dpi, int chunk_size, int single_pass, void *context)
+{
+    jpeg_compress_options options;
+    jpeg_compress_options_init(&options);
+    options.quality = quality;
+    options.dpi = dpi;
+    options.output = JPEG_COMPRESS_OUTPUT_STREAM;
+    options.chunk_size = chunk_size;
+    options.single_pass = single_pass;
+    jpeg_compress_ex(p0, width, height, stride, input_cs, &options, context);
+}
+
+/// Compresses the image into [count] outputs at once; options[i] specifies the size, quality and the output of the i-th result.
+/// The source is read only once; the resized images are cascaded from the smallest larger one already generated and
+/// all the outputs are encoded in parallel on the worker pool.
+/// Each vector result (JPEG_COMPRESS_OUTPUT_VECTOR) is notified by PROGRESS_PASS_VECTOR_PTR with totalPass=i, and
+/// each file result (JPEG_COMPRESS_OUTPUT_FILE) by PROGRESS_PASS_OUTPUT_FILESIZE with totalPass=i. The progress is notified
+/// with pass=<number of finished outputs> and totalPass=count. The exit code is non-zero if any of the outputs failed.
+/// The crop rectangle (options[i].crop_*) should be same for all the outputs.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress_ladder(const unsigned char *p0, int width, int height, int stride, int input_cs, const jpeg_compress_options *options, int count, void *context)
+{
+    // The source is cropped once for all the outputs
+    if (count > 0 && !apply_crop(p0, width, height, stride, input_cs, options[0]))
+    {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, 0, EXIT_FAILURE);
         return;
     }
+    for (int i = 0; i < count; i++)
+    {
+        const jpeg_compress_options &o = options[i];
+        if (o.crop_x != options[0].crop_x || o.crop_y != options[0].crop_y || o.crop_width != options[0].crop_width || o.crop_height != options[0].crop_height)
+        {
+            debug_printf("the crop rectangle should be same for all the outputs.\n");
+            notify_progress(context, PROGRESS_PASS_EXITCODE, 0, EXIT_FAILURE);
+            return;
+        }
+        if (!validate_parameters(width, height, stride, input_cs, o) || o.output == JPEG_COMPRESS_OUTPUT_STREAM)
+        {
+            notify_progress(context, PROGRESS_PASS_EXITCODE, 0, EXIT_FAILURE);
+            return;
+        }
+    }
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
-    debug_printf("compression succeeded.\n");
+    struct Level
+    {
+        int index; // index on options
+        int width, height; // in the source orientation; the transform is applied on encoding the level
+        const unsigned char *p0;
+        int stride;
+        std::vector<unsigned char> pixels; // empty if the level is the source itself
+        bool flattened;                    // the alpha is already composited over the background
+    };
+    std::vector<Level> levels(count);
+    for (int i = 0; i < count; i++)
+    {
+        levels[i].index = i;
+        resolve_target_size(width, height, options[i], levels[i].width, levels[i].height);
+        if (transposes(options[i].transform))
+            std::swap(levels[i].width, levels[i].height);
+    }
+    std::stable_sort(levels.begin(), levels.end(), [](const Level &a, const Level &b)
+                     { return (size_t)a.width * a.height > (size_t)b.width * b.height; });
+
+    // Generate the resized images from the largest; each one is downscaled from the smallest image which is not smaller than it.
+    // As in append_stages, the alpha is flattened before downscaling, so the images are shared only by the levels with the
+    // same alpha mode and background; each group of them is cascaded from the source separately.
+    const int components = comps[input_cs];
+    auto same_flattening = [&](const Level &a, const Level &b)
+    {
+        const jpeg_compress_options &x = options[a.index], &y = options[b.index];
+        return x.alpha_mode == y.alpha_mode && (x.alpha_mode == JPEG_COMPRESS_ALPHA_IGNORE || x.background == y.background);
+    };
+    for (size_t i = 0; i < levels.size(); i++)
+    {
+        Level &level = levels[i];
+        const Level *base = NULL;
+        for (size_t j = 0; j < i; j++)
+        {
+            const Level &l = levels[j];
+            if (same_flattening(l, level) && l.width >= level.width && l.height >= level.height &&
+                (!base || (size_t)l.width * l.height < (size_t)base->width * base->height))
+                base = &l;
+        }
+        const unsigned char *base_p0 = base ? base->p0 : p0;
+        const int base_width = base ? base->width : width;
+        const int base_height = base ? base->height : height;
+        const int base_stride = base ? base->stride : stride;
+        if (level.width == base_width && level.height == base_height)
+        {
+            level.p0 = base_p0;
+            level.stride = base_stride;
+            level.flattened = base && base->flattened;
+            continue;
+        }
 
-    std::vector<unsigned char> *pVector = new std::vector<unsigned char>(std::move(outbuffer));
-    notify_progress_v(progress.context, PROGRESS_PASS_VECTOR_PTR, 0, pVector);
-    post_progress_monitor((j_common_ptr)&cinfo, PROGRESS_PASS_EXITCODE, 0, 0);
+        jpeg_compress_options opts = options[level.index];
+        if (base && base->flattened)
+            opts.alpha_mode = JPEG_COMPRESS_ALPHA_IGNORE;
+        std::vector<std::unique_ptr<RowSource>> stages;
+        stages.emplace_back(new MemoryRowSource(base_p0, base_width, base_height, base_stride, components));
+        append_stages(stages, input_cs, opts, level.width, level.height);
+        level.flattened = options[level.index].alpha_mode != JPEG_COMPRESS_ALPHA_IGNORE;
+        level.stride = level.width * components;
+        level.pixels.resize((size_t)level.stride * level.height);
+        for (int y = 0; y < level.height; y++)
+            memcpy(&level.pixels[(size_t)level.stride * y], stages.back()->next_row(), level.stride);
+        level.p0 = level.pixels.data();
+    }
+
+    std::atomic<int> exit_code(0);
+    std::atomic<int> finished(0);
+    WorkerPool::shared().parallel_for(levels.size(), [&](size_t i)
+                                      {
+        const Level &level = levels[i];
+        jpeg_compress_options opts = options[level.index];
+        opts.target_width = opts.target_height = 0;
+        opts.crop_x = opts.crop_y = opts.crop_width = opts.crop_height = 0;
+        if (level.flattened)
+            opts.alpha_mode = JPEG_COMPRESS_ALPHA_IGNORE;
+
+        jpeg_compress_struct cinfo;
+        jpeg_error_mgr jsrcerr;
+        cinfo.err = debug_foward_error(&jsrcerr);
+        jpeg_create_compress(&cinfo);
+
+        int code;
+        if (opts.output == JPEG_COMPRESS_OUTPUT_FILE)
+        {
+            TempOutputFile file(opts.output_path);
+            if (!file.open())
+            {
+                jpeg_destroy_compress(&cinfo);
+                code = EXIT_FAILURE;
+            }
+            else
+            {
+                code = compress_pixels(&cinfo, level.p0, level.width, level.height, level.stride, input_cs, opts, [&](j_compress_ptr cinfo)
+                                       { fd_dest_mgr::init(cinfo, file.fd(), fd_dest_mgr::DEFAULT_CHUNK_SIZE, opts.output_policy); });
+                size_t size = code == 0 ? file.size() : 0;
+                if (code == 0 && !file.commit())
+                    code = EXIT_FAILURE;
+                if (code == 0)
+                    notify_progress(context, PROGRESS_PASS_OUTPUT_FILESIZE, level.index, size);
+            }
+        }
+        else
+        {
+            std::vector<unsigned char> outbuffer;
+            code = compress_pixels(&cinfo, level.p0, level.width, level.height, level.stride, input_cs, opts, [&](j_compress_ptr cinfo)
+                                   { vector_dest_mgr::init(cinfo, outbuffer); });
+            if (code == 0)
+                notify_progress_v(context, PROGRESS_PASS_VECTOR_PTR, level.index, new SharedBuffer(std::make_shared<VectorEncodedData>(std::move(outbuffer))));
+        }
+
+        if (code != 0)
+        {
+            int expected = 0;
+            exit_code.compare_exchange_strong(expected, code);
+        }
+        notify_progress(context, ++finished, (int)levels.size(), 100); });
+
+    notify_progress(context, PROGRESS_PASS_EXITCODE, 0, exit_code);
 }
 
+// Estimates the IJG quality of the JPEG from the luma (the first component) and chroma (the second one) tables as
+// jpeg_probe does; returns -1 if the tables are not available.
+static int estimate_input_quality(j_decompress_ptr srcinfo)
+{
+    const JQUANT_TBL *luma = srcinfo->quant_tbl_ptrs[srcinfo->comp_info[0].quant_tbl_no];
+    if (!luma)
+        return -1;
+    const JQUANT_TBL *chroma = srcinfo->num_components >= 3 ? srcinfo->quant_tbl_ptrs[srcinfo->comp_info[1].quant_tbl_no] : NULL;
+    unsigned short luma_table[DCTSIZE2], chroma_table[DCTSIZE2];
+    for (int i = 0; i < DCTSIZE2; i++)
+    {
+        luma_table[i] = luma->quantval[i];
+        chroma_table[i] = chroma ? chroma->quantval[i] : 0;
+    }
+    return jpeg_estimate_quality(luma_table, chroma ? chroma_table : NULL);
+}
+
+// Re-encodes the DCT coefficients of the JPEG without decoding (same as jpegtran -copy all); the entropy coding is
+// optimized and the output is progressive unless options.single_pass. cinfo is destroyed on return.
+template <typename DestInit>
+static int transcode_coefficients(j_decompress_ptr srcinfo, const unsigned char *data, size_t size, j_compress_ptr cinfo, const jpeg_compress_options &options, DestInit init_dest)
+{
+    try
+    {
+        jvirt_barray_ptr *coef_arrays = jpeg_read_coefficients_parallel(srcinfo, data, size);
+        init_dest(cinfo);
+        jpeg_c_set_int_param(cinfo, JINT_COMPRESS_PROFILE, JCP_MAX_COMPRESSION);
+        jpeg_copy_critical_parameters(srcinfo, cinfo);
+        cinfo->optimize_coding = TRUE;
+        if (options.single_pass)
+        {
+            cinfo->num_scans = 0;
+            cinfo->scan_info = NULL;
+            jpeg_c_set_bool_param(cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
+        }
+        else
+        {
+            jpeg_simple_progression(cinfo);
+        }
+        jpeg_write_coefficients(cinfo, coef_arrays);
+        jcopy_markers_execute(srcinfo, cinfo, JCOPYOPT_ALL);
+        jpeg_finish_compress(cinfo);
+    }
+    catch (int code)
+    {
+        debug_printf("Woops, exit_code=%d\n", code);
+        jpeg_destroy_compress(cinfo);
+        return code;
+    }
+    jpeg_destroy_compress(cinfo);
+    return 0;
+}
+
+// Decodes the JPEG (using the DCT scaling for large downscaling) and encodes it again with the options; a JPEG with
+// restart markers is decoded by bands on the worker pool. cinfo is destroyed on return.
+template <typename DestInit>
+static int recompress_pixels(j_decompress_ptr srcinfo, const unsigned char *data, size_t size, j_compress_ptr cinfo, int target_width, int target_height, const jpeg_compress_options &options, DestInit init_dest)
+{
+    int input_cs;
+    JpegSegments segments;
+    bool parallel;
+    std::vector<std::unique_ptr<RowSource>> stages;
+    try
+    {
+        // The largest reduction by the decoder that still keeps the image larger than the target
+        srcinfo->scale_num = 1;
+        srcinfo->scale_denom = 1;
+        for (unsigned int denom = 8; denom > 1; denom /= 2)
+        {
+            if ((srcinfo->image_width + denom - 1) / denom >= (JDIMENSION)target_width && (srcinfo->image_height + denom - 1) / denom >= (JDIMENSION)target_height)
+            {
+                srcinfo->scale_denom = denom;
+                break;
+            }
+        }
+        switch (srcinfo->jpeg_color_space)
+        {
+        case JCS_GRAYSCALE:
+            srcinfo->out_color_space = JCS_GRAYSCALE;
+            break;
+        case JCS_CMYK:
+        case JCS_YCCK:
+            srcinfo->out_color_space = JCS_CMYK;
+            break;
+        default:
+            srcinfo->out_color_space = JCS_RGB;
+            break;
+        }
+        input_cs = srcinfo->out_color_space;
+        parallel = JpegSegments::worth_splitting(srcinfo) && segments.parse(data, size);
+        if (parallel)
+            jpeg_calc_output_dimensions(srcinfo);
+        else
+            jpeg_start_decompress(srcinfo);
+    }
+    catch (int code)
+    {
+        jpeg_destroy_compress(cinfo);
+        return code;
+    }
+
+    if (parallel)
+        stages.emplace_back(new ParallelDecoderRowSource(srcinfo, segments));
+    else
+        stages.emplace_back(new DecoderRowSource(srcinfo));
+    append_stages(stages, input_cs, options, target_width, target_height);
+    return compress_image(cinfo, *stages.back(), input_cs, options, init_dest, srcinfo);
+}
+
+/// Recompresses the JPEG data with [options] (quality, size and output); if the IJG quality of the input estimated by
+/// jpeg_estimate_quality is at or below the target quality and no resizing is requested, the image is not decoded but
+/// only losslessly optimized like jpegtran, and if the optimized result is larger than the input, the input is delivered
+/// as is.
+/// The result is delivered as same as jpeg_compress_ex (without the single-flight and the cache) with totalPass set to
+/// PROGRESS_TPASS_RECOMPRESSED (decoded and encoded again), PROGRESS_TPASS_OPTIMIZED (losslessly optimized) or
+/// PROGRESS_TPASS_ORIGINAL (the input as is). The markers of the input (EXIF, ICC profile etc.) are kept on both paths.
+/// The alpha options, the transform and the crop are ignored (use jpegtran for the lossless transforms/crop).
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_recompress(const unsigned char *data, size_t size, const jpeg_compress_options *options, void *context)
+{
+    jpeg_decompress_struct srcinfo;
+    jpeg_error_mgr jsrcerr;
+    srcinfo.err = debug_foward_error(&jsrcerr);
+
+    int code;
+    try
+    {
+        jpeg_create_decompress(&srcinfo);
+        jpeg_mem_src(&srcinfo, data, (unsigned long)size);
+        jcopy_markers_setup(&srcinfo, JCOPYOPT_ALL);
+        jpeg_read_header(&srcinfo, TRUE);
+        code = 0;
+    }
+    catch (int exit_code)
+    {
+        code = exit_code != 0 ? exit_code : EXIT_FAILURE;
+    }
+
+    jpeg_compress_options opts = *options;
+    opts.alpha_mode = JPEG_COMPRESS_ALPHA_IGNORE;
+    opts.transform = JPEG_COMPRESS_TRANSFORM_NONE;
+    int target_width = 0, target_height = 0;
+    if (code == 0 && !resolve_target_size((int)srcinfo.image_width, (int)srcinfo.image_height, opts, target_width, target_height))
+    {
+        debug_printf("target size %dx%d exceeds the image size %dx%d.\n", target_width, target_height, srcinfo.image_width, srcinfo.image_height);
+        code = EXIT_FAILURE;
+    }
+
+    if (code == 0)
+    {
+        const bool resize = target_width != (int)srcinfo.image_width || target_height != (int)srcinfo.image_height;
+        // Recompressing an input already at (or below) the target quality only loses the quality without reducing the size
+        const int input_quality = estimate_input_quality(&srcinfo);
+        const bool lossless = !resize && input_quality >= 0 && input_quality <= opts.quality;
+        debug_printf("input quality is about %d; %s.\n", input_quality, lossless ? "optimizing losslessly" : "recompressing");
+
+        int tpass = lossless ? PROGRESS_TPASS_OPTIMIZED : PROGRESS_TPASS_RECOMPRESSED;
+        SharedBuffer result;
+        code = encode_to_output(opts, context, tpass, result, lossless ? data : NULL, size, [&](auto init_dest)
+                                {
+                                    jpeg_compress_struct cinfo;
+                                    jpeg_error_mgr jdsterr;
+                                    cinfo.err = debug_foward_error(&jdsterr);
+                                    jpeg_create_compress(&cinfo);
+                                    cdjpeg_progress_mgr progress;
+                                    start_progress_monitor((j_common_ptr)&cinfo, &progress, context);
+                                    if (lossless)
+                                        return transcode_coefficients(&srcinfo, data, size, &cinfo, opts, init_dest);
+                                    return recompress_pixels(&srcinfo, data, size, &cinfo, target_width, target_height, opts, init_dest); });
+        if (code == 0 && result)
+            notify_progress_v(context, PROGRESS_PASS_VECTOR_PTR, tpass, new SharedBuffer(result));
+    }
+
+    jpeg_destroy_decompress(&srcinfo);
+    notify_progress(context, PROGRESS_PASS_EXITCODE, 0, code);
+}
+
+// The handle posted by PROGRESS_PASS_VECTOR_PTR is a SharedBuffer*; each handle holds a reference to the result,
+// which may be shared with other requests.
 extern "C" __attribute__((visibility("default"))) __attribute__((used)) void *jpeg_compress_get_ptr(void *p)
 {
     if (!p)
         return NULL;
-    std::vector<unsigned char> &v = *(std::vector<unsigned char> *)p;
-    return v.data();
+    return (void *)(*(SharedBuffer *)p)->data();
 }
 
 extern "C" __attribute__((visibility("default"))) __attribute__((used)) size_t jpeg_compress_get_size(void *p)
 {
     if (!p)
         return -1;
-    std::vector<unsigned char> &v = *(std::vector<unsigned char> *)p;
-    return v.size();
+    return (*(SharedBuffer *)p)->size();
 }
 
 extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress_release(void *p)
 {
     if (p)
-        delete (std::vector<unsigned char> *)p;
+        delete (SharedBuffer *)p;
 }
 
-#include <pthread.h>
+#include <functional>
 
-class JpegCompressParams
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress_threaded(const unsigned char *p0, int width, int height, int stride, int input_cs, int quality, int dpi, void *context)
 {
-public:
-    JpegCompressParams(const unsigned char *p0, int width, int height, int stride, int input_cs, int quality, int dpi, void *context) : p0(p0), width(width), height(height), stride(stride), input_cs(input_cs), quality(quality), dpi(dpi), context(context)
+    if (!run_detached([=]()
+                      { jpeg_compress(p0, width, height, stride, input_cs, quality, dpi, context); }))
     {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, -1, -1); // error
     }
+}
 
-    void fireAndForget()
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress_file_threaded(const unsigned char *p0, int width, int height, int stride, int input_cs, int quality, int dpi, const char *path, int policy, void *context)
+{
+    std::string pathCopy(path);
+    if (!run_detached([=]()
+                      { jpeg_compress_file(p0, width, height, stride, input_cs, quality, dpi, pathCopy.c_str(), policy, context); }))
     {
-        pthread_t t;
-        if (pthread_create(&t, NULL, s_start, (void *)this) != 0)
-        {
-            notify_progress(context, PROGRESS_PASS_EXITCODE, -1, -1); // error
-        }
+        notify_progress(context, PROGRESS_PASS_EXITCODE, -1, -1); // error
     }
+}
 
-private:
-    const unsigned char *p0;
-    int width;
-    int height;
-    int stride;
-    int input_cs;
-    int quality;
-    int dpi;
-    void *context;
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress_stream_threaded(const unsigned char *p0, int width, int height, int stride, int input_cs, int quality, int dpi, int chunk_size, int single_pass, void *context)
+{
+    if (!run_detached([=]()
+                      { jpeg_compress_stream(p0, width, height, stride, input_cs, quality, dpi, chunk_size, single_pass, context); }))
+    {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, -1, -1); // error
+    }
+}
 
-    static void *s_start(void *param)
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress_ex_threaded(const unsigned char *p0, int width, int height, int stride, int input_cs, const jpeg_compress_options *options, void *context)
+{
+    // options (and the strings) are copied; the caller may release them immediately
+    jpeg_compress_options opts = *options;
+    std::string path(options->output_path ? options->output_path : "");
+    std::string dedupe_key(options->dedupe_key ? options->dedupe_key : "");
+    const bool has_dedupe_key = options->dedupe_key != NULL;
+    if (!run_detached([=]()
+                      {
+                          jpeg_compress_options o = opts;
+                          o.output_path = path.c_str();
+                          o.dedupe_key = has_dedupe_key ? dedupe_key.c_str() : NULL;
+                          jpeg_compress_ex(p0, width, height, stride, input_cs, &o, context); }))
     {
-        JpegCompressParams &jcp = *(JpegCompressParams *)param;
-        jpeg_compress(jcp.p0, jcp.width, jcp.height, jcp.stride, jcp.input_cs, jcp.quality, jcp.dpi, jcp.context);
-        delete &jcp;
-        return 0;
+        notify_progress(context, PROGRESS_PASS_EXITCODE, -1, -1); // error
     }
-};
+}
 
-extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress_threaded(const unsigned char *p0, int width, int height, int stride, int input_cs, int quality, int dpi, void *context)
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_compress_ladder_threaded(const unsigned char *p0, int width, int height, int stride, int input_cs, const jpeg_compress_options *options, int count, void *context)
 {
-    JpegCompressParams *jcp = new JpegCompressParams(p0, width, height, stride, input_cs, quality, dpi, context);
-    jcp->fireAndForget();
+    // options (and the paths) are copied; the caller may release them immediately
+    std::vector<jpeg_compress_options> opts(options, options + count);
+    std::vector<std::string> paths;
+    for (int i = 0; i < count; i++)
+        paths.push_back(options[i].output_path ? options[i].output_path : "");
+    if (!run_detached([=]() mutable
+                      {
+                          for (int i = 0; i < count; i++)
+                          {
+                              opts[i].output_path = paths[i].c_str();
+                              opts[i].dedupe_key = NULL; // not used by the ladder
+                          }
+                          jpeg_compress_ladder(p0, width, height, stride, input_cs, opts.data(), count, context); }))
+    {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, -1, -1); // error
+    }
+}
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_recompress_threaded(const unsigned char *data, size_t size, const jpeg_compress_options *options, void *context)
+{
+    // options (and the path) are copied; the caller may release them immediately
+    jpeg_compress_options opts = *options;
+    std::string path(options->output_path ? options->output_path : "");
+    if (!run_detached([=]()
+                      {
+                          jpeg_compress_options o = opts;
+                          o.output_path = path.c_str();
+                          o.dedupe_key = NULL; // not used by recompress
+                          jpeg_recompress(data, size, &o, context); }))
+    {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, -1, -1); // error
+    }
 }
@@ -0,0 +1,88 @@
+#ifndef _jpegcompress_h_
+#define _jpegcompress_h_
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+    enum
+    {
+        // Values for jpeg_compress_options.output
+        JPEG_COMPRESS_OUTPUT_VECTOR = 0, // result handle is posted by PROGRESS_PASS_VECTOR_PTR; see jpeg_compress_get_ptr
+        JPEG_COMPRESS_OUTPUT_FILE = 1,   // written to output_path; the size is posted by PROGRESS_PASS_OUTPUT_FILESIZE
+        JPEG_COMPRESS_OUTPUT_STREAM = 2, // posted by chunk_size chunks with PROGRESS_PASS_CHUNK
+
+        // Values for jpeg_compress_options.alpha_mode
+        JPEG_COMPRESS_ALPHA_IGNORE = 0,        // the 4th byte is just ignored (legacy behavior)
+        JPEG_COMPRESS_ALPHA_STRAIGHT = 1,      // composite straight alpha pixels over the background
+        JPEG_COMPRESS_ALPHA_PREMULTIPLIED = 2, // composite premultiplied alpha pixels over the background
+
+        // Values for jpeg_compress_options.transform; same as JXFORM_CODE of transupp.h
+        JPEG_COMPRESS_TRANSFORM_NONE = 0,
+        JPEG_COMPRESS_TRANSFORM_FLIP_H = 1,     // mirror left-right
+        JPEG_COMPRESS_TRANSFORM_FLIP_V = 2,     // mirror top-bottom
+        JPEG_COMPRESS_TRANSFORM_TRANSPOSE = 3,  // mirror across the upper-left to lower-right axis
+        JPEG_COMPRESS_TRANSFORM_TRANSVERSE = 4, // mirror across the upper-right to lower-left axis
+        JPEG_COMPRESS_TRANSFORM_ROT_90 = 5,     // 90 degrees clockwise
+        JPEG_COMPRESS_TRANSFORM_ROT_180 = 6,
+        JPEG_COMPRESS_TRANSFORM_ROT_270 = 7,
+    };
+
+    // Options for jpeg_compress_ex; the layout is shared with _JpegCompressOptions on the Dart side.
+    typedef struct jpeg_compress_options
+    {
+        int quality;             // JPEG quality in [0 - 100]
+        int dpi;                 // density written to the JFIF header
+        int output;              // JPEG_COMPRESS_OUTPUT_*
+        int output_policy;       // fd_dest_mgr::FD_DEST_POLICY_* for JPEG_COMPRESS_OUTPUT_FILE
+        const char *output_path; // for JPEG_COMPRESS_OUTPUT_FILE
+        int chunk_size;          // for JPEG_COMPRESS_OUTPUT_STREAM; 0 for the default
+        int single_pass;         // non-zero to generate baseline output in a single pass
+        int target_width;        // output size; if either is 0, it's calculated from the other one keeping the aspect ratio
+        int target_height;       // if both are 0, the image is not resized
+        int alpha_mode;          // JPEG_COMPRESS_ALPHA_*; only for 4-byte pixel layouts; the X byte of extRGBX etc. is the alpha
+        int background;          // background color for alpha compositing in 0xRRGGBB
+        const char *dedupe_key;  // identity of the input pixels to coalesce identical concurrent requests and to look up
+                                 // the persistent cache without hashing the pixels; NULL to hash them. It should change
+                                 // whenever the content changes (e.g. include the file modification time).
+        int transform;           // JPEG_COMPRESS_TRANSFORM_*; applied to the pixels on reading them, before the alpha
+                                 // compositing and the resizing (target_width/target_height are of the transformed image)
+        int crop_x, crop_y;      // rectangle of the source pixels to encode (before the transform); the rows are addressed
+        int crop_width;          // in place from p0 without copying. 0 for crop_width/crop_height means up to the right/
+        int crop_height;         // bottom edge, so all zeros encodes the whole image
+    } jpeg_compress_options;
+
+    void jpeg_compress_options_init(jpeg_compress_options *options);
+    int jpeg_compress_to_path(const unsigned char *p0, int width, int height, int stride, int input_cs, const jpeg_compress_options *options, const char *path);
+
+#if defined(__cplusplus)
+}
+
+#include <stddef.h>
+#include <memory>
+#include <vector>
+
+class RowSource;
+
+// Bytes per pixel of the color space; 0 if the color space is not supported.
+int jpeg_compress_components(int input_cs);
+
+// The first stage that reads the pixels on memory applying transform (JPEG_COMPRESS_TRANSFORM_*); the size of the stage
+// is swapped from width/height by the transposing transforms.
+RowSource *new_memory_row_source(const unsigned char *p0, int width, int height, int stride, int input_cs, int transform);
+
+// Appends the stages (alpha flattening and downscaling) that convert the rows of stages.back() for the encoder.
+void append_stages(std::vector<std::unique_ptr<RowSource>> &stages, int input_cs, const jpeg_compress_options &options, int target_width, int target_height);
+
+// Applies the crop of options to width/height and validates the parameters on the cropped source; the byte offset of
+// the cropped rectangle from p0 is stored to offset and the output size (of the transformed image) to
+// target_width/target_height. Returns false if any of the parameters is invalid.
+bool jpeg_compress_resolve_source(int &width, int &height, int stride, int input_cs, const jpeg_compress_options &options, ptrdiff_t &offset, int &target_width, int &target_height);
+
+// Sets the encoding parameters of options (quality, dpi, single_pass) for the encoder input of width x height pixels
+// of input_cs; the same parameters always produce the same quantization/Huffman tables.
+void jpeg_compress_setup(struct jpeg_compress_struct *cinfo, int width, int height, int input_cs, const jpeg_compress_options &options);
+#endif
+
+#endif /* _jpegcompress_h_ */
@@ -0,0 +1,370 @@
+#include "cdjpeg.h"
+#include "cdjapi.h"
+#include "jconfigint.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "vector_dest_mgr.h"
+#include "fd_dest_mgr.h"
+#include "encoded_data.h"
+#include "content_hash.h"
+#include "file_io.h"
+#include "row_source.h"
+#include "jpegframe.h"
+#include "worker_pool.h"
+
+class JpegFrameEncoder
+{
+public:
+    JpegFrameEncoder(int width, int height, int stride, int input_cs, const jpeg_compress_options &options)
+        : width(width), height(height), stride(stride), input_cs(input_cs), options(options), has_previous(false)
+    {
+        this->options.output_path = NULL;
+        this->options.dedupe_key = NULL;
+    }
+
+    // Validates the parameters and lays out the MCU grid of the encoder input.
+    bool init()
+    {
+        source_width = width;
+        source_height = height;
+        if (!jpeg_compress_resolve_source(source_width, source_height, stride, input_cs, options, offset, target_width, target_height))
+            return false;
+        components = jpeg_compress_components(input_cs);
+
+        // The sampling factors are determined by the parameters
+        jpeg_compress_struct cinfo;
+        jpeg_error_mgr jerr;
+        cinfo.err = debug_foward_error(&jerr);
+        try
+        {
+            jpeg_create_compress(&cinfo);
+            jpeg_compress_setup(&cinfo, target_width, target_height, input_cs, options);
+        }
+        catch (int code)
+        {
+            debug_printf("failed to set up the encoder: exit_code=%d\n", code);
+            jpeg_destroy_compress(&cinfo);
+            return false;
+        }
+        num_components = cinfo.num_components;
+        int max_h = 1, max_v = 1;
+        for (int ci = 0; ci < num_components; ci++)
+        {
+            // A single component image is not interleaved; its MCU is a block regardless of the sampling factors
+            h_samp[ci] = num_components == 1 ? 1 : cinfo.comp_info[ci].h_samp_factor;
+            v_samp[ci] = num_components == 1 ? 1 : cinfo.comp_info[ci].v_samp_factor;
+            max_h = std::max(max_h, h_samp[ci]);
+            max_v = std::max(max_v, v_samp[ci]);
+        }
+        jpeg_destroy_compress(&cinfo);
+
+        mcu_width = max_h * DCTSIZE;
+        mcu_height = max_v * DCTSIZE;
+        mcu_columns = (target_width + mcu_width - 1) / mcu_width;
+        mcu_rows = (target_height + mcu_height - 1) / mcu_height;
+        hashes.assign((size_t)mcu_columns * mcu_rows, 0);
+        for (int ci = 0; ci < num_components; ci++)
+            blocks[ci].resize((size_t)mcu_columns * h_samp[ci] * mcu_rows * v_samp[ci] * DCTSIZE2);
+        return true;
+    }
+
+    // Encodes the frame into output_path (or on memory if it's NULL); returns the exit code.
+    int encode(const unsigned char *p0, const char *output_path, void *context)
+    {
+        // Pull the encoder input and hash it by MCUs; the input is kept to encode the changed MCUs from it
+        std::vector<std::unique_ptr<RowSource>> stages;
+        stages.emplace_back(new_memory_row_source(p0 + offset, source_width, source_height, stride, input_cs, options.transform));
+        append_stages(stages, input_cs, options, target_width, target_height);
+        const bool direct = stages.size() == 1 && options.transform == JPEG_COMPRESS_TRANSFORM_NONE;
+        const size_t row_bytes = (size_t)target_width * components;
+        if (!direct)
+            pixels.resize(row_bytes * target_height);
+        const unsigned char *base = direct ? p0 + offset : pixels.data();
+        const ptrdiff_t pitch = direct ? (ptrdiff_t)stride : (ptrdiff_t)row_bytes;
+
+        std::vector<char> changed(hashes.size(), 0);
+        int changed_count = 0;
+        std::vector<ContentHash> mcu_hashes;
+        for (int y = 0; y < target_height; y++)
+        {
+            const unsigned char *row = stages.back()->next_row();
+            if (!direct)
+                memcpy(pixels.data() + row_bytes * y, row, row_bytes);
+            if (y % mcu_height == 0)
+                mcu_hashes.assign(mcu_columns, ContentHash());
+            const size_t mcu_bytes = (size_t)mcu_width * components;
+            for (int c = 0; c < mcu_columns; c++)
+                mcu_hashes[c].update(row + mcu_bytes * c, std::min(mcu_bytes, row_bytes - mcu_bytes * c));
+            if (y % mcu_height == mcu_height - 1 || y == target_height - 1)
+            {
+                const size_t first = (size_t)(y / mcu_height) * mcu_columns;
+                for (int c = 0; c < mcu_columns; c++)
+                {
+                    const uint64_t h = mcu_hashes[c].digest64();
+                    if (!has_previous || hashes[first + c] != h)
+                    {
+                        changed[first + c] = 1;
+                        changed_count++;
+                    }
+                    hashes[first + c] = h;
+                }
+            }
+        }
+        // Until this frame succeeds, the coefficients don't match the hashes
+        has_previous = false;
+
+        // Re-encode the changed MCUs; the consecutive MCU rows with changes are merged into a rectangle of their spans
+        int r0 = -1, c0 = 0, c1 = 0;
+        for (int r = 0; r <= mcu_rows; r++)
+        {
+            int first = mcu_columns, last = -1;
+            for (int c = 0; r < mcu_rows && c < mcu_columns; c++)
+            {
+                if (changed[(size_t)r * mcu_columns + c])
+                {
+                    first = std::min(first, c);
+                    last = c;
+                }
+            }
+            if (last >= 0)
+            {
+                if (r0 < 0)
+                    r0 = r, c0 = first, c1 = last;
+                else
+                    c0 = std::min(c0, first), c1 = std::max(c1, last);
+                continue;
+            }
+            if (r0 >= 0)
+            {
+                const int code = encode_region(base, pitch, c0, r0, c1 - c0 + 1, r - r0);
+                if (code != 0)
+                    return code;
+                r0 = -1;
+            }
+        }
+        notify_progress(context, changed_count, (int)hashes.size(), 100);
+
+        int code;
+        if (output_path)
+        {
+            // The frames are usually rewritten to the same path; the previous frame stays readable until the new one
+            // is complete
+            TempOutputFile file(output_path);
+            if (!file.open())
+                return EXIT_FAILURE;
+            code = write_frame([&](j_compress_ptr cinfo)
+                               { fd_dest_mgr::init(cinfo, file.fd(), fd_dest_mgr::DEFAULT_CHUNK_SIZE, options.output_policy); });
+            const size_t size = code == 0 ? file.size() : 0;
+            if (code == 0 && !file.commit())
+                code = EXIT_FAILURE;
+            if (code == 0)
+                notify_progress(context, PROGRESS_PASS_OUTPUT_FILESIZE, PROGRESS_TPASS_OPTIMIZED, size);
+        }
+        else
+        {
+            std::vector<unsigned char> outbuffer;
+            code = write_frame([&](j_compress_ptr cinfo)
+                               { vector_dest_mgr::init(cinfo, outbuffer); });
+            if (code == 0)
+                notify_progress_v(context, PROGRESS_PASS_VECTOR_PTR, 0, new SharedBuffer(std::make_shared<VectorEncodedData>(std::move(outbuffer))));
+        }
+        has_previous = code == 0;
+        return code;
+    }
+
+private:
+    const int width, height, stride, input_cs;
+    jpeg_compress_options options;
+    int source_width, source_height; // after the crop
+    ptrdiff_t offset;                // of the crop from p0
+    int target_width, target_height;
+    int components;
+
+    int num_components;
+    int h_samp[MAX_COMPONENTS], v_samp[MAX_COMPONENTS]; // in blocks per MCU
+    int mcu_width, mcu_height;                          // in pixels
+    int mcu_columns, mcu_rows;
+
+    bool has_previous;                // whether hashes/blocks are of the previous frame
+    std::vector<uint64_t> hashes;     // of the encoder input by MCUs in raster order
+    std::vector<JCOEF> blocks[MAX_COMPONENTS]; // quantized coefficients of the whole frame padded to the MCUs
+    std::vector<unsigned char> pixels; // encoder input if it's not read in place
+
+    // Encodes the rectangle of MCUs and stores its quantized coefficients into blocks; returns the exit code.
+    int encode_region(const unsigned char *base, ptrdiff_t pitch, int column, int row, int columns, int rows)
+    {
+        const int x0 = column * mcu_width;
+        const int y0 = row * mcu_height;
+        const int w = std::min(columns * mcu_width, target_width - x0);
+        const int h = std::min(rows * mcu_height, target_height - y0);
+        MemoryRowSource src(base + pitch * y0 + (ptrdiff_t)x0 * components, w, h, (int)pitch, components);
+
+        // The region is encoded as a small JPEG; its edges are on the MCU boundaries (or the image edges), so that the
+        // color conversion, downsampling and DCT produce the same blocks as the whole frame.
+        std::vector<unsigned char> jpeg;
+        jpeg_compress_struct cinfo;
+        jpeg_error_mgr jerr;
+        cinfo.err = debug_foward_error(&jerr);
+        try
+        {
+            jpeg_create_compress(&cinfo);
+            vector_dest_mgr::init(&cinfo, jpeg);
+            jpeg_compress_setup(&cinfo, w, h, input_cs, options);
+            // Only the coefficients are used. The DC trellis couples the neighboring blocks, which can't be kept
+            // across the reused ones.
+            cinfo.num_scans = 0;
+            cinfo.scan_info = NULL;
+            cinfo.optimize_coding = FALSE;
+            jpeg_c_set_bool_param(&cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
+            jpeg_c_set_bool_param(&cinfo, JBOOLEAN_TRELLIS_QUANT_DC, FALSE);
+            jpeg_start_compress(&cinfo, TRUE);
+            for (int y = 0; y < h; y++)
+            {
+                const unsigned char *pLine = src.next_row();
+                jpeg_write_scanlines(&cinfo, (JSAMPARRAY)&pLine, 1);
+            }
+            jpeg_finish_compress(&cinfo);
+        }
+        catch (int code)
+        {
+            debug_printf("Woops, exit_code=%d\n", code);
+            jpeg_destroy_compress(&cinfo);
+            return code != 0 ? code : EXIT_FAILURE;
+        }
+        jpeg_destroy_compress(&cinfo);
+
+        jpeg_decompress_struct dinfo;
+        jpeg_error_mgr djerr;
+        dinfo.err = debug_foward_error(&djerr);
+        try
+        {
+            jpeg_create_decompress(&dinfo);
+            jpeg_mem_src(&dinfo, jpeg.data(), (unsigned long)jpeg.size());
+            jpeg_read_header(&dinfo, TRUE);
+            jvirt_barray_ptr *coef_arrays = jpeg_read_coefficients(&dinfo);
+            for (int ci = 0; ci < num_components; ci++)
+            {
+                const size_t cols = (size_t)mcu_columns * h_samp[ci];
+                const size_t rows_in_blocks = (size_t)mcu_rows * v_samp[ci];
+                const size_t x_blocks = (size_t)column * h_samp[ci];
+                const size_t copy_cols = std::min((size_t)columns * h_samp[ci], cols - x_blocks);
+                for (int by = 0; by < rows * v_samp[ci]; by += v_samp[ci])
+                {
+                    JBLOCKARRAY src_blocks = (*dinfo.mem->access_virt_barray)((j_common_ptr)&dinfo, coef_arrays[ci], (JDIMENSION)by, (JDIMENSION)v_samp[ci], FALSE);
+                    for (int k = 0; k < v_samp[ci]; k++)
+                    {
+                        const size_t dy = (size_t)row * v_samp[ci] + by + k;
+                        if (dy < rows_in_blocks)
+                            memcpy(&blocks[ci][(dy * cols + x_blocks) * DCTSIZE2], src_blocks[k], copy_cols * sizeof(JBLOCK));
+                    }
+                }
+            }
+            jpeg_finish_decompress(&dinfo);
+        }
+        catch (int code)
+        {
+            debug_printf("Woops, exit_code=%d\n", code);
+            jpeg_destroy_decompress(&dinfo);
+            return code != 0 ? code : EXIT_FAILURE;
+        }
+        jpeg_destroy_decompress(&dinfo);
+        return 0;
+    }
+
+    // Entropy codes the whole frame from blocks into the destination installed by init_dest; returns the exit code.
+    template <typename DestInit>
+    int write_frame(DestInit init_dest)
+    {
+        jpeg_compress_struct cinfo;
+        jpeg_error_mgr jerr;
+        cinfo.err = debug_foward_error(&jerr);
+        try
+        {
+            jpeg_create_compress(&cinfo);
+            init_dest(&cinfo);
+            jpeg_compress_setup(&cinfo, target_width, target_height, input_cs, options);
+            if (!options.single_pass)
+            {
+                jpeg_c_set_bool_param(&cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
+                jpeg_simple_progression(&cinfo);
+            }
+
+            jvirt_barray_ptr coef_arrays[MAX_COMPONENTS];
+            for (int ci = 0; ci < num_components; ci++)
+            {
+                coef_arrays[ci] = (*cinfo.mem->request_virt_barray)((j_common_ptr)&cinfo, JPOOL_IMAGE, FALSE,
+                                                                    (JDIMENSION)(mcu_columns * h_samp[ci]),
+                                                                    (JDIMENSION)(mcu_rows * v_samp[ci]), (JDIMENSION)v_samp[ci]);
+            }
+            jpeg_write_coefficients(&cinfo, coef_arrays);
+            for (int ci = 0; ci < num_components; ci++)
+            {
+                const size_t cols = (size_t)mcu_columns * h_samp[ci];
+                for (int by = 0; by < mcu_rows * v_samp[ci]; by += v_samp[ci])
+                {
+                    JBLOCKARRAY dst = (*cinfo.mem->access_virt_barray)((j_common_ptr)&cinfo, coef_arrays[ci], (JDIMENSION)by, (JDIMENSION)v_samp[ci], TRUE);
+                    for (int k = 0; k < v_samp[ci]; k++)
+                        memcpy(dst[k], &blocks[ci][(by + k) * cols * DCTSIZE2], cols * sizeof(JBLOCK));
+                }
+            }
+            jpeg_finish_compress(&cinfo);
+        }
+        catch (int code)
+        {
+            debug_printf("Woops, exit_code=%d\n", code);
+            jpeg_destroy_compress(&cinfo);
+            return code != 0 ? code : EXIT_FAILURE;
+        }
+        jpeg_destroy_compress(&cinfo);
+        return 0;
+    }
+};
+
+/// Creates a frame encoder for the frames of width x height pixels of input_cs laid out by stride; see jpegframe.h.
+/// options work as same as jpeg_compress_ex except output/output_path/dedupe_key, which are ignored. Returns NULL if the
+/// parameters are invalid.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void *jpeg_frame_encoder_create(int width, int height, int stride, int input_cs, const jpeg_compress_options *options)
+{
+    JpegFrameEncoder *encoder = new JpegFrameEncoder(width, height, stride, input_cs, *options);
+    if (!encoder->init())
+    {
+        delete encoder;
+        return NULL;
+    }
+    return encoder;
+}
+
+/// Encodes the frame at p0 into output_path, or on memory if output_path is NULL; the result is notified as same as
+/// jpeg_compress_ex. Before the result, the number of the re-encoded MCUs and the number of all the MCUs are notified as
+/// (pass, totalPass). The first frame (and the frame after a failure) is encoded entirely.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_frame_encoder_encode(void *encoder, const unsigned char *p0, const char *output_path, void *context)
+{
+    const int code = ((JpegFrameEncoder *)encoder)->encode(p0, output_path, context);
+    if (code == 0)
+        debug_printf("compression succeeded.\n");
+    notify_progress(context, PROGRESS_PASS_EXITCODE, 0, code);
+}
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_frame_encoder_encode_threaded(void *encoder, const unsigned char *p0, const char *output_path, void *context)
+{
+    const bool has_path = output_path != NULL;
+    std::string path(has_path ? output_path : "");
+    if (!run_detached([=]()
+                      { jpeg_frame_encoder_encode(encoder, p0, has_path ? path.c_str() : NULL, context); }))
+    {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, -1, -1); // error
+    }
+}
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_frame_encoder_release(void *encoder)
+{
+    delete (JpegFrameEncoder *)encoder;
+}
@@ -0,0 +1,24 @@
+#ifndef _jpegframe_h_
+#define _jpegframe_h_
+
+#include "jpegcompress.h"
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+    // Stateful encoder for the successive frames of the same size that are mostly identical (screen capture, ...).
+    // The encoder input is hashed by MCUs (16x16 pixels for YCbCr 4:2:0, 8x8 for grayscale) and only the MCUs changed
+    // from the previous frame are color converted, transformed and quantized; the quantized coefficients of the other
+    // MCUs are reused from the previous frame and the whole frame is entropy coded from them.
+    // The frames should be encoded one by one; an encoder is not thread-safe.
+    void *jpeg_frame_encoder_create(int width, int height, int stride, int input_cs, const jpeg_compress_options *options);
+    void jpeg_frame_encoder_encode(void *encoder, const unsigned char *p0, const char *output_path, void *context);
+    void jpeg_frame_encoder_release(void *encoder);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _jpegframe_h_ */
@@ -0,0 +1,222 @@
+#include "cdjapi.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "jpegmarkers.h"
+#include "encoded_data.h"
+#include "file_io.h"
+
+static const int M_SOI = 0xd8;
+static const int M_EOI = 0xd9;
+static const int M_SOS = 0xda;
+static const int M_APP0 = 0xe0;
+static const int M_APP14 = 0xee;
+static const int M_COM = 0xfe;
+
+static bool is_app_or_com(int marker)
+{
+    return (marker >= M_APP0 && marker <= M_APP0 + 15) || marker == M_COM;
+}
+
+// Markers without the length field
+static bool is_standalone(int marker)
+{
+    return marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7); // TEM, RSTn
+}
+
+static bool starts_with(const unsigned char *data, size_t size, const void *signature, size_t length)
+{
+    return size >= length && memcmp(data, signature, length) == 0;
+}
+
+// JFIF and Adobe markers are needed to decode the colors correctly; they're never dropped or replaced.
+static bool is_protected(int marker, const unsigned char *data, size_t size)
+{
+    return (marker == M_APP0 && starts_with(data, size, "JFIF\0", 5)) ||
+           (marker == M_APP14 && starts_with(data, size, "Adobe", 5));
+}
+
+static const jpeg_marker_rule *find_rule(const jpeg_marker_policy &policy, int marker, const unsigned char *data, size_t size)
+{
+    for (int i = 0; i < policy.num_rules; i++)
+    {
+        const jpeg_marker_rule &rule = policy.rules[i];
+        if (rule.marker != JPEG_MARKER_ANY && rule.marker != marker)
+            continue;
+        if (rule.signature && !starts_with(data, size, rule.signature, rule.signature_length))
+            continue;
+        return &rule;
+    }
+    return NULL;
+}
+
+static void put_segment(std::vector<unsigned char> &out, int marker, const unsigned char *data, size_t size)
+{
+    const size_t length = size + 2;
+    const unsigned char head[] = {0xff, (unsigned char)marker, (unsigned char)(length >> 8), (unsigned char)length};
+    out.insert(out.end(), head, head + sizeof(head));
+    out.insert(out.end(), data, data + size);
+}
+
+static bool validate_policy(const jpeg_marker_policy &policy)
+{
+    for (int i = 0; i < policy.num_rules; i++)
+    {
+        const jpeg_marker_rule &rule = policy.rules[i];
+        if (rule.action == JPEG_MARKER_REPLACE && rule.size > JPEG_MARKER_MAX_DATA_SIZE)
+        {
+            debug_printf("replacement data too large: %zu bytes.\n", rule.size);
+            return false;
+        }
+    }
+    for (int i = 0; i < policy.num_inserts; i++)
+    {
+        const jpeg_marker_segment &segment = policy.inserts[i];
+        if (!is_app_or_com(segment.marker) || segment.size > JPEG_MARKER_MAX_DATA_SIZE)
+        {
+            debug_printf("invalid marker segment to insert: marker=0x%02x, %zu bytes.\n", segment.marker, segment.size);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Copies the JPEG into out applying the policy to the APPn/COM markers in the header; everything from the first SOS
+// marker (the entropy-coded data and the following tables/scans) is copied verbatim.
+static int splice_markers(const unsigned char *p, size_t size, const jpeg_marker_policy &policy, std::vector<unsigned char> &out)
+{
+    if (!validate_policy(policy))
+        return EXIT_FAILURE;
+    if (size < 4 || p[0] != 0xff || p[1] != M_SOI)
+    {
+        debug_printf("Not a JPEG file.\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t inserted_size = 0;
+    for (int i = 0; i < policy.num_inserts; i++)
+        inserted_size += policy.inserts[i].size + 4;
+    out.clear();
+    out.reserve(size + inserted_size);
+    out.insert(out.end(), p, p + 2);
+
+    bool inserted = false;
+    size_t pos = 2;
+    for (;;)
+    {
+        if (pos >= size || p[pos] != 0xff)
+        {
+            debug_printf("Corrupt JPEG data: no marker at offset %zu.\n", pos);
+            return EXIT_FAILURE;
+        }
+        while (pos < size && p[pos] == 0xff) // fill bytes
+            pos++;
+        if (pos >= size)
+            break;
+        const int marker = p[pos++];
+        if (marker == 0 || marker == M_EOI || marker == M_SOI)
+            break;
+
+        if (is_standalone(marker))
+        {
+            out.push_back(0xff);
+            out.push_back((unsigned char)marker);
+            continue;
+        }
+
+        // The inserted markers go after the existing APPn/COM markers (so JFIF/EXIF stay first)
+        if (!is_app_or_com(marker) && !inserted)
+        {
+            for (int i = 0; i < policy.num_inserts; i++)
+                put_segment(out, policy.inserts[i].marker, policy.inserts[i].data, policy.inserts[i].size);
+            inserted = true;
+        }
+
+        if (marker == M_SOS)
+        {
+            out.push_back(0xff);
+            out.push_back((unsigned char)marker);
+            out.insert(out.end(), p + pos, p + size);
+            return 0;
+        }
+
+        if (pos + 2 > size)
+            break;
+        const size_t length = (size_t)p[pos] << 8 | p[pos + 1];
+        if (length < 2 || pos + length > size)
+            break;
+        const unsigned char *data = p + pos + 2;
+        const size_t data_size = length - 2;
+
+        int action = JPEG_MARKER_KEEP;
+        const jpeg_marker_rule *rule = NULL;
+        if (is_app_or_com(marker) && !is_protected(marker, data, data_size))
+        {
+            rule = find_rule(policy, marker, data, data_size);
+            action = rule ? rule->action : policy.default_action;
+        }
+        switch (action)
+        {
+        case JPEG_MARKER_DROP:
+            break;
+        case JPEG_MARKER_REPLACE:
+            put_segment(out, marker, rule->data, rule->size);
+            break;
+        default:
+            out.insert(out.end(), p + pos - 2, p + pos + length);
+            break;
+        }
+        pos += length;
+    }
+    debug_printf("Corrupt JPEG data: premature end of the header.\n");
+    return EXIT_FAILURE;
+}
+
+/// Rewrites the APPn/COM markers of the JPEG data by [policy] without decoding the image; the other markers and the
+/// entropy-coded data are copied as is. On success, the result handle (see jpeg_compress_get_ptr/jpeg_compress_release)
+/// is stored to *result and the function returns 0.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int jpeg_rewrite_markers(const unsigned char *data, size_t size, const jpeg_marker_policy *policy, void **result)
+{
+    std::vector<unsigned char> out;
+    int code = splice_markers(data, size, *policy, out);
+    if (code == 0)
+        *result = new SharedBuffer(std::make_shared<VectorEncodedData>(std::move(out)));
+    return code;
+}
+
+/// File version of jpeg_rewrite_markers; output_path may be same as input_path to rewrite the file in place.
+/// The output is written to a temporary file and renamed, so the output file is never left partially written.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int jpeg_rewrite_markers_file(const char *input_path, const char *output_path, const jpeg_marker_policy *policy)
+{
+    int fd = open(input_path, O_RDONLY);
+    if (fd < 0)
+    {
+        debug_printf("can't open %s\n", input_path);
+        return EXIT_FAILURE;
+    }
+    SharedBuffer input = MappedEncodedData::map(fd);
+    close(fd);
+    if (!input)
+    {
+        debug_printf("can't read %s\n", input_path);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<unsigned char> out;
+    int code = splice_markers(input->data(), input->size(), *policy, out);
+    if (code != 0)
+        return code;
+
+    if (!replace_file(output_path, out.data(), out.size()))
+    {
+        debug_printf("can't write %s\n", output_path);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
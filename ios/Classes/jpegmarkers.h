@@ -0,0 +1,61 @@
+#ifndef _jpegmarkers_h_
+#define _jpegmarkers_h_
+
+#include <stddef.h>
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+    enum
+    {
+        // Values for jpeg_marker_rule.marker
+        JPEG_MARKER_ANY = -1, // any APPn/COM marker; otherwise 0xE0 + n (APPn) or 0xFE (COM)
+
+        // Values for jpeg_marker_rule.action and jpeg_marker_policy.default_action
+        JPEG_MARKER_KEEP = 0,
+        JPEG_MARKER_DROP = 1,
+        JPEG_MARKER_REPLACE = 2, // replace the data with jpeg_marker_rule.data
+
+        // Maximum data size of a marker segment (excluding the length field)
+        JPEG_MARKER_MAX_DATA_SIZE = 65533,
+    };
+
+    // A rule matches a marker if the marker code matches and its data starts with the signature.
+    typedef struct jpeg_marker_rule
+    {
+        int marker;                     // JPEG_MARKER_ANY, 0xE0 + n or 0xFE
+        const unsigned char *signature; // e.g. "Exif\0\0" for EXIF; NULL matches any data
+        size_t signature_length;
+        int action;                     // JPEG_MARKER_*
+        const unsigned char *data;      // replacement data for JPEG_MARKER_REPLACE
+        size_t size;
+    } jpeg_marker_rule;
+
+    // A marker segment to insert.
+    typedef struct jpeg_marker_segment
+    {
+        int marker; // 0xE0 + n or 0xFE
+        const unsigned char *data;
+        size_t size;
+    } jpeg_marker_segment;
+
+    // Policy of jpeg_rewrite_markers; the layout is shared with _JpegMarkerPolicy on the Dart side.
+    typedef struct jpeg_marker_policy
+    {
+        int default_action; // JPEG_MARKER_KEEP or JPEG_MARKER_DROP for the markers that match no rule
+        const jpeg_marker_rule *rules; // the first matching rule is applied
+        int num_rules;
+        const jpeg_marker_segment *inserts; // inserted after the existing APPn/COM markers in the header
+        int num_inserts;
+    } jpeg_marker_policy;
+
+    int jpeg_rewrite_markers(const unsigned char *data, size_t size, const jpeg_marker_policy *policy, void **result);
+    int jpeg_rewrite_markers_file(const char *input_path, const char *output_path, const jpeg_marker_policy *policy);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _jpegmarkers_h_ */
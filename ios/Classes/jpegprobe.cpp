@@ -0,0 +1,172 @@
+#include "cdjpeg.h"
+#include "cdjapi.h"
+#include "jconfigint.h"
+
+#include <algorithm>
+
+#include "jpegprobe.h"
+
+// Sample quantization tables from the JPEG spec (Annex K); the base of the IJG quality scaling. In natural order.
+static const unsigned short std_luminance_quant_tbl[DCTSIZE2] = {
+    16, 11, 10, 16, 24, 40, 51, 61,
+    12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56,
+    14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77,
+    24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103, 99};
+static const unsigned short std_chrominance_quant_tbl[DCTSIZE2] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99};
+
+// Sum of the differences between the table and the IJG table for the quality (same as jpeg_set_quality with force_baseline).
+static long quant_table_error(const unsigned short *table, const unsigned short *base, int quality)
+{
+    const long scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    long error = 0;
+    for (int i = 0; i < DCTSIZE2; i++)
+    {
+        long q = (base[i] * scale + 50) / 100;
+        q = q < 1 ? 1 : q > 255 ? 255 : q;
+        error += labs(q - table[i]);
+    }
+    return error;
+}
+
+/// Estimates the IJG quality (as of jpeg_set_quality) of the quantization tables in natural order; chroma may be NULL.
+/// The result is the quality whose tables are the closest to the given ones; it's only an approximation for the tables
+/// that are not based on the IJG ones (e.g. mozjpeg's default tables).
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int jpeg_estimate_quality(const unsigned short *luma, const unsigned short *chroma)
+{
+    int best = -1;
+    long best_error = 0;
+    for (int quality = 1; quality <= 100; quality++)
+    {
+        long error = quant_table_error(luma, std_luminance_quant_tbl, quality);
+        if (chroma)
+            error += quant_table_error(chroma, std_chrominance_quant_tbl, quality);
+        if (best < 0 || error < best_error)
+        {
+            best = quality;
+            best_error = error;
+        }
+    }
+    return best;
+}
+
+// Fills info from the header already read by jpeg_read_header.
+static void fill_probe_info(j_decompress_ptr cinfo, jpeg_probe_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->width = (int)cinfo->image_width;
+    info->height = (int)cinfo->image_height;
+    info->num_components = cinfo->num_components;
+    info->color_space = cinfo->jpeg_color_space;
+    info->data_precision = cinfo->data_precision;
+    info->progressive = cinfo->progressive_mode ? 1 : 0;
+    info->arithmetic = cinfo->arith_code ? 1 : 0;
+    info->restart_interval = (int)cinfo->restart_interval;
+
+    for (int ci = 0; ci < cinfo->num_components && ci < JPEG_PROBE_MAX_COMPONENTS; ci++)
+    {
+        const jpeg_component_info *comp = &cinfo->comp_info[ci];
+        info->h_samp_factor[ci] = comp->h_samp_factor;
+        info->v_samp_factor[ci] = comp->v_samp_factor;
+        info->quant_tbl_no[ci] = comp->quant_tbl_no;
+    }
+    for (int t = 0; t < JPEG_PROBE_MAX_QUANT_TABLES && t < NUM_QUANT_TBLS; t++)
+    {
+        const JQUANT_TBL *tbl = cinfo->quant_tbl_ptrs[t];
+        if (!tbl)
+            continue;
+        info->quant_tbl_defined[t] = 1;
+        for (int i = 0; i < DCTSIZE2; i++)
+            info->quant_tables[t][i] = tbl->quantval[i];
+    }
+
+    // Luma (the first component) and chroma (the second one) tables
+    const int luma = info->quant_tbl_no[0];
+    const int chroma = cinfo->num_components >= 3 ? info->quant_tbl_no[1] : -1;
+    if (luma >= 0 && luma < JPEG_PROBE_MAX_QUANT_TABLES && info->quant_tbl_defined[luma])
+        info->quality = jpeg_estimate_quality(info->quant_tables[luma],
+                                              chroma >= 0 && chroma < JPEG_PROBE_MAX_QUANT_TABLES && info->quant_tbl_defined[chroma] ? info->quant_tables[chroma] : NULL);
+    else
+        info->quality = -1;
+
+    if (cinfo->saw_JFIF_marker)
+    {
+        info->density_unit = cinfo->density_unit;
+        info->x_density = cinfo->X_density;
+        info->y_density = cinfo->Y_density;
+    }
+    info->adobe_transform = cinfo->saw_Adobe_marker ? cinfo->Adobe_transform : -1;
+
+    for (jpeg_saved_marker_ptr m = cinfo->marker_list; m; m = m->next)
+    {
+        if (info->num_markers < JPEG_PROBE_MAX_MARKERS)
+        {
+            jpeg_probe_marker *pm = &info->markers[info->num_markers];
+            pm->marker = m->marker;
+            pm->length = m->original_length;
+            memcpy(pm->head, m->data, std::min<size_t>(m->data_length, JPEG_PROBE_MARKER_HEAD_SIZE));
+        }
+        info->num_markers++;
+    }
+}
+
+// Reads the header from the source set up by init_src; no DCT coefficients are read.
+template <typename SrcInit>
+static int probe(jpeg_probe_info *info, SrcInit init_src)
+{
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = debug_foward_error(&jerr);
+    int code = 0;
+    try
+    {
+        jpeg_create_decompress(&cinfo);
+        init_src(&cinfo);
+        // only the beginning of each marker is kept
+        jpeg_save_markers(&cinfo, JPEG_COM, JPEG_PROBE_MARKER_HEAD_SIZE);
+        for (int i = 0; i < 16; i++)
+            jpeg_save_markers(&cinfo, JPEG_APP0 + i, JPEG_PROBE_MARKER_HEAD_SIZE);
+        jpeg_read_header(&cinfo, TRUE);
+        fill_probe_info(&cinfo, info);
+    }
+    catch (int exit_code)
+    {
+        code = exit_code != 0 ? exit_code : EXIT_FAILURE;
+    }
+    jpeg_destroy_decompress(&cinfo);
+    return code;
+}
+
+/// Reads only the header of the JPEG data on memory and fills info; returns 0 on success.
+/// It's fast enough to call synchronously.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int jpeg_probe(const unsigned char *data, size_t size, jpeg_probe_info *info)
+{
+    return probe(info, [&](j_decompress_ptr cinfo)
+                 { jpeg_mem_src(cinfo, data, (unsigned long)size); });
+}
+
+/// Reads only the header of the JPEG file and fills info; returns 0 on success.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int jpeg_probe_file(const char *path, jpeg_probe_info *info)
+{
+    FILE *fp = fopen(path, READ_BINARY);
+    if (!fp)
+    {
+        debug_printf("can't open %s for reading\n", path);
+        return EXIT_FAILURE;
+    }
+    int code = probe(info, [&](j_decompress_ptr cinfo)
+                     { jpeg_stdio_src(cinfo, fp); });
+    fclose(fp);
+    return code;
+}
@@ -0,0 +1,60 @@
+#ifndef _jpegprobe_h_
+#define _jpegprobe_h_
+
+#include <stddef.h>
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+    enum
+    {
+        JPEG_PROBE_MAX_COMPONENTS = 4,
+        JPEG_PROBE_MAX_QUANT_TABLES = 4,
+        JPEG_PROBE_MAX_MARKERS = 16,
+        JPEG_PROBE_MARKER_HEAD_SIZE = 32,
+    };
+
+    // APPn/COM marker found in the header.
+    typedef struct jpeg_probe_marker
+    {
+        int marker;                                      // JPEG_APP0 + n or JPEG_COM
+        unsigned int length;                             // data length excluding the length field
+        unsigned char head[JPEG_PROBE_MARKER_HEAD_SIZE]; // first bytes of the data; e.g. "Exif\0\0" or "JFIF\0"
+    } jpeg_probe_marker;
+
+    // Result of jpeg_probe; the layout is shared with _JpegProbeInfo on the Dart side.
+    typedef struct jpeg_probe_info
+    {
+        int width;
+        int height;
+        int num_components;
+        int color_space;      // J_COLOR_SPACE of the JPEG data
+        int data_precision;   // bits per sample
+        int progressive;      // non-zero if progressive
+        int arithmetic;       // non-zero if arithmetic coded
+        int restart_interval; // in MCUs; 0 if no restart markers
+        int h_samp_factor[JPEG_PROBE_MAX_COMPONENTS];
+        int v_samp_factor[JPEG_PROBE_MAX_COMPONENTS];
+        int quant_tbl_no[JPEG_PROBE_MAX_COMPONENTS];             // quantization table used by each component
+        int quant_tbl_defined[JPEG_PROBE_MAX_QUANT_TABLES];      // non-zero if the table is defined
+        unsigned short quant_tables[JPEG_PROBE_MAX_QUANT_TABLES][64]; // in natural (not zigzag) order
+        int density_unit;     // JFIF density; 0: aspect ratio only, 1: dpi, 2: dots per cm
+        int x_density;
+        int y_density;
+        int adobe_transform;  // Adobe APP14 transform; -1 if there's no Adobe marker
+        int num_markers;      // number of APPn/COM markers; only the first JPEG_PROBE_MAX_MARKERS are in markers
+        jpeg_probe_marker markers[JPEG_PROBE_MAX_MARKERS];
+        int quality;          // estimated IJG quality by jpeg_estimate_quality; -1 if unknown
+    } jpeg_probe_info;
+
+    int jpeg_probe(const unsigned char *data, size_t size, jpeg_probe_info *info);
+    int jpeg_probe_file(const char *path, jpeg_probe_info *info);
+    int jpeg_estimate_quality(const unsigned short *luma, const unsigned short *chroma);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _jpegprobe_h_ */
@@ -0,0 +1,420 @@
+#include "cdjpeg.h"
+#include "cdjapi.h"
+#include "jconfigint.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "jpegcompress.h"
+#include "jpegpyramid.h"
+#include "jpegtiles.h"
+#include "file_io.h"
+#include "row_source.h"
+#include "decoder_row_source.h"
+#include "worker_pool.h"
+
+// Halves the pair of rows (2x2 box filter); the last column of an odd width is averaged only vertically.
+static void downscale_rows(const unsigned char *a, const unsigned char *b, int width, int components, unsigned char *out)
+{
+    const int pairs = width / 2;
+    for (int x = 0; x < pairs; x++)
+    {
+        const unsigned char *pa = a + x * 2 * components;
+        const unsigned char *pb = b + x * 2 * components;
+        for (int c = 0; c < components; c++)
+            *out++ = (unsigned char)((pa[c] + pa[c + components] + pb[c] + pb[c + components] + 2) >> 2);
+    }
+    if (width & 1)
+    {
+        const unsigned char *pa = a + pairs * 2 * components;
+        const unsigned char *pb = b + pairs * 2 * components;
+        for (int c = 0; c < components; c++)
+            *out++ = (unsigned char)((pa[c] + pb[c] + 1) >> 1);
+    }
+}
+
+static bool make_dir(const std::string &path)
+{
+    return mkdir(path.c_str(), 0777) == 0 || errno == EEXIST;
+}
+
+// Number of the Deep Zoom levels above level 0 (1x1); the full size image is on this level.
+static int max_level_for(int width, int height)
+{
+    const int size = std::max(width, height);
+    int level = 0;
+    while ((1 << level) < size)
+        level++;
+    return level;
+}
+
+// Builds the pyramid from the rows of the first (largest) level, keeping only the rows needed for the current tile row
+// on each level. Each level receives its rows by halving the pairs of rows of the level above.
+class PyramidBuilder
+{
+public:
+    PyramidBuilder(int width, int height, int components, int input_cs, int first_level, const jpeg_pyramid_options &options,
+                   std::atomic<int> &finished, int total, void *context)
+        : components(components), input_cs(input_cs), options(options), finished(finished), total(total), context(context)
+    {
+        tile_options = options.compress;
+        tile_options.output = JPEG_COMPRESS_OUTPUT_FILE;
+        tile_options.target_width = tile_options.target_height = 0;
+        tile_options.alpha_mode = JPEG_COMPRESS_ALPHA_IGNORE; // already flattened
+        tile_options.dedupe_key = NULL;
+        tile_options.transform = JPEG_COMPRESS_TRANSFORM_NONE; // already transformed
+        tile_options.crop_x = tile_options.crop_y = tile_options.crop_width = tile_options.crop_height = 0;
+
+        for (int level = first_level; level >= 0; level--)
+        {
+            Level l;
+            l.index = level;
+            l.width = width;
+            l.height = height;
+            l.columns = (width + options.tile_size - 1) / options.tile_size;
+            l.rows = (height + options.tile_size - 1) / options.tile_size;
+            l.row_bytes = (size_t)width * components;
+            l.band.resize(l.row_bytes * std::min(options.tile_size + 2 * options.overlap, height));
+            levels.push_back(std::move(l));
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+        for (size_t i = 0; i + 1 < levels.size(); i++)
+        {
+            levels[i].pending.resize(levels[i].row_bytes);
+            levels[i].down.resize(levels[i + 1].row_bytes);
+        }
+    }
+
+    // Number of the tiles on the levels from first_level to 0.
+    static int count_tiles(int width, int height, int first_level, int tile_size)
+    {
+        int count = 0;
+        for (int level = first_level; level >= 0; level--)
+        {
+            count += ((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size);
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+        return count;
+    }
+
+    bool make_dirs() const
+    {
+        for (const Level &l : levels)
+        {
+            if (!make_dir(level_dir(l.index)))
+            {
+                debug_printf("can't create %s\n", level_dir(l.index).c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Feeds the next row of the first level; returns false if any tile failed.
+    bool push_row(const unsigned char *row)
+    {
+        push(0, row);
+        return exit_code == 0;
+    }
+
+    // Flushes the rows waiting for their pairs; returns the exit code.
+    int finish()
+    {
+        for (size_t i = 0; i + 1 < levels.size() && exit_code == 0; i++)
+        {
+            Level &l = levels[i];
+            if (l.has_pending)
+            {
+                l.has_pending = false;
+                downscale_rows(l.pending.data(), l.pending.data(), l.width, components, l.down.data());
+                push(i + 1, l.down.data());
+            }
+        }
+        return exit_code;
+    }
+
+private:
+    struct Level
+    {
+        int index; // Deep Zoom level
+        int width, height;
+        int columns, rows;
+        size_t row_bytes;
+        std::vector<unsigned char> band; // rows [band_y, band_y + band_rows) of the level
+        int band_y = 0;
+        int band_rows = 0;
+        int next_tile_row = 0;
+        std::vector<unsigned char> pending; // even row waiting for the next one to be halved together
+        bool has_pending = false;
+        std::vector<unsigned char> down; // halved row for the next level
+    };
+
+    const int components;
+    const int input_cs;
+    const jpeg_pyramid_options &options;
+    jpeg_compress_options tile_options;
+    std::vector<Level> levels;
+    std::atomic<int> exit_code{0};
+    std::atomic<int> &finished;
+    const int total;
+    void *context;
+
+    std::string level_dir(int level) const
+    {
+        return std::string(options.output_dir) + "/" + std::to_string(level);
+    }
+
+    void push(size_t i, const unsigned char *row)
+    {
+        Level &l = levels[i];
+        memcpy(&l.band[l.row_bytes * l.band_rows++], row, l.row_bytes);
+
+        if (i + 1 < levels.size())
+        {
+            if (!l.has_pending)
+            {
+                memcpy(l.pending.data(), row, l.row_bytes);
+                l.has_pending = true;
+            }
+            else
+            {
+                l.has_pending = false;
+                downscale_rows(l.pending.data(), row, l.width, components, l.down.data());
+                push(i + 1, l.down.data());
+            }
+        }
+
+        // Encode the tile rows whose rows (including the overlap) are all on the band
+        const int tile_size = options.tile_size, overlap = options.overlap;
+        while (l.next_tile_row < l.rows && exit_code == 0)
+        {
+            const int r = l.next_tile_row;
+            const int y_start = std::max(r * tile_size - overlap, 0);
+            const int y_end = std::min((r + 1) * tile_size + overlap, l.height);
+            if (l.band_y + l.band_rows < y_end)
+                break;
+            encode_tile_row(l, r, y_start, y_end);
+            l.next_tile_row++;
+
+            // Drop the rows above the next tile row
+            const int next_start = std::min(std::max((r + 1) * tile_size - overlap, 0), l.band_y + l.band_rows);
+            const int drop = next_start - l.band_y;
+            if (drop > 0)
+            {
+                memmove(l.band.data(), &l.band[l.row_bytes * drop], l.row_bytes * (l.band_rows - drop));
+                l.band_y += drop;
+                l.band_rows -= drop;
+            }
+        }
+    }
+
+    void encode_tile_row(const Level &l, int r, int y_start, int y_end)
+    {
+        const int tile_size = options.tile_size, overlap = options.overlap;
+        WorkerPool::shared().parallel_for(l.columns, [&](size_t c)
+                                          {
+            const int x_start = std::max((int)c * tile_size - overlap, 0);
+            const int x_end = std::min(((int)c + 1) * tile_size + overlap, l.width);
+            const unsigned char *p0 = &l.band[l.row_bytes * (y_start - l.band_y) + (size_t)x_start * components];
+            const std::string path = level_dir(l.index) + "/" + std::to_string(c) + "_" + std::to_string(r) + ".jpg";
+            int code = jpeg_compress_to_path(p0, x_end - x_start, y_end - y_start, (int)l.row_bytes, input_cs, &tile_options, path.c_str());
+            if (code != 0)
+            {
+                int expected = 0;
+                exit_code.compare_exchange_strong(expected, code);
+            }
+            notify_progress(context, ++finished, total, 100); });
+    }
+};
+
+static bool validate_options(const jpeg_pyramid_options &options)
+{
+    if (options.tile_size <= 0 || options.overlap < 0 || options.overlap > options.tile_size || !options.output_dir ||
+        options.compress.transform < JPEG_COMPRESS_TRANSFORM_NONE || options.compress.transform > JPEG_COMPRESS_TRANSFORM_ROT_270)
+    {
+        debug_printf("invalid pyramid options.\n");
+        return false;
+    }
+    return make_dir(options.output_dir);
+}
+
+static bool write_dzi(const jpeg_pyramid_options &options, int width, int height)
+{
+    if (!options.dzi_path)
+        return true;
+    char xml[512];
+    const int n = snprintf(xml, sizeof(xml),
+                           "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                           "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" TileSize=\"%d\" Overlap=\"%d\" Format=\"jpg\">\n"
+                           "  <Size Width=\"%d\" Height=\"%d\"/>\n"
+                           "</Image>\n",
+                           options.tile_size, options.overlap, width, height);
+    return replace_file(options.dzi_path, (const unsigned char *)xml, (size_t)n);
+}
+
+/// Generates the Deep Zoom (DZI) tile pyramid of the image: the levels are halved down to 1x1 and each level is split
+/// into options->tile_size tiles with options->overlap pixels shared with the neighbors. Only the source rows needed for
+/// the current row of tiles are kept on each level, and the tiles of a row are encoded in parallel.
+/// The progress is notified as (number of finished tiles, number of tiles) and PROGRESS_PASS_EXITCODE comes last.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_pyramid(const unsigned char *p0, int width, int height, int stride, int input_cs, const jpeg_pyramid_options *options, void *context)
+{
+    int code = EXIT_FAILURE;
+    if (validate_options(*options) && width > 0 && height > 0 && jpeg_compress_components(input_cs) > 0)
+    {
+        // Flatten the alpha (if requested) before downscaling so that the levels are averaged on the composited colors
+        jpeg_compress_options flatten = options->compress;
+        flatten.target_width = flatten.target_height = 0;
+        std::vector<std::unique_ptr<RowSource>> stages;
+        stages.emplace_back(new_memory_row_source(p0, width, height, stride, input_cs, options->compress.transform));
+        width = stages.back()->width; // the pyramid is of the transformed image
+        height = stages.back()->height;
+        append_stages(stages, input_cs, flatten, width, height);
+
+        const int max_level = max_level_for(width, height);
+        std::atomic<int> finished(0);
+        PyramidBuilder builder(width, height, stages.back()->components, input_cs, max_level, *options, finished,
+                               PyramidBuilder::count_tiles(width, height, max_level, options->tile_size), context);
+        if (builder.make_dirs())
+        {
+            for (int y = 0; y < height && builder.push_row(stages.back()->next_row()); y++)
+                ;
+            code = builder.finish();
+        }
+        if (code == 0 && !write_dzi(*options, width, height))
+            code = EXIT_FAILURE;
+    }
+    notify_progress(context, PROGRESS_PASS_EXITCODE, 0, code);
+}
+
+/// Generates the Deep Zoom tile pyramid of the JPEG; see jpeg_pyramid. With options->lossless_top_level, the tiles of the
+/// full size level are cropped from the DCT coefficients (see jpeg_tile_grid) and the image is decoded at 1/2 scale by
+/// the DCT scaling for the other levels.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_pyramid_from_jpeg(const unsigned char *data, size_t size, const jpeg_pyramid_options *options, void *context)
+{
+    if (!validate_options(*options))
+    {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, 0, EXIT_FAILURE);
+        return;
+    }
+
+    jpeg_decompress_struct srcinfo;
+    jpeg_error_mgr jsrcerr;
+    srcinfo.err = debug_foward_error(&jsrcerr);
+    int code = 0;
+    try
+    {
+        jpeg_create_decompress(&srcinfo);
+        jpeg_mem_src(&srcinfo, data, (unsigned long)size);
+        jpeg_read_header(&srcinfo, TRUE);
+
+        const int width = (int)srcinfo.image_width, height = (int)srcinfo.image_height;
+        const int max_level = max_level_for(width, height);
+        const int imcu_width = srcinfo.num_components == 1 ? DCTSIZE : srcinfo.max_h_samp_factor * DCTSIZE;
+        const int imcu_height = srcinfo.num_components == 1 ? DCTSIZE : srcinfo.max_v_samp_factor * DCTSIZE;
+        const bool lossless = options->lossless_top_level && options->overlap == 0 && max_level > 0 &&
+                              options->tile_size % imcu_width == 0 && options->tile_size % imcu_height == 0;
+        const int first_level = lossless ? max_level - 1 : max_level;
+        const int total = PyramidBuilder::count_tiles(width, height, max_level, options->tile_size);
+        std::atomic<int> finished(0);
+
+        if (lossless)
+        {
+            const std::string dir = std::string(options->output_dir) + "/" + std::to_string(max_level);
+            jpeg_tile_options tile_options = {options->tile_size, options->tile_size, JPEG_COMPRESS_OUTPUT_FILE, dir.c_str(),
+                                              options->compress.output_policy, 0, options->compress.single_pass ? 0 : 1};
+            if (!make_dir(dir))
+                code = EXIT_FAILURE;
+            else
+                code = jpeg_tile_grid_run(data, size, &tile_options, NULL);
+            finished += PyramidBuilder::count_tiles(width, height, 0, options->tile_size);
+            notify_progress(context, finished, total, 100);
+            srcinfo.scale_num = 1;
+            srcinfo.scale_denom = 2;
+        }
+
+        if (code == 0)
+        {
+            int input_cs;
+            switch (srcinfo.jpeg_color_space)
+            {
+            case JCS_GRAYSCALE:
+                input_cs = srcinfo.out_color_space = JCS_GRAYSCALE;
+                break;
+            case JCS_CMYK:
+            case JCS_YCCK:
+                input_cs = srcinfo.out_color_space = JCS_CMYK;
+                break;
+            default:
+                input_cs = srcinfo.out_color_space = JCS_RGB;
+                break;
+            }
+            jpeg_start_decompress(&srcinfo);
+
+            DecoderRowSource src(&srcinfo);
+            PyramidBuilder builder(src.width, src.height, src.components, input_cs, first_level, *options, finished, total, context);
+            if (!builder.make_dirs())
+            {
+                code = EXIT_FAILURE;
+            }
+            else
+            {
+                for (int y = 0; y < src.height && builder.push_row(src.next_row()); y++)
+                    ;
+                code = builder.finish();
+            }
+            if (code == 0 && !write_dzi(*options, width, height))
+                code = EXIT_FAILURE;
+        }
+    }
+    catch (int exit_code)
+    {
+        code = exit_code != 0 ? exit_code : EXIT_FAILURE;
+    }
+    jpeg_destroy_decompress(&srcinfo);
+    notify_progress(context, PROGRESS_PASS_EXITCODE, 0, code);
+}
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_pyramid_threaded(const unsigned char *p0, int width, int height, int stride, int input_cs, const jpeg_pyramid_options *options, void *context)
+{
+    // options (and the paths) are copied; the caller may release them immediately
+    jpeg_pyramid_options opts = *options;
+    std::string dir(options->output_dir ? options->output_dir : "");
+    const bool has_dzi = options->dzi_path != NULL;
+    std::string dzi(has_dzi ? options->dzi_path : "");
+    if (!run_detached([=]()
+                      {
+                          jpeg_pyramid_options o = opts;
+                          o.output_dir = dir.c_str();
+                          o.dzi_path = has_dzi ? dzi.c_str() : NULL;
+                          jpeg_pyramid(p0, width, height, stride, input_cs, &o, context); }))
+    {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, -1, -1); // error
+    }
+}
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_pyramid_from_jpeg_threaded(const unsigned char *data, size_t size, const jpeg_pyramid_options *options, void *context)
+{
+    jpeg_pyramid_options opts = *options;
+    std::string dir(options->output_dir ? options->output_dir : "");
+    const bool has_dzi = options->dzi_path != NULL;
+    std::string dzi(has_dzi ? options->dzi_path : "");
+    if (!run_detached([=]()
+                      {
+                          jpeg_pyramid_options o = opts;
+                          o.output_dir = dir.c_str();
+                          o.dzi_path = has_dzi ? dzi.c_str() : NULL;
+                          jpeg_pyramid_from_jpeg(data, size, &o, context); }))
+    {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, -1, -1); // error
+    }
+}
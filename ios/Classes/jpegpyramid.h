@@ -0,0 +1,33 @@
+#ifndef _jpegpyramid_h_
+#define _jpegpyramid_h_
+
+#include <stddef.h>
+
+#include "jpegcompress.h"
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+    // Options for jpeg_pyramid; the layout is shared with _JpegPyramidOptions on the Dart side.
+    typedef struct jpeg_pyramid_options
+    {
+        int tile_size;          // tile size excluding the overlap; 254 is the common choice for Deep Zoom
+        int overlap;            // pixels shared with the adjacent tiles on each side
+        const char *output_dir; // tiles are written to <output_dir>/<level>/<column>_<row>.jpg (the "_files" directory)
+        const char *dzi_path;   // if not NULL, the Deep Zoom descriptor (.dzi) is written to the path
+        int lossless_top_level; // for JPEG input; non-zero to crop the top level tiles losslessly from the source (only if
+                                // overlap is 0 and tile_size is a multiple of the MCU size); the source is held on memory
+        jpeg_compress_options compress; // encoding parameters of the tiles; output/target size/dedupe_key/crop are ignored
+                                        // and transform is applied to the raw pixel input only
+    } jpeg_pyramid_options;
+
+    void jpeg_pyramid(const unsigned char *p0, int width, int height, int stride, int input_cs, const jpeg_pyramid_options *options, void *context);
+    void jpeg_pyramid_from_jpeg(const unsigned char *data, size_t size, const jpeg_pyramid_options *options, void *context);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _jpegpyramid_h_ */
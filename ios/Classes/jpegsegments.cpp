@@ -0,0 +1,364 @@
+#include "cdjpeg.h"
+#include "cdjapi.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "jpegsegments.h"
+#include "worker_pool.h"
+
+static const int M_SOF0 = 0xc0;
+static const int M_SOF1 = 0xc1;
+static const int M_DHT = 0xc4;
+static const int M_RST0 = 0xd0;
+static const int M_SOI = 0xd8;
+static const int M_EOI = 0xd9;
+static const int M_SOS = 0xda;
+static const int M_DQT = 0xdb;
+static const int M_DRI = 0xdd;
+static const int M_APP0 = 0xe0;
+static const int M_APP14 = 0xee;
+
+// Bands per worker; more bands than the workers even out the differences of the decoding cost between the bands.
+static const size_t BANDS_PER_THREAD = 4;
+
+static size_t gcd(size_t a, size_t b)
+{
+    while (b)
+    {
+        const size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static JDIMENSION round_up(JDIMENSION a, JDIMENSION b)
+{
+    return (a + b - 1) / b * b;
+}
+
+bool JpegSegments::worth_splitting(j_decompress_ptr srcinfo)
+{
+    return WorkerPool::shared().thread_count() > 1 && srcinfo->restart_interval > 0 && !srcinfo->progressive_mode &&
+           !srcinfo->arith_code;
+}
+
+bool JpegSegments::parse(const unsigned char *p, size_t size)
+{
+    if (size < 4 || p[0] != 0xff || p[1] != M_SOI)
+        return false;
+    header.assign(p, p + 2);
+    size_t pos = 2;
+    int width = 0, max_h = 0, max_v = 0, num_components = 0;
+    unsigned int restart_interval = 0;
+    bool sof = false;
+    for (;;)
+    {
+        if (pos >= size || p[pos] != 0xff)
+            return false;
+        while (pos < size && p[pos] == 0xff) // fill bytes
+            pos++;
+        if (pos + 2 >= size)
+            return false;
+        const int marker = p[pos++];
+        const size_t length = (size_t)p[pos] << 8 | p[pos + 1];
+        if (length < 2 || pos + length > size)
+            return false;
+        const unsigned char *seg = p + pos + 2;
+        const size_t seg_size = length - 2;
+        bool keep = false;
+        switch (marker)
+        {
+        case M_SOF0:
+        case M_SOF1:
+            if (sof || seg_size < 6)
+                return false;
+            image_height = seg[1] << 8 | seg[2];
+            width = seg[3] << 8 | seg[4];
+            num_components = seg[5];
+            if (image_height == 0 || width == 0 || num_components == 0 || seg_size < 6 + (size_t)num_components * 3)
+                return false; // a DNL marker defines the height; not supported
+            for (int i = 0; i < num_components; i++)
+            {
+                max_h = std::max(max_h, seg[7 + i * 3] >> 4);
+                max_v = std::max(max_v, seg[7 + i * 3] & 15);
+            }
+            sof_height_offset = header.size() + 5;
+            sof = true;
+            keep = true;
+            break;
+        case M_DRI:
+            if (seg_size < 2)
+                return false;
+            restart_interval = seg[0] << 8 | seg[1];
+            keep = true;
+            break;
+        case M_DHT:
+        case M_DQT:
+            keep = true;
+            break;
+        case M_SOS:
+            // An interleaved scan of all the components is the only scan of the sequential JPEG
+            if (!sof || seg_size < 1 || seg[0] != num_components)
+                return false;
+            keep = true;
+            break;
+        default:
+            if ((marker >= 0xc2 && marker <= 0xcf && marker != M_DHT) || marker == M_SOI || marker == M_EOI)
+                return false; // progressive, lossless, arithmetic or hierarchical
+            if (marker == 0x01 || (marker >= M_RST0 && marker <= M_RST0 + 7))
+                return false; // standalone markers out of the scan
+            // JFIF and Adobe markers are needed to decode the colors correctly; the others are not for the decoder
+            keep = (marker == M_APP0 && seg_size >= 5 && memcmp(seg, "JFIF\0", 5) == 0) ||
+                   (marker == M_APP14 && seg_size >= 5 && memcmp(seg, "Adobe", 5) == 0);
+            break;
+        }
+        if (keep)
+            header.insert(header.end(), p + pos - 2, p + pos + length);
+        pos += length;
+        if (marker == M_SOS)
+            break;
+    }
+    if (restart_interval == 0 || max_h == 0 || max_v == 0)
+        return false;
+
+    // Locate the restart markers in the entropy-coded data
+    scan_offset = pos;
+    rst_offsets.clear();
+    for (;;)
+    {
+        const unsigned char *ff = (const unsigned char *)memchr(p + pos, 0xff, size - pos);
+        if (!ff || ff + 1 >= p + size)
+            return false;
+        pos = ff - p;
+        const int marker = p[pos + 1];
+        if (marker == 0 || marker == 0xff) // stuffed zero, or fill bytes before a marker
+        {
+            pos += marker == 0 ? 2 : 1;
+            continue;
+        }
+        if (marker >= M_RST0 && marker <= M_RST0 + 7)
+        {
+            rst_offsets.push_back(pos);
+            pos += 2;
+            continue;
+        }
+        if (marker != M_EOI)
+            return false; // DNL or another scan
+        rst_offsets.push_back(pos);
+        break;
+    }
+
+    const size_t mcus_per_row = (width + max_h * DCTSIZE - 1) / (max_h * DCTSIZE);
+    mcu_height = max_v * DCTSIZE;
+    mcu_rows = (image_height + mcu_height - 1) / mcu_height;
+    const size_t segments = (mcus_per_row * mcu_rows + restart_interval - 1) / restart_interval;
+    if (rst_offsets.size() != segments)
+        return false; // damaged; the decoder resyncs
+    // The smallest run of the segments that ends on an MCU row boundary
+    segments_per_unit = mcus_per_row / gcd(restart_interval, mcus_per_row);
+    unit_mcu_rows = segments_per_unit * restart_interval / mcus_per_row;
+    units = (segments + segments_per_unit - 1) / segments_per_unit;
+    data = p;
+    this->size = size;
+    return units > 1;
+}
+
+void JpegSegments::make_band(size_t first, size_t end, std::vector<unsigned char> &out) const
+{
+    const size_t first_segment = first * segments_per_unit;
+    const size_t end_segment = std::min(end * segments_per_unit, rst_offsets.size());
+    const size_t begin = first_segment == 0 ? scan_offset : rst_offsets[first_segment - 1] + 2;
+    const size_t finish = rst_offsets[end_segment - 1]; // the restart marker after the band, or EOI
+    out.clear();
+    out.reserve(header.size() + (finish - begin) + 2);
+    out.insert(out.end(), header.begin(), header.end());
+    const int height = std::min(unit_mcu_row(end) * mcu_height, image_height) - unit_mcu_row(first) * mcu_height;
+    out[sof_height_offset] = (unsigned char)(height >> 8);
+    out[sof_height_offset + 1] = (unsigned char)height;
+    const size_t offset = out.size() - begin;
+    out.insert(out.end(), data + begin, data + finish);
+    // The restart markers in the band are numbered from RST0
+    for (size_t i = first_segment; i + 1 < end_segment; i++)
+        out[rst_offsets[i] + offset + 1] = (unsigned char)(M_RST0 + (i - first_segment) % 8);
+    out.push_back(0xff);
+    out.push_back(M_EOI);
+}
+
+// Decodes the coefficients of the units [first, end) into the rows of the image; returns false if the band had any
+// errors or warnings.
+static bool decode_coefficients(j_decompress_ptr srcinfo, const JpegSegments &segments, size_t first, size_t end, JBLOCKARRAY *image)
+{
+    std::vector<unsigned char> band;
+    segments.make_band(first, end, band);
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = debug_foward_error(&jerr);
+    bool ok;
+    try
+    {
+        jpeg_create_decompress(&cinfo);
+        jpeg_mem_src(&cinfo, band.data(), (unsigned long)band.size());
+        jpeg_read_header(&cinfo, TRUE);
+        jvirt_barray_ptr *arrays = jpeg_read_coefficients(&cinfo);
+        for (int ci = 0; ci < srcinfo->num_components; ci++)
+        {
+            const jpeg_component_info *comp = &srcinfo->comp_info[ci];
+            const jpeg_component_info *band_comp = &cinfo.comp_info[ci];
+            const JDIMENSION v = comp->v_samp_factor;
+            const JDIMENSION first_row = segments.unit_mcu_row(first) * v;
+            const JDIMENSION rows = std::min(round_up(band_comp->height_in_blocks, v), round_up(comp->height_in_blocks, v) - first_row);
+            const size_t row_size = round_up(comp->width_in_blocks, comp->h_samp_factor) * sizeof(JBLOCK);
+            for (JDIMENSION row = 0; row < rows; row += v)
+            {
+                JBLOCKARRAY src = (*cinfo.mem->access_virt_barray)((j_common_ptr)&cinfo, arrays[ci], row, v, FALSE);
+                for (JDIMENSION i = 0; i < v && row + i < rows; i++)
+                    memcpy(image[ci][first_row + row + i], src[i], row_size);
+            }
+        }
+        ok = jerr.num_warnings == 0;
+    }
+    catch (int code)
+    {
+        ok = false;
+    }
+    jpeg_destroy_decompress(&cinfo);
+    return ok;
+}
+
+jvirt_barray_ptr *jpeg_read_coefficients_parallel(j_decompress_ptr srcinfo, const unsigned char *data, size_t size,
+                                                  const std::function<void()> &request_workspace)
+{
+    // With -maxmemory, the whole image should not be on memory at once
+    JpegSegments segments;
+    if (!JpegSegments::worth_splitting(srcinfo) || srcinfo->mem->max_memory_to_use > 0 || !segments.parse(data, size))
+        return jpeg_read_coefficients(srcinfo);
+
+    // The arrays of the whole image; they're accessed at once as the bands are written in any order
+    jvirt_barray_ptr *arrays = (jvirt_barray_ptr *)(*srcinfo->mem->alloc_small)((j_common_ptr)srcinfo, JPOOL_IMAGE, sizeof(jvirt_barray_ptr) * srcinfo->num_components);
+    for (int ci = 0; ci < srcinfo->num_components; ci++)
+    {
+        const jpeg_component_info *comp = &srcinfo->comp_info[ci];
+        const JDIMENSION rows = round_up(comp->height_in_blocks, comp->v_samp_factor);
+        arrays[ci] = (*srcinfo->mem->request_virt_barray)((j_common_ptr)srcinfo, JPOOL_IMAGE, FALSE,
+                                                          round_up(comp->width_in_blocks, comp->h_samp_factor), rows, rows);
+    }
+    (*srcinfo->mem->realize_virt_arrays)((j_common_ptr)srcinfo);
+    JBLOCKARRAY image[MAX_COMPONENTS];
+    for (int ci = 0; ci < srcinfo->num_components; ci++)
+    {
+        const jpeg_component_info *comp = &srcinfo->comp_info[ci];
+        image[ci] = (*srcinfo->mem->access_virt_barray)((j_common_ptr)srcinfo, arrays[ci], 0, round_up(comp->height_in_blocks, comp->v_samp_factor), TRUE);
+    }
+
+    const size_t units = segments.unit_count();
+    const size_t bands = std::min(units, (size_t)WorkerPool::shared().thread_count() * BANDS_PER_THREAD);
+    std::unique_ptr<bool[]> ok(new bool[bands]);
+    WorkerPool::shared().parallel_for(bands, [&](size_t b)
+                                      { ok[b] = decode_coefficients(srcinfo, segments, units * b / bands, units * (b + 1) / bands, image); });
+    if (std::find(ok.get(), ok.get() + bands, false) != ok.get() + bands)
+    {
+        debug_printf("decoding by bands failed; decoding sequentially.\n");
+        jpeg_abort_decompress(srcinfo);
+        jpeg_mem_src(srcinfo, data, (unsigned long)size);
+        jpeg_read_header(srcinfo, TRUE);
+        if (request_workspace)
+            request_workspace();
+        return jpeg_read_coefficients(srcinfo);
+    }
+    return arrays;
+}
+
+ParallelDecoderRowSource::ParallelDecoderRowSource(j_decompress_ptr srcinfo, const JpegSegments &segments)
+    : RowSource(srcinfo->output_width, srcinfo->output_height, srcinfo->output_components), segments(segments),
+      scale_denom(srcinfo->scale_denom / srcinfo->scale_num), out_color_space(srcinfo->out_color_space), next_band(0),
+      batch_rows(0), y(0)
+{
+    const size_t units = segments.unit_count();
+    const size_t bands = std::min(units, (size_t)WorkerPool::shared().thread_count() * BANDS_PER_THREAD);
+    for (size_t b = 0; b <= bands; b++)
+        band_units.push_back(units * b / bands);
+}
+
+int ParallelDecoderRowSource::output_row(size_t unit) const
+{
+    // The unit boundaries are on the MCU rows, which are multiples of 8 pixels
+    return std::min(segments.unit_mcu_row(unit) * segments.mcu_height / (int)scale_denom, height);
+}
+
+const unsigned char *ParallelDecoderRowSource::next_row()
+{
+    if (y >= batch_rows)
+        decode_batch();
+    return &rows[(size_t)width * components * y++];
+}
+
+void ParallelDecoderRowSource::decode_batch()
+{
+    const size_t first_band = next_band;
+    const size_t end_band = std::min(first_band + WorkerPool::shared().thread_count(), band_units.size() - 1);
+    const int first_row = output_row(band_units[first_band]);
+    const size_t row_size = (size_t)width * components;
+    batch_rows = output_row(band_units[end_band]) - first_row;
+    rows.resize(row_size * batch_rows);
+    y = 0;
+    next_band = end_band;
+
+    std::unique_ptr<int[]> codes(new int[end_band - first_band]);
+    WorkerPool::shared().parallel_for(end_band - first_band, [&](size_t i)
+                                      {
+        const size_t b = first_band + i;
+        // One more unit above and below for the upsampling of the edge rows
+        const size_t first = band_units[b], end = band_units[b + 1];
+        const size_t context_first = first > 0 ? first - 1 : 0;
+        const size_t context_end = std::min(end + 1, segments.unit_count());
+        std::vector<unsigned char> band;
+        segments.make_band(context_first, context_end, band);
+
+        jpeg_decompress_struct cinfo;
+        jpeg_error_mgr jerr;
+        cinfo.err = debug_foward_error(&jerr);
+        int code = 0;
+        try
+        {
+            jpeg_create_decompress(&cinfo);
+            jpeg_mem_src(&cinfo, band.data(), (unsigned long)band.size());
+            jpeg_read_header(&cinfo, TRUE);
+            cinfo.scale_num = 1;
+            cinfo.scale_denom = scale_denom;
+            cinfo.out_color_space = out_color_space;
+            jpeg_start_decompress(&cinfo);
+            if ((int)cinfo.output_width != width || cinfo.output_components != components)
+                throw EXIT_FAILURE;
+            std::vector<unsigned char> skipped(row_size);
+            for (int n = output_row(first) - output_row(context_first); n > 0; n--)
+            {
+                JSAMPROW p = skipped.data();
+                jpeg_read_scanlines(&cinfo, &p, 1);
+            }
+            for (int row = output_row(first); row < output_row(end); row++)
+            {
+                JSAMPROW p = &rows[row_size * (row - first_row)];
+                jpeg_read_scanlines(&cinfo, &p, 1);
+            }
+            jpeg_abort_decompress(&cinfo); // the context rows below are not needed
+        }
+        catch (int c)
+        {
+            code = c != 0 ? c : EXIT_FAILURE;
+        }
+        jpeg_destroy_decompress(&cinfo);
+        codes[i] = code; });
+
+    for (size_t i = 0; i < end_band - first_band; i++)
+    {
+        if (codes[i] != 0)
+        {
+            debug_printf("decoding the band %zu failed.\n", first_band + i);
+            throw codes[i];
+        }
+    }
+}
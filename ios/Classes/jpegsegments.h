@@ -0,0 +1,89 @@
+#ifndef _jpegsegments_h_
+#define _jpegsegments_h_
+
+#include <stddef.h>
+#include <functional>
+#include <vector>
+
+#include "jpeglib.h"
+#include "row_source.h"
+
+// Restart segments of a single-scan sequential Huffman JPEG (baseline or extended).
+// The entropy-coded data is split at the restart markers that fall on MCU row boundaries into bands, and each band is
+// made a standalone JPEG (the tables and the frame header of the image with the height of the band) that is decoded
+// independently, so that the bands can be decoded on the worker pool.
+class JpegSegments
+{
+public:
+    JpegSegments() : data(NULL), size(0), units(0) {}
+
+    // Locates the restart markers of the JPEG; returns false if it can't be split (progressive, arithmetic coded,
+    // multiple scans, no restart markers on the MCU row boundaries, or damaged), which should be decoded as usual.
+    // The data should be kept valid while the object is used.
+    bool parse(const unsigned char *data, size_t size);
+
+    // Returns true if the JPEG of srcinfo (after jpeg_read_header) may be split; cheap checks before parse.
+    static bool worth_splitting(j_decompress_ptr srcinfo);
+
+    // Makes the standalone JPEG of the units [first, end) into out.
+    void make_band(size_t first, size_t end, std::vector<unsigned char> &out) const;
+
+    // First MCU row of the unit; mcu_rows for unit_count() (the end of the image).
+    int unit_mcu_row(size_t unit) const { return unit < units ? (int)(unit * unit_mcu_rows) : mcu_rows; }
+    size_t unit_count() const { return units; }
+
+    int mcu_height; // in pixels
+    int mcu_rows;   // of the image
+
+private:
+    const unsigned char *data;
+    size_t size;
+    std::vector<unsigned char> header; // SOI to SOS of the bands; APPn other than JFIF/Adobe and COM are dropped
+    size_t sof_height_offset;          // of the height field of SOF in header
+    int image_height;
+    size_t segments_per_unit;
+    size_t unit_mcu_rows;
+    size_t units;
+    std::vector<size_t> rst_offsets; // of the restart markers in data; the end of the scan (EOI) is appended
+    size_t scan_offset;              // of the entropy-coded data in data
+};
+
+// Reads the DCT coefficients like jpeg_read_coefficients, decoding the bands on the worker pool if the JPEG has the
+// restart markers on the MCU row boundaries; srcinfo should have read the header of [data, size) given by jpeg_mem_src.
+// Otherwise jpeg_read_coefficients is used. If the bands can't be decoded cleanly, srcinfo is aborted, which frees the
+// arrays of the bands with the rest of the image pool, and restarted from the header before jpeg_read_coefficients, so
+// that the fallback doesn't hold two sets of the arrays; request_workspace is then called again after the header to
+// request the arrays the caller had requested on the image pool (e.g. by jtransform_request_workspace).
+// On the parallel path, the arrays are requested and realized on srcinfo but it stays in DSTATE_READY; it can be
+// passed to jpeg_copy_critical_parameters and the transupp functions, and should be just destroyed after the use.
+jvirt_barray_ptr *jpeg_read_coefficients_parallel(j_decompress_ptr srcinfo, const unsigned char *data, size_t size,
+                                                  const std::function<void()> &request_workspace = nullptr);
+
+// Rows decoded from a JPEG with restart markers by bands on the worker pool; the settings of srcinfo (scale_denom and
+// out_color_space) are used for the bands and srcinfo itself is not started. A batch of the bands is decoded at once,
+// so the memory usage is a part of the decoded image. Each band is decoded with one more unit above and below to get
+// the same upsampled rows as the sequential decoder.
+class ParallelDecoderRowSource : public RowSource
+{
+public:
+    // segments should be parsed from the JPEG of srcinfo and kept valid while the object is used; srcinfo should have
+    // the output dimensions calculated by jpeg_calc_output_dimensions.
+    ParallelDecoderRowSource(j_decompress_ptr srcinfo, const JpegSegments &segments);
+
+    const unsigned char *next_row() override;
+
+private:
+    const JpegSegments &segments;
+    unsigned int scale_denom;
+    J_COLOR_SPACE out_color_space;
+    std::vector<size_t> band_units; // first unit of each band; unit_count() is appended
+    size_t next_band;               // the first band of the next batch
+    std::vector<unsigned char> rows; // rows of the current batch
+    int batch_rows;
+    int y; // in the batch
+
+    int output_row(size_t unit) const;
+    void decode_batch();
+};
+
+#endif /* _jpegsegments_h_ */
@@ -0,0 +1,341 @@
+#include "cdjpeg.h"
+#include "cdjapi.h"
+#include "jconfigint.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "vector_dest_mgr.h"
+#include "fd_dest_mgr.h"
+#include "encoded_data.h"
+#include "file_io.h"
+#include "row_source.h"
+#include "jpegsequence.h"
+#include "worker_pool.h"
+
+// Compressor reused for the frames; the parameters (and so the tables) are set once on creation.
+struct FrameEncoder
+{
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+
+    FrameEncoder()
+    {
+        cinfo.err = debug_foward_error(&jerr);
+        jpeg_create_compress(&cinfo);
+    }
+    ~FrameEncoder()
+    {
+        jpeg_destroy_compress(&cinfo);
+    }
+};
+
+class JpegSequence
+{
+public:
+    JpegSequence(int width, int height, int stride, int input_cs, const jpeg_compress_options &options, void *context)
+        : width(width), height(height), stride(stride), input_cs(input_cs), options(options),
+          output_path(options.output_path ? options.output_path : ""), context(context), fd(-1),
+          next_index(0), pending(0), finishing(false), next_write(0), exit_code(0), written(0)
+    {
+        // The tables are shared by all the frames, so the Huffman tables can't be optimized per frame
+        this->options.single_pass = 1;
+        this->options.output_path = output_path.c_str();
+        this->options.dedupe_key = NULL;
+    }
+
+    ~JpegSequence()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // Validates the parameters and makes the tables-only datastream; for the file output, it's written to the file.
+    bool start()
+    {
+        source_width = width;
+        source_height = height;
+        if (!jpeg_compress_resolve_source(source_width, source_height, stride, input_cs, options, offset, target_width, target_height))
+            return false;
+        if (options.output != JPEG_COMPRESS_OUTPUT_VECTOR && options.output != JPEG_COMPRESS_OUTPUT_FILE)
+        {
+            debug_printf("sequence output should be either vector or file.\n");
+            return false;
+        }
+
+        std::unique_ptr<FrameEncoder> encoder = new_encoder();
+        if (!encoder)
+            return false;
+        std::vector<unsigned char> out;
+        try
+        {
+            vector_dest_mgr::init(&encoder->cinfo, out);
+            jpeg_write_tables(&encoder->cinfo);
+        }
+        catch (int code)
+        {
+            debug_printf("failed to write the tables: exit_code=%d\n", code);
+            return false;
+        }
+        tables = std::make_shared<VectorEncodedData>(std::move(out));
+        idle.push_back(std::move(encoder));
+
+        if (options.output == JPEG_COMPRESS_OUTPUT_FILE)
+        {
+            fd = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0)
+            {
+                debug_printf("can't open %s for writing\n", output_path.c_str());
+                return false;
+            }
+            if (!write_out(*tables))
+            {
+                debug_printf("can't write to %s\n", output_path.c_str());
+                close(fd);
+                fd = -1;
+                unlink(output_path.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    SharedBuffer tables_only() const { return tables; }
+    void *context_value() const { return context; }
+
+    // Queues the frame to the worker pool; returns the frame index or -1 if the sequence is already finishing.
+    int add_frame(const unsigned char *p0)
+    {
+        int index;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (finishing)
+                return -1;
+            index = next_index++;
+            pending++;
+        }
+        WorkerPool::shared().post([this, index, p0]()
+                                  {
+            std::unique_ptr<FrameEncoder> encoder = acquire_encoder();
+            SharedBuffer frame;
+            int code = encoder ? encode(*encoder, p0, frame) : EXIT_FAILURE;
+            if (encoder)
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                idle.push_back(std::move(encoder));
+            }
+            frame_done(index, code, frame); });
+        return index;
+    }
+
+    // Waits for the queued frames and closes the output; returns the exit code of the sequence.
+    int finish()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        finishing = true;
+        cv.wait(lock, [this]()
+                { return pending == 0; });
+        if (fd >= 0)
+        {
+            int code = exit_code;
+            if (code == 0 && (options.output_policy & fd_dest_mgr::FD_DEST_POLICY_DATASYNC))
+            {
+#if defined(__APPLE__)
+                if (fsync(fd) != 0)
+#else
+                if (fdatasync(fd) != 0)
+#endif
+                    code = EXIT_FAILURE;
+            }
+            if (close(fd) != 0 && code == 0)
+                code = EXIT_FAILURE;
+            fd = -1;
+            if (code != 0)
+            {
+                debug_printf("can't write to %s\n", output_path.c_str());
+                unlink(output_path.c_str());
+            }
+            exit_code = code;
+        }
+        return exit_code;
+    }
+
+private:
+    const int width, height, stride, input_cs;
+    jpeg_compress_options options;
+    std::string output_path;
+    void *context;
+    int source_width, source_height; // after the crop
+    ptrdiff_t offset;                // of the crop from p0
+    int target_width, target_height;
+    SharedBuffer tables;
+    int fd;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<std::unique_ptr<FrameEncoder>> idle; // encoders not in use
+    int next_index;
+    int pending; // frames queued but not finished yet
+    bool finishing;
+    std::map<int, std::pair<int, SharedBuffer>> unwritten; // finished frames (exit code, data) waiting for the preceding ones
+    int next_write;
+    int exit_code;
+    off_t written;
+
+    std::unique_ptr<FrameEncoder> new_encoder()
+    {
+        std::unique_ptr<FrameEncoder> encoder;
+        try
+        {
+            encoder.reset(new FrameEncoder());
+            jpeg_compress_setup(&encoder->cinfo, target_width, target_height, input_cs, options);
+        }
+        catch (int code)
+        {
+            debug_printf("failed to set up the encoder: exit_code=%d\n", code);
+            encoder.reset();
+        }
+        return encoder;
+    }
+
+    std::unique_ptr<FrameEncoder> acquire_encoder()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!idle.empty())
+            {
+                std::unique_ptr<FrameEncoder> encoder = std::move(idle.back());
+                idle.pop_back();
+                return encoder;
+            }
+        }
+        return new_encoder();
+    }
+
+    // Encodes the frame as an abbreviated datastream; the encoder is ready for the next frame on return.
+    int encode(FrameEncoder &encoder, const unsigned char *p0, SharedBuffer &frame)
+    {
+        std::vector<std::unique_ptr<RowSource>> stages;
+        stages.emplace_back(new_memory_row_source(p0 + offset, source_width, source_height, stride, input_cs, options.transform));
+        append_stages(stages, input_cs, options, target_width, target_height);
+
+        std::vector<unsigned char> out;
+        j_compress_ptr cinfo = &encoder.cinfo;
+        try
+        {
+            vector_dest_mgr::init(cinfo, out);
+            jpeg_suppress_tables(cinfo, TRUE); // they're in the tables-only datastream
+            jpeg_start_compress(cinfo, FALSE);
+            for (int y = 0; y < target_height; y++)
+            {
+                const unsigned char *pLine = stages.back()->next_row();
+                jpeg_write_scanlines(cinfo, (JSAMPARRAY)&pLine, 1);
+            }
+            jpeg_finish_compress(cinfo);
+        }
+        catch (int code)
+        {
+            debug_printf("failed to encode the frame: exit_code=%d\n", code);
+            jpeg_abort_compress(cinfo);
+            return code != 0 ? code : EXIT_FAILURE;
+        }
+        frame = std::make_shared<VectorEncodedData>(std::move(out));
+        return 0;
+    }
+
+    bool write_out(const EncodedData &data)
+    {
+        const off_t start = written;
+        if (!write_fully(fd, data.data(), data.size()))
+            return false;
+        written += data.size();
+        if (options.output_policy & fd_dest_mgr::FD_DEST_POLICY_DONTNEED)
+            fd_dest_mgr::drop_cache(fd, start, written - start);
+        return true;
+    }
+
+    // Delivers the frame; the file output is written in the order of the frames.
+    void frame_done(int index, int code, const SharedBuffer &frame)
+    {
+        if (options.output == JPEG_COMPRESS_OUTPUT_VECTOR)
+            notify_progress_v(context, PROGRESS_PASS_VECTOR_PTR, index, code == 0 ? new SharedBuffer(frame) : NULL);
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if (code != 0 && exit_code == 0)
+            exit_code = code;
+        if (options.output == JPEG_COMPRESS_OUTPUT_FILE)
+        {
+            unwritten[index] = std::make_pair(code, frame);
+            for (auto it = unwritten.begin(); it != unwritten.end() && it->first == next_write; it = unwritten.erase(it), next_write++)
+            {
+                bool ok = it->second.first == 0 && exit_code == 0;
+                if (ok && !write_out(*it->second.second))
+                {
+                    exit_code = EXIT_FAILURE;
+                    ok = false;
+                }
+                notify_progress(context, PROGRESS_PASS_OUTPUT_FILESIZE, it->first, ok ? it->second.second->size() : (size_t)-1);
+            }
+        }
+        // finish() may delete this right after the lock is released
+        if (--pending == 0)
+            cv.notify_all();
+    }
+};
+
+/// Creates a sequence encoder for the frames of width x height pixels of input_cs laid out by stride; see jpegsequence.h.
+/// options work as same as jpeg_compress_ex except that the output is always baseline with the fixed tables
+/// (single_pass) and the output should be JPEG_COMPRESS_OUTPUT_VECTOR or JPEG_COMPRESS_OUTPUT_FILE.
+/// The frames are notified to context: each vector frame by PROGRESS_PASS_VECTOR_PTR (NULL if failed), and each file
+/// frame by PROGRESS_PASS_OUTPUT_FILESIZE (-1 if failed) after it's written, with totalPass=<frame index>.
+/// Returns NULL if the parameters are invalid.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void *jpeg_sequence_create(int width, int height, int stride, int input_cs, const jpeg_compress_options *options, void *context)
+{
+    JpegSequence *sequence = new JpegSequence(width, height, stride, input_cs, *options, context);
+    if (!sequence->start())
+    {
+        delete sequence;
+        return NULL;
+    }
+    return sequence;
+}
+
+/// Returns the handle of the tables-only datastream of the sequence; see jpeg_compress_get_ptr/jpeg_compress_release.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void *jpeg_sequence_tables(void *sequence)
+{
+    return new SharedBuffer(((JpegSequence *)sequence)->tables_only());
+}
+
+/// Queues the frame; the frames are encoded in parallel on the worker pool. The pixels at p0 should be kept valid
+/// until the frame is notified. Returns the frame index, or -1 if the sequence is being finished.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int jpeg_sequence_add_frame(void *sequence, const unsigned char *p0)
+{
+    return ((JpegSequence *)sequence)->add_frame(p0);
+}
+
+/// Waits for the queued frames, closes the output and releases the sequence; PROGRESS_PASS_EXITCODE is notified last
+/// (non-zero if any of the frames failed).
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_sequence_finish(void *sequence)
+{
+    JpegSequence *s = (JpegSequence *)sequence;
+    void *context = s->context_value();
+    const int code = s->finish();
+    delete s;
+    notify_progress(context, PROGRESS_PASS_EXITCODE, 0, code);
+}
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_sequence_finish_threaded(void *sequence)
+{
+    if (!run_detached([=]()
+                      { jpeg_sequence_finish(sequence); }))
+    {
+        jpeg_sequence_finish(sequence); // the frames are encoded on the pool anyway; just wait for them here
+    }
+}
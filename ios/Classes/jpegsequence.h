@@ -0,0 +1,28 @@
+#ifndef _jpegsequence_h_
+#define _jpegsequence_h_
+
+#include "jpegcompress.h"
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+    // Sequence encoder for the same-sized frames (burst capture, screen recording, Motion-JPEG).
+    // The quantization and Huffman tables are fixed for the sequence and written once as a tables-only (abbreviated)
+    // datastream; every frame is an abbreviated datastream without the tables, which is decoded by a decompressor that
+    // has read the tables-only datastream first.
+    //
+    // With JPEG_COMPRESS_OUTPUT_FILE, the file is the raw container: the tables-only datastream followed by the frames
+    // in the order they are added, each SOI ... EOI. Every datastream can be read one by one by jpeg_read_header on the
+    // same decompress object.
+    void *jpeg_sequence_create(int width, int height, int stride, int input_cs, const jpeg_compress_options *options, void *context);
+    void *jpeg_sequence_tables(void *sequence);
+    int jpeg_sequence_add_frame(void *sequence, const unsigned char *p0);
+    void jpeg_sequence_finish(void *sequence);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _jpegsequence_h_ */
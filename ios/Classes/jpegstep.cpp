@@ -0,0 +1,168 @@
+#include "cdjpeg.h"
+#include "cdjapi.h"
+#include "jconfigint.h"
+
+#include <memory>
+#include <vector>
+
+#include "vector_dest_mgr.h"
+#include "fd_dest_mgr.h"
+#include "encoded_data.h"
+#include "file_io.h"
+#include "row_source.h"
+#include "jpegstep.h"
+
+// State of the scanline loop of the compression between the steps.
+class SteppedCompress
+{
+public:
+    SteppedCompress(const jpeg_compress_options &options)
+        : options(options), y(0), state(JPEG_COMPRESS_STEP_MORE), code(0)
+    {
+        cinfo.err = debug_foward_error(&jerr);
+        jpeg_create_compress(&cinfo);
+    }
+
+    ~SteppedCompress()
+    {
+        jpeg_destroy_compress(&cinfo);
+    }
+
+    // Builds the source stages and starts the compression; returns false if the parameters are invalid.
+    bool begin(const unsigned char *p0, int width, int height, int stride, int input_cs)
+    {
+        ptrdiff_t offset;
+        int target_width, target_height;
+        if (!jpeg_compress_resolve_source(width, height, stride, input_cs, options, offset, target_width, target_height))
+            return false;
+        if (options.output != JPEG_COMPRESS_OUTPUT_VECTOR && options.output != JPEG_COMPRESS_OUTPUT_FILE)
+        {
+            debug_printf("output should be either vector or file.\n");
+            return false;
+        }
+        stages.emplace_back(new_memory_row_source(p0 + offset, width, height, stride, input_cs, options.transform));
+        append_stages(stages, input_cs, options, target_width, target_height);
+
+        if (options.output == JPEG_COMPRESS_OUTPUT_FILE)
+        {
+            // The path is replaced only by a successful end; abandoning the steps leaves the existing file as it was
+            file.reset(new TempOutputFile(options.output_path));
+            if (!file->open())
+                return false;
+        }
+        try
+        {
+            if (file)
+                fd_dest_mgr::init(&cinfo, file->fd(), fd_dest_mgr::DEFAULT_CHUNK_SIZE, options.output_policy);
+            else
+                vector_dest_mgr::init(&cinfo, outbuffer);
+            jpeg_compress_setup(&cinfo, target_width, target_height, input_cs, options);
+            jpeg_start_compress(&cinfo, TRUE);
+        }
+        catch (int code)
+        {
+            debug_printf("Woops, exit_code=%d\n", code);
+            file.reset();
+            return false;
+        }
+        return true;
+    }
+
+    int step(int max_rows)
+    {
+        if (state != JPEG_COMPRESS_STEP_MORE)
+            return state;
+        try
+        {
+            const int height = stages.back()->height;
+            for (int n = 0; n < max_rows && y < height; n++, y++)
+            {
+                const unsigned char *pLine = stages.back()->next_row();
+                jpeg_write_scanlines(&cinfo, (JSAMPARRAY)&pLine, 1);
+            }
+            if (y == height)
+            {
+                jpeg_finish_compress(&cinfo);
+                state = JPEG_COMPRESS_STEP_DONE;
+            }
+        }
+        catch (int c)
+        {
+            debug_printf("Woops, exit_code=%d\n", c);
+            jpeg_abort_compress(&cinfo);
+            code = c != 0 ? c : EXIT_FAILURE;
+            state = JPEG_COMPRESS_STEP_ERROR;
+        }
+        return state;
+    }
+
+    // Finishes the output; returns the exit code. The output is discarded unless all the rows are encoded.
+    int end(void **result, size_t *size)
+    {
+        if (state == JPEG_COMPRESS_STEP_MORE)
+        {
+            debug_printf("compression abandoned at row %d.\n", y);
+            jpeg_abort_compress(&cinfo);
+            code = EXIT_FAILURE;
+        }
+        size_t written = outbuffer.size();
+        if (file)
+        {
+            written = code == 0 ? file->size() : 0;
+            if (code == 0 && !file->commit())
+                code = EXIT_FAILURE;
+            file.reset(); // removes the temporary file unless committed
+        }
+        else if (code == 0 && result)
+        {
+            *result = new SharedBuffer(std::make_shared<VectorEncodedData>(std::move(outbuffer)));
+        }
+        if (code == 0 && size)
+            *size = written;
+        return code;
+    }
+
+private:
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+    jpeg_compress_options options;
+    std::unique_ptr<TempOutputFile> file; // for JPEG_COMPRESS_OUTPUT_FILE
+    std::vector<unsigned char> outbuffer;
+    std::vector<std::unique_ptr<RowSource>> stages;
+    int y;     // rows written so far
+    int state; // JPEG_COMPRESS_STEP_*
+    int code;
+};
+
+/// Starts the compression of the image with [options] (see jpeg_compress_ex; output should be JPEG_COMPRESS_OUTPUT_VECTOR
+/// or JPEG_COMPRESS_OUTPUT_FILE and dedupe_key is ignored). The pixels at p0 should be kept valid until the last step.
+/// Returns NULL if the parameters are invalid.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void *jpeg_compress_begin(const unsigned char *p0, int width, int height, int stride, int input_cs, const jpeg_compress_options *options)
+{
+    SteppedCompress *encoder = new SteppedCompress(*options);
+    if (!encoder->begin(p0, width, height, stride, input_cs))
+    {
+        delete encoder;
+        return NULL;
+    }
+    return encoder;
+}
+
+/// Encodes up to [max_rows] rows (of the output image) on the calling thread; returns JPEG_COMPRESS_STEP_*.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int jpeg_compress_step(void *encoder, int max_rows)
+{
+    return ((SteppedCompress *)encoder)->step(max_rows);
+}
+
+/// Releases the encoder and returns the exit code; it can be called at any time to abandon the compression.
+/// On success, the output size is stored to *size and, for JPEG_COMPRESS_OUTPUT_VECTOR, the result handle (see
+/// jpeg_compress_get_ptr/jpeg_compress_release) is stored to *result.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int jpeg_compress_end(void *encoder, void **result, size_t *size)
+{
+    SteppedCompress *e = (SteppedCompress *)encoder;
+    const int code = e->end(result, size);
+    delete e;
+    if (code == 0)
+        debug_printf("compression succeeded.\n");
+    return code;
+}
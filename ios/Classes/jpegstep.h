@@ -0,0 +1,31 @@
+#ifndef _jpegstep_h_
+#define _jpegstep_h_
+
+#include "jpegcompress.h"
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+    enum
+    {
+        // Return values of jpeg_compress_step
+        JPEG_COMPRESS_STEP_DONE = 0,   // the image is entirely encoded; call jpeg_compress_end to get the result
+        JPEG_COMPRESS_STEP_MORE = 1,   // call jpeg_compress_step again
+        JPEG_COMPRESS_STEP_ERROR = -1, // the encoding failed; call jpeg_compress_end to release the encoder
+    };
+
+    // Resumable encoder for the callers that can't spare a thread: jpeg_compress_begin sets up the encoder, each
+    // jpeg_compress_step encodes up to max_rows rows on the calling thread and jpeg_compress_end returns the result.
+    // Nothing is notified to Dart. With options->single_pass, every step takes time proportional to max_rows; otherwise
+    // the last step also runs the multi-pass (progressive/optimized) entropy coding of the whole image.
+    void *jpeg_compress_begin(const unsigned char *p0, int width, int height, int stride, int input_cs, const jpeg_compress_options *options);
+    int jpeg_compress_step(void *encoder, int max_rows);
+    int jpeg_compress_end(void *encoder, void **result, size_t *size);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _jpegstep_h_ */
@@ -0,0 +1,274 @@
+#include "cdjpeg.h"
+#include "cdjapi.h"
+#include "jconfigint.h"
+#include "transupp.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "vector_dest_mgr.h"
+#include "fd_dest_mgr.h"
+#include "encoded_data.h"
+#include "jpegcompress.h"
+#include "jpegtiles.h"
+#include "worker_pool.h"
+
+static int round_up(int value, int unit)
+{
+    return (value + unit - 1) / unit * unit;
+}
+
+// Grid of the tiles in iMCUs; a tile is a lossless crop of the source on the iMCU boundaries.
+struct TileGrid
+{
+    int imcu_width, imcu_height; // iMCU size in pixels
+    int tile_width, tile_height; // tile size in pixels (multiple of the iMCU size)
+    int columns, rows;
+};
+
+static TileGrid make_grid(j_decompress_ptr srcinfo, const jpeg_tile_options &options)
+{
+    TileGrid grid;
+    // A single component image is not interleaved; its MCU is a block regardless of the sampling factors
+    grid.imcu_width = srcinfo->num_components == 1 ? DCTSIZE : srcinfo->max_h_samp_factor * DCTSIZE;
+    grid.imcu_height = srcinfo->num_components == 1 ? DCTSIZE : srcinfo->max_v_samp_factor * DCTSIZE;
+    grid.tile_width = round_up(options.tile_width, grid.imcu_width);
+    grid.tile_height = round_up(options.tile_height, grid.imcu_height);
+    grid.columns = ((int)srcinfo->image_width + grid.tile_width - 1) / grid.tile_width;
+    grid.rows = ((int)srcinfo->image_height + grid.tile_height - 1) / grid.tile_height;
+    return grid;
+}
+
+// Encodes the tile at (column, row) from the coefficients of the source; src_blocks[ci] are the whole block rows of
+// the component ci, which are only read here and can be shared by the concurrent calls. cinfo is destroyed on return.
+template <typename DestInit>
+static int encode_tile(j_decompress_ptr srcinfo, const std::vector<JBLOCKARRAY> &src_blocks, const TileGrid &grid, int column, int row,
+                       const jpeg_tile_options &options, j_compress_ptr cinfo, DestInit init_dest)
+{
+    const int x0 = column * grid.tile_width;
+    const int y0 = row * grid.tile_height;
+    const int width = std::min(grid.tile_width, (int)srcinfo->image_width - x0);
+    const int height = std::min(grid.tile_height, (int)srcinfo->image_height - y0);
+    const int width_in_imcus = (width + grid.imcu_width - 1) / grid.imcu_width;
+    const int height_in_imcus = (height + grid.imcu_height - 1) / grid.imcu_height;
+
+    try
+    {
+        init_dest(cinfo);
+        jpeg_c_set_int_param(cinfo, JINT_COMPRESS_PROFILE, JCP_MAX_COMPRESSION);
+        jpeg_copy_critical_parameters(srcinfo, cinfo);
+        cinfo->image_width = (JDIMENSION)width;
+        cinfo->image_height = (JDIMENSION)height;
+        cinfo->optimize_coding = TRUE;
+        if (options.progressive)
+        {
+            jpeg_simple_progression(cinfo);
+        }
+        else
+        {
+            cinfo->num_scans = 0;
+            cinfo->scan_info = NULL;
+            jpeg_c_set_bool_param(cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
+        }
+
+        jvirt_barray_ptr dst_coef_arrays[MAX_COMPONENTS];
+        for (int ci = 0; ci < cinfo->num_components; ci++)
+        {
+            const jpeg_component_info *comp = &cinfo->comp_info[ci];
+            const int h_samp = cinfo->num_components == 1 ? 1 : comp->h_samp_factor;
+            const int v_samp = cinfo->num_components == 1 ? 1 : comp->v_samp_factor;
+            dst_coef_arrays[ci] = (*cinfo->mem->request_virt_barray)((j_common_ptr)cinfo, JPOOL_IMAGE, FALSE,
+                                                                     (JDIMENSION)(width_in_imcus * h_samp),
+                                                                     (JDIMENSION)(height_in_imcus * v_samp), (JDIMENSION)v_samp);
+        }
+        jpeg_write_coefficients(cinfo, dst_coef_arrays);
+        if (options.copy_markers)
+            jcopy_markers_execute(srcinfo, cinfo, JCOPYOPT_ALL);
+
+        // Fill the tile coefficients from the source; the arrays are consumed by jpeg_finish_compress
+        for (int ci = 0; ci < cinfo->num_components; ci++)
+        {
+            const jpeg_component_info *src_comp = &srcinfo->comp_info[ci];
+            const int h_samp = cinfo->num_components == 1 ? 1 : src_comp->h_samp_factor;
+            const int v_samp = cinfo->num_components == 1 ? 1 : src_comp->v_samp_factor;
+            const int src_cols = round_up((int)src_comp->width_in_blocks, src_comp->h_samp_factor);
+            const int src_rows = round_up((int)src_comp->height_in_blocks, src_comp->v_samp_factor);
+            const int x_blocks = x0 / grid.imcu_width * h_samp;
+            const int y_blocks = y0 / grid.imcu_height * v_samp;
+            const int cols = width_in_imcus * h_samp;
+            const int copy_cols = std::max(0, std::min(cols, src_cols - x_blocks));
+            for (int by = 0; by < height_in_imcus * v_samp; by += v_samp)
+            {
+                JBLOCKARRAY dst = (*cinfo->mem->access_virt_barray)((j_common_ptr)cinfo, dst_coef_arrays[ci], (JDIMENSION)by, (JDIMENSION)v_samp, TRUE);
+                for (int k = 0; k < v_samp; k++)
+                {
+                    const int sy = y_blocks + by + k;
+                    if (sy < src_rows)
+                        memcpy(dst[k], src_blocks[ci][sy] + x_blocks, copy_cols * sizeof(JBLOCK));
+                    else
+                        memset(dst[k], 0, copy_cols * sizeof(JBLOCK));
+                    if (copy_cols < cols)
+                        memset(dst[k] + copy_cols, 0, (cols - copy_cols) * sizeof(JBLOCK));
+                }
+            }
+        }
+        jpeg_finish_compress(cinfo);
+    }
+    catch (int code)
+    {
+        debug_printf("Woops, exit_code=%d\n", code);
+        jpeg_destroy_compress(cinfo);
+        return code;
+    }
+    jpeg_destroy_compress(cinfo);
+    return 0;
+}
+
+/// Splits the JPEG into a grid of tiles of options->tile_width x options->tile_height (rounded up to the MCU size);
+/// each tile is a lossless crop (no decoding/requantization) encoded as a separate JPEG. The coefficients of the source
+/// are read only once and the tiles are encoded in parallel from them.
+/// The tiles are numbered in raster order (index = row * columns + column) and each tile is delivered as:
+/// - JPEG_COMPRESS_OUTPUT_VECTOR: the result handle by PROGRESS_PASS_VECTOR_PTR with totalPass=index
+/// - JPEG_COMPRESS_OUTPUT_FILE: written to <options->output_dir>/<column>_<row>.jpg and the size is notified by
+///   PROGRESS_PASS_OUTPUT_FILESIZE with totalPass=index
+/// The progress is notified as (number of finished tiles, number of tiles) and PROGRESS_PASS_EXITCODE comes last.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_tile_grid(const unsigned char *data, size_t size, const jpeg_tile_options *options, void *context)
+{
+    notify_progress(context, PROGRESS_PASS_EXITCODE, 0, jpeg_tile_grid_run(data, size, options, context));
+}
+
+// jpeg_tile_grid without PROGRESS_PASS_EXITCODE; returns the exit code. If context is NULL, nothing is notified.
+int jpeg_tile_grid_run(const unsigned char *data, size_t size, const jpeg_tile_options *options, void *context)
+{
+    if (options->tile_width <= 0 || options->tile_height <= 0 ||
+        (options->output != JPEG_COMPRESS_OUTPUT_VECTOR && options->output != JPEG_COMPRESS_OUTPUT_FILE) ||
+        (options->output == JPEG_COMPRESS_OUTPUT_FILE && !options->output_dir) ||
+        (options->output == JPEG_COMPRESS_OUTPUT_VECTOR && !context))
+    {
+        debug_printf("invalid tile options.\n");
+        return EXIT_FAILURE;
+    }
+
+    jpeg_decompress_struct srcinfo;
+    jpeg_error_mgr jsrcerr;
+    srcinfo.err = debug_foward_error(&jsrcerr);
+    std::vector<JBLOCKARRAY> src_blocks;
+    try
+    {
+        jpeg_create_decompress(&srcinfo);
+        jpeg_mem_src(&srcinfo, data, (unsigned long)size);
+        jcopy_markers_setup(&srcinfo, options->copy_markers ? JCOPYOPT_ALL : JCOPYOPT_NONE);
+        jpeg_read_header(&srcinfo, TRUE);
+        jvirt_barray_ptr *src_coef_arrays = jpeg_read_coefficients(&srcinfo);
+
+        // Collect the row pointers of the whole arrays here; the tiles only read the blocks through them concurrently.
+        // They're stable only if each array is entirely on memory; the arrays on the backing store (which is not
+        // thread-safe anyway) are detected by the rows not being contiguous in one buffer.
+        for (int ci = 0; ci < srcinfo.num_components; ci++)
+        {
+            const jpeg_component_info *comp = &srcinfo.comp_info[ci];
+            const int rows = round_up((int)comp->height_in_blocks, comp->v_samp_factor);
+            JBLOCKARRAY first = NULL;
+            for (int y = 0; y < rows; y += comp->v_samp_factor)
+            {
+                JBLOCKARRAY blocks = (*srcinfo.mem->access_virt_barray)((j_common_ptr)&srcinfo, src_coef_arrays[ci], (JDIMENSION)y, (JDIMENSION)comp->v_samp_factor, FALSE);
+                if (!first)
+                    first = blocks;
+                if (blocks != first + y)
+                {
+                    debug_printf("the image is too large to tile on memory.\n");
+                    throw (int)EXIT_FAILURE;
+                }
+            }
+            src_blocks.push_back(first);
+        }
+    }
+    catch (int code)
+    {
+        jpeg_destroy_decompress(&srcinfo);
+        return code != 0 ? code : EXIT_FAILURE;
+    }
+
+    const TileGrid grid = make_grid(&srcinfo, *options);
+    const size_t count = (size_t)grid.columns * grid.rows;
+    debug_printf("%dx%d tiles of %dx%d.\n", grid.columns, grid.rows, grid.tile_width, grid.tile_height);
+
+    std::atomic<int> exit_code(0);
+    std::atomic<int> finished(0);
+    WorkerPool::shared().parallel_for(count, [&](size_t i)
+                                      {
+        const int column = (int)(i % grid.columns);
+        const int row = (int)(i / grid.columns);
+
+        jpeg_compress_struct cinfo;
+        jpeg_error_mgr jdsterr;
+        cinfo.err = debug_foward_error(&jdsterr);
+        jpeg_create_compress(&cinfo);
+
+        int code;
+        if (options->output == JPEG_COMPRESS_OUTPUT_FILE)
+        {
+            const std::string path = std::string(options->output_dir) + "/" + std::to_string(column) + "_" + std::to_string(row) + ".jpg";
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0)
+            {
+                debug_printf("can't open %s for writing\n", path.c_str());
+                jpeg_destroy_compress(&cinfo);
+                code = EXIT_FAILURE;
+            }
+            else
+            {
+                code = encode_tile(&srcinfo, src_blocks, grid, column, row, *options, &cinfo, [&](j_compress_ptr cinfo)
+                                   { fd_dest_mgr::init(cinfo, fd, fd_dest_mgr::DEFAULT_CHUNK_SIZE, options->output_policy); });
+                size_t size = code == 0 ? (size_t)lseek(fd, 0, SEEK_CUR) : 0;
+                if (close(fd) != 0 && code == 0)
+                    code = EXIT_FAILURE;
+                if (code != 0)
+                    unlink(path.c_str());
+                else if (context)
+                    notify_progress(context, PROGRESS_PASS_OUTPUT_FILESIZE, (int)i, size);
+            }
+        }
+        else
+        {
+            std::vector<unsigned char> outbuffer;
+            code = encode_tile(&srcinfo, src_blocks, grid, column, row, *options, &cinfo, [&](j_compress_ptr cinfo)
+                               { vector_dest_mgr::init(cinfo, outbuffer); });
+            if (code == 0)
+                notify_progress_v(context, PROGRESS_PASS_VECTOR_PTR, (int)i, new SharedBuffer(std::make_shared<VectorEncodedData>(std::move(outbuffer))));
+        }
+
+        if (code != 0)
+        {
+            int expected = 0;
+            exit_code.compare_exchange_strong(expected, code);
+        }
+        const int done = ++finished;
+        if (context)
+            notify_progress(context, done, (int)count, 100); });
+
+    jpeg_destroy_decompress(&srcinfo);
+    return exit_code;
+}
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) void jpeg_tile_grid_threaded(const unsigned char *data, size_t size, const jpeg_tile_options *options, void *context)
+{
+    // options (and the directory) are copied; the caller may release them immediately
+    jpeg_tile_options opts = *options;
+    const bool has_dir = options->output_dir != NULL;
+    std::string dir(has_dir ? options->output_dir : "");
+    if (!run_detached([=]()
+                      {
+                          jpeg_tile_options o = opts;
+                          o.output_dir = has_dir ? dir.c_str() : NULL;
+                          jpeg_tile_grid(data, size, &o, context); }))
+    {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, -1, -1); // error
+    }
+}
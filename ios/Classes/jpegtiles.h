@@ -0,0 +1,30 @@
+#ifndef _jpegtiles_h_
+#define _jpegtiles_h_
+
+#include <stddef.h>
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+    // Options for jpeg_tile_grid; the layout is shared with _JpegTileOptions on the Dart side.
+    typedef struct jpeg_tile_options
+    {
+        int tile_width;         // rounded up to the multiple of the MCU width (8 or 16 typically)
+        int tile_height;        // rounded up to the multiple of the MCU height
+        int output;             // JPEG_COMPRESS_OUTPUT_VECTOR or JPEG_COMPRESS_OUTPUT_FILE
+        const char *output_dir; // for JPEG_COMPRESS_OUTPUT_FILE; each tile is written to <output_dir>/<column>_<row>.jpg
+        int output_policy;      // fd_dest_mgr::FD_DEST_POLICY_* for JPEG_COMPRESS_OUTPUT_FILE
+        int copy_markers;       // non-zero to copy the APPn/COM markers of the source to every tile
+        int progressive;        // non-zero for progressive tiles; otherwise baseline with optimized Huffman tables
+    } jpeg_tile_options;
+
+    void jpeg_tile_grid(const unsigned char *data, size_t size, const jpeg_tile_options *options, void *context);
+    int jpeg_tile_grid_run(const unsigned char *data, size_t size, const jpeg_tile_options *options, void *context);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _jpegtiles_h_ */
@@ -27,8 +27,74 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <atomic>
+#include <chrono>
 
 #include "vector_dest_mgr.h"
+#include "fd_dest_mgr.h"
+#include "sha256.h"
+#include "jpeg_cache.h"
+#include "file_io.h"
+#include "spill_mem_mgr.h"
+#include "jpegsegments.h"
+#include "jpegtransform.h"
+#include "batch_io.h"
+#include "worker_pool.h"
+
+static const int EXIF_TAG_ORIENTATION = 0x0112;
+static const int EXIF_TYPE_SHORT = 3;
+
+// The lossless transform that brings the image to the upright position for each EXIF orientation value (1-8).
+static const JXFORM_CODE orientation_transforms[] = {
+    JXFORM_NONE, JXFORM_NONE, JXFORM_FLIP_H, JXFORM_ROT_180, JXFORM_FLIP_V,
+    JXFORM_TRANSPOSE, JXFORM_ROT_90, JXFORM_TRANSVERSE, JXFORM_ROT_270};
+
+static unsigned exif_get16(const JOCTET *p, bool motorola)
+{
+    return motorola ? (p[0] << 8 | p[1]) : (p[1] << 8 | p[0]);
+}
+
+static unsigned exif_get32(const JOCTET *p, bool motorola)
+{
+    return motorola ? (exif_get16(p, true) << 16 | exif_get16(p + 2, true))
+                    : (exif_get16(p + 2, false) << 16 | exif_get16(p, false));
+}
+
+// Returns the address of the Orientation value in IFD0 of the saved EXIF marker, or NULL if the marker has no
+// (valid) Orientation tag. *motorola receives the byte order of the value.
+static JOCTET *exif_orientation_field(jpeg_saved_marker_ptr marker, bool *motorola)
+{
+    if (marker->marker != JPEG_APP0 + 1 || marker->data_length < 6 + 8 ||
+        memcmp(marker->data, "Exif\0\0", 6) != 0)
+        return NULL;
+    JOCTET *tiff = marker->data + 6;
+    const size_t size = marker->data_length - 6;
+    if (tiff[0] == 'M' && tiff[1] == 'M')
+        *motorola = true;
+    else if (tiff[0] == 'I' && tiff[1] == 'I')
+        *motorola = false;
+    else
+        return NULL;
+    if (exif_get16(tiff + 2, *motorola) != 42)
+        return NULL;
+    const size_t ifd = exif_get32(tiff + 4, *motorola);
+    if (ifd < 8 || ifd + 2 > size)
+        return NULL;
+    const unsigned count = exif_get16(tiff + ifd, *motorola);
+    for (unsigned i = 0; i < count; i++)
+    {
+        JOCTET *entry = tiff + ifd + 2 + i * 12;
+        if (entry + 12 > tiff + size)
+            return NULL;
+        if (exif_get16(entry, *motorola) == EXIF_TAG_ORIENTATION)
+        {
+            if (exif_get16(entry + 2, *motorola) != EXIF_TYPE_SHORT || exif_get32(entry + 4, *motorola) != 1)
+                return NULL;
+            return entry + 8; // the value is stored in the first 2 bytes of the value field
+        }
+    }
+    return NULL;
+}
 
 class JpegTran
 {
@@ -72,8 +138,13 @@ public:
     size_t image_size;
     boolean strict;                      /* for -strict switch */
     boolean prefer_smallest;             /* use smallest of input or result file (if no image-changing options supplied) */
+    boolean auto_orient;                 /* -autoorient switch */
     JCOPY_OPTION copyoption;             /* -copy switch */
+    int output_policy;                   /* -dropcache/-fsync switches; fd_dest_mgr::FD_DEST_POLICY_* */
+    const char *temp_dir;                /* -tempdir switch; for the arrays exceeding -maxmemory */
+    std::unique_ptr<spill_mem_mgr> spill; /* outlives the JPEG objects */
     jpeg_transform_info transformoption; /* image transformation options */
+    std::string cache_params;            /* switches that affect the output; a part of the cache key */
 
     void init()
     {
@@ -81,7 +152,10 @@ public:
         image_ptr = NULL;
         image_size = 0;
         strict = FALSE;
+        auto_orient = FALSE;
         copyoption = JCOPYOPT_DEFAULT;
+        output_policy = fd_dest_mgr::FD_DEST_POLICY_NONE;
+        temp_dir = getenv("TMPDIR");
         transformoption.transform = JXFORM_NONE;
         transformoption.perfect = FALSE;
         transformoption.trim = FALSE;
@@ -103,7 +177,10 @@ public:
         debug_printf("  -progressive   Create progressive JPEG file (enabled by default)\n");
         debug_printf("  -revert        Revert to standard defaults (instead of mozjpeg defaults)\n");
         debug_printf("  -fastcrush     Disable progressive scan optimization\n");
+        debug_printf("  -fastdecode N  Baseline with optimized Huffman table and restart markers every N MCU rows\n"
+                     "                 (or N MCUs with B) for faster and parallel decoding; overrides -progressive\n");
         debug_printf("Switches for modifying the image:\n");
+        debug_printf("  -autoorient    Rotate/flip image upright according to the EXIF orientation and reset it\n");
         debug_printf("  -crop WxH+X+Y  Crop to a rectangular region\n");
         debug_printf("  -flip [horizontal|vertical]  Mirror image (left-right or top-bottom)\n");
         debug_printf("  -grayscale     Reduce to grayscale (omit color data)\n");
@@ -116,8 +193,11 @@ public:
         debug_printf("Switches for advanced users:\n");
         debug_printf("  -restart N     Set restart interval in rows, or in blocks with B\n");
         debug_printf("  -maxmemory N   Maximum memory to use (in kbytes)\n");
+        debug_printf("  -tempdir dir   Directory for the temporary file used beyond -maxmemory\n");
         debug_printf("  -maxscans N    Maximum number of scans to allow in input file\n");
         debug_printf("  -outfile name  Specify name for output file\n");
+        debug_printf("  -dropcache     Drop the output file pages from the OS cache while writing\n");
+        debug_printf("  -fsync         Flush the output file data to the storage before finishing\n");
         debug_printf("  -strict        Treat all warnings as fatal\n");
         debug_printf("  -verbose  or  -debug   Emit debug output\n");
         jt_exit(EXIT_FAILURE);
@@ -140,6 +220,28 @@ public:
         }
     }
 
+    void parse_restart(j_compress_ptr cinfo, const char *arg)
+    /* Restart interval in MCU rows (or in MCUs with 'b') for -restart and -fastdecode. */
+    {
+        long lval;
+        char ch = 'x';
+
+        if (sscanf(arg, "%ld%c", &lval, &ch) < 1)
+            usage();
+        if (lval < 0 || lval > 65535L)
+            usage();
+        if (ch == 'b' || ch == 'B')
+        {
+            cinfo->restart_interval = (unsigned int)lval;
+            cinfo->restart_in_rows = 0; /* else prior '-restart n' overrides me */
+        }
+        else
+        {
+            cinfo->restart_in_rows = (int)lval;
+            /* restart_interval will be computed during startup */
+        }
+    }
+
     size_t parse_switches(j_compress_ptr cinfo, size_t argc, char **argv,
                           int last_file_arg_seen, boolean for_real)
     /* Parse optional switches.
@@ -150,7 +252,9 @@ public:
  */
     {
         boolean simple_progressive = cinfo->num_scans == 0 ? FALSE : TRUE;
+        boolean fast_decode = FALSE;
         cinfo->err->trace_level = 0;
+        cache_params.clear();
 
         /* Scan command line options, adjust parameters */
         size_t argn;
@@ -168,9 +272,16 @@ public:
                 }
                 break; /* else done parsing switches */
             }
+            const size_t switch_index = argn;
+            bool affects_output = true;
             arg++; /* advance past switch marker character */
 
-            if (keymatch(arg, "copy", 2))
+            if (keymatch(arg, "autoorient", 2))
+            {
+                /* Select the transform by the EXIF orientation; it's resolved on reading the header. */
+                auto_orient = TRUE;
+            }
+            else if (keymatch(arg, "copy", 2))
             {
                 /* Select which extra markers to copy. */
                 if (++argn >= argc) /* advance to next argument */
@@ -206,6 +317,7 @@ public:
             }
             else if (keymatch(arg, "debug", 1) || keymatch(arg, "verbose", 1))
             {
+                affects_output = false;
                 /* Enable debug printouts. */
                 /* On first -d, print version identification */
                 // static boolean printed_version = FALSE;
@@ -241,6 +353,37 @@ public:
 
                 prefer_smallest = FALSE;
             }
+            else if (keymatch(arg, "dropcache", 2))
+            {
+                /* Don't keep the output file on the page cache. */
+                output_policy |= fd_dest_mgr::FD_DEST_POLICY_DONTNEED;
+                affects_output = false;
+            }
+            else if (keymatch(arg, "fsync", 2))
+            {
+                /* Flush the output file data before finishing. */
+                output_policy |= fd_dest_mgr::FD_DEST_POLICY_DATASYNC;
+                affects_output = false;
+            }
+            else if (keymatch(arg, "tempdir", 2))
+            {
+                /* Directory for the coefficient arrays spilled beyond -maxmemory. */
+                if (++argn >= argc) /* advance to next argument */
+                    usage();
+                temp_dir = argv[argn];
+                affects_output = false;
+            }
+            else if (keymatch(arg, "fastdecode", 5))
+            {
+                /* Baseline with optimized Huffman tables and restart markers for the decoders. */
+                if (++argn >= argc) /* advance to next argument */
+                    usage();
+                parse_restart(cinfo, argv[argn]);
+                /* The defaults of jpeg_copy_critical_parameters are baseline by this */
+                jpeg_c_set_int_param(cinfo, JINT_COMPRESS_PROFILE, JCP_FASTEST);
+                fast_decode = TRUE;
+                prefer_smallest = FALSE;
+            }
             else if (keymatch(arg, "fastcrush", 4))
             {
                 jpeg_c_set_bool_param(cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
@@ -264,6 +407,7 @@ public:
                 if (ch == 'm' || ch == 'M')
                     lval *= 1000L;
                 cinfo->mem->max_memory_to_use = lval * 1000L;
+                affects_output = false;
             }
             else if (keymatch(arg, "optimize", 1) || keymatch(arg, "optimise", 1))
             {
@@ -276,6 +420,7 @@ public:
                 if (++argn >= argc) /* advance to next argument */
                     usage();
                 outfilename = argv[argn]; /* save it away for later use */
+                affects_output = false;
             }
             else if (keymatch(arg, "perfect", 2))
             {
@@ -293,25 +438,9 @@ public:
             else if (keymatch(arg, "restart", 1))
             {
                 /* Restart interval in MCU rows (or in MCUs with 'b'). */
-                long lval;
-                char ch = 'x';
-
                 if (++argn >= argc) /* advance to next argument */
                     usage();
-                if (sscanf(argv[argn], "%ld%c", &lval, &ch) < 1)
-                    usage();
-                if (lval < 0 || lval > 65535L)
-                    usage();
-                if (ch == 'b' || ch == 'B')
-                {
-                    cinfo->restart_interval = (unsigned int)lval;
-                    cinfo->restart_in_rows = 0; /* else prior '-restart n' overrides me */
-                }
-                else
-                {
-                    cinfo->restart_in_rows = (int)lval;
-                    /* restart_interval will be computed during startup */
-                }
+                parse_restart(cinfo, argv[argn]);
             }
             else if (keymatch(arg, "revert", 3))
             {
@@ -375,18 +504,96 @@ public:
                 debug_printf("*** unknown/unsupported option: -%s\n", arg);
                 usage(); /* bogus switch */
             }
+
+            if (affects_output)
+            {
+                for (size_t i = switch_index; i <= argn; i++)
+                    cache_params.append(argv[i]).push_back('\0');
+            }
         }
 
         /* Post-switch-scanning cleanup */
         if (for_real)
         {
-            if (simple_progressive) /* process -progressive; -scans can override */
+            if (fast_decode) /* -fastdecode overrides -progressive */
+            {
+                cinfo->num_scans = 0;
+                cinfo->scan_info = NULL;
+                cinfo->optimize_coding = TRUE;
+                jpeg_c_set_bool_param(cinfo, JBOOLEAN_OPTIMIZE_SCANS, FALSE);
+            }
+            else if (simple_progressive) /* process -progressive; -scans can override */
+            {
                 jpeg_simple_progression(cinfo);
+            }
         }
 
         return argn; /* return index of next arg (file name) */
     }
 
+    void setup_auto_orient(j_decompress_ptr srcinfo)
+    /* The EXIF marker is needed to find the orientation even if it's not copied. */
+    {
+        if (copyoption == JCOPYOPT_NONE || copyoption == JCOPYOPT_COMMENTS)
+            jpeg_save_markers(srcinfo, JPEG_APP0 + 1, 0xFFFF);
+    }
+
+    void apply_auto_orient(j_decompress_ptr srcinfo)
+    /* Select the transform that cancels the EXIF orientation. */
+    {
+        if (transformoption.transform != JXFORM_NONE)
+        {
+            debug_printf("%s: -autoorient can't be combined with other transformations\n", progname);
+            usage();
+        }
+        const unsigned orientation = reset_orientation_marker(srcinfo);
+        if (orientation >= 2 && orientation <= 8)
+        {
+            select_transform(orientation_transforms[orientation]);
+            /* Drop the partial edge blocks rather than leaving them in the wrong place */
+            if (!transformoption.perfect)
+                transformoption.trim = TRUE;
+            prefer_smallest = FALSE;
+        }
+    }
+
+    unsigned reset_orientation_marker(j_decompress_ptr srcinfo)
+    /* Reset the EXIF orientation of the saved marker to 1 (upright) for
+     * jcopy_markers_execute and unlink the EXIF marker saved only for the
+     * orientation; returns the original orientation (0 if not found).
+     */
+    {
+        unsigned orientation = 0;
+        for (jpeg_saved_marker_ptr marker = srcinfo->marker_list; marker; marker = marker->next)
+        {
+            bool motorola;
+            JOCTET *field = exif_orientation_field(marker, &motorola);
+            if (!field)
+                continue;
+            orientation = exif_get16(field, motorola);
+            if (orientation >= 2 && orientation <= 8)
+            {
+                field[0] = motorola ? 0 : 1;
+                field[1] = motorola ? 1 : 0;
+            }
+            break;
+        }
+
+        /* Unlink the EXIF marker saved only for the orientation */
+        if (copyoption == JCOPYOPT_NONE || copyoption == JCOPYOPT_COMMENTS)
+        {
+            jpeg_saved_marker_ptr *link = &srcinfo->marker_list;
+            while (*link)
+            {
+                if ((*link)->marker == JPEG_APP0 + 1)
+                    *link = (*link)->next;
+                else
+                    link = &(*link)->next;
+            }
+        }
+        return orientation;
+    }
+
     static void my_emit_message(j_common_ptr cinfo, int msg_level)
     {
         if (msg_level < 0)
@@ -401,10 +608,188 @@ public:
         }
     }
 
+    // Delivers the cached output in the same way as the normal path; returns false if not cached.
+    bool serve_from_cache(j_common_ptr cinfo, const std::string &cache_key, const unsigned char *input, size_t input_size, void *buf_address, size_t buf_size)
+    {
+        SharedBuffer cached = JpegCache::shared().lookup(cache_key);
+        if (!cached)
+            return false;
+        if (buf_address)
+        {
+            if (cached->size() < buf_size)
+            {
+                memcpy(buf_address, cached->data(), cached->size());
+                post_progress_monitor(cinfo, PROGRESS_PASS_OUTPUT_FILESIZE, PROGRESS_TPASS_OPTIMIZED, cached->size());
+            }
+            else
+            {
+                post_progress_monitor(cinfo, PROGRESS_PASS_OUTPUT_FILESIZE, PROGRESS_TPASS_ORIGINAL, buf_size);
+            }
+            return true;
+        }
+        if (!outfilename)
+            return false;
+        if (!replace_file(outfilename, cached->data(), cached->size()))
+        {
+            debug_printf("%s: can't write to %s\n", progname, outfilename);
+            jt_exit(EXIT_FAILURE);
+        }
+        const bool original = cached->size() == input_size && memcmp(cached->data(), input, input_size) == 0;
+        post_progress_monitor(cinfo, PROGRESS_PASS_OUTPUT_FILESIZE, original ? PROGRESS_TPASS_ORIGINAL : PROGRESS_TPASS_OPTIMIZED, cached->size());
+        return true;
+    }
+
+    // Transforms the JPEG data of srcinfo (its source is already set to [input, input_size)) by the switches into the
+    // destination installed by init_dest; dstinfo should have been parsed the switches once. Errors are thrown by jt_exit.
+    template <typename DestInit>
+    void transcode(j_decompress_ptr srcinfo, j_compress_ptr dstinfo, const unsigned char *input, size_t input_size, DestInit init_dest)
+    {
+        /* With -maxmemory, the coefficient arrays that don't fit are backed by a temporary file */
+        if (srcinfo->mem->max_memory_to_use > 0)
+        {
+            spill.reset(new spill_mem_mgr(temp_dir));
+            spill->install((j_common_ptr)srcinfo);
+            spill->install((j_common_ptr)dstinfo);
+        }
+
+        /* Enable saving of extra markers that we want to copy */
+        jcopy_markers_setup(srcinfo, copyoption);
+        if (auto_orient)
+            setup_auto_orient(srcinfo);
+
+        /* Read file header */
+        jpeg_read_header(srcinfo, TRUE);
+
+        /* -autoorient: the transform depends on the EXIF marker of the input */
+        if (auto_orient)
+            apply_auto_orient(srcinfo);
+
+        /* Any space needed by a transform option must be requested before
+         * jpeg_read_coefficients so that memory allocation will be done right.
+         */
+        /* Fail right away if -perfect is given and transformation is not perfect. */
+        if (!jtransform_request_workspace(srcinfo, &transformoption))
+        {
+            debug_printf("%s: transformation is not perfect\n", progname);
+            jt_exit(EXIT_FAILURE);
+        }
+
+        /* Read source file as DCT coefficients; the restart segments are decoded in parallel if possible */
+        /* If the bands fail, srcinfo is restarted from the header; the saved markers and the workspace are made again */
+        jvirt_barray_ptr *src_coef_arrays = jpeg_read_coefficients_parallel(srcinfo, input, input_size, [&]()
+                                                                            {
+                                                                                if (auto_orient)
+                                                                                    reset_orientation_marker(srcinfo);
+                                                                                jtransform_request_workspace(srcinfo, &transformoption); });
+
+        /* Initialize destination compression parameters from source values */
+        jpeg_copy_critical_parameters(srcinfo, dstinfo);
+
+        /* Adjust destination parameters if required by transform options;
+         * also find out which set of coefficient arrays will hold the output.
+         */
+        jvirt_barray_ptr *dst_coef_arrays = jtransform_adjust_parameters(srcinfo, dstinfo,
+                                                                         src_coef_arrays,
+                                                                         &transformoption);
+
+        /* Adjust default compression parameters by re-parsing the options */
+        parse_switches(dstinfo, argv.size(), &argv[0], 0, TRUE);
+
+        init_dest(dstinfo);
+
+        // Start compressor (note no image data is actually written here)
+        jpeg_write_coefficients(dstinfo, dst_coef_arrays);
+
+        // Copy to the output file any extra markers that we want to preserve
+        jcopy_markers_execute(srcinfo, dstinfo, copyoption);
+
+        // Execute image transformation, if any; the rotations and flips are done by bands on the worker pool
+        jtransform_execute_transformation_parallel(srcinfo, dstinfo, src_coef_arrays,
+                                                   &transformoption);
+
+        jpeg_finish_compress(dstinfo);
+
+        if (spill && spill->arrays_spilled() > 0)
+        {
+            debug_printf("%s: %d coefficient arrays (%lld bytes) spilled to %s; %lld bytes on memory\n", progname,
+                         spill->arrays_spilled(), (long long)spill->bytes_spilled(), temp_dir ? temp_dir : "/tmp",
+                         (long long)spill->bytes_in_memory());
+            post_progress_monitor((j_common_ptr)dstinfo, PROGRESS_PASS_SPILL, spill->arrays_spilled(), (size_t)spill->bytes_spilled());
+        }
+    }
+
+    // Transforms the JPEG data on memory into output by the switches (argv should have no file names); for the batch.
+    // If the output is not smaller than the input and the switches don't change the image, the input is returned as is.
+    // Returns the exit code; nothing is notified.
+    int transcode_buffer(const unsigned char *input, size_t size, std::vector<unsigned char> &output)
+    {
+        int result;
+        jpeg_decompress_struct srcinfo;
+        memset(&srcinfo, 0, sizeof(srcinfo));
+        jpeg_error_mgr jsrcerr;
+        srcinfo.err = debug_foward_error(&jsrcerr);
+        jpeg_compress_struct dstinfo;
+        memset(&dstinfo, 0, sizeof(dstinfo));
+        jpeg_error_mgr jdsterr;
+        dstinfo.err = debug_foward_error(&jdsterr);
+        try
+        {
+            jpeg_create_decompress(&srcinfo);
+            jpeg_create_compress(&dstinfo);
+            parse_switches(&dstinfo, argv.size(), &argv[0], 0, FALSE);
+            jsrcerr.trace_level = jdsterr.trace_level;
+            srcinfo.mem->max_memory_to_use = dstinfo.mem->max_memory_to_use;
+            if (strict)
+                jsrcerr.emit_message = my_emit_message;
+
+            jpeg_mem_src(&srcinfo, input, (unsigned long)size);
+            transcode(&srcinfo, &dstinfo, input, size, [&](j_compress_ptr dstinfo)
+                      { vector_dest_mgr::init(dstinfo, output); });
+            if (prefer_smallest && output.size() >= size)
+                output.assign(input, input + size);
+            result = jsrcerr.num_warnings + jdsterr.num_warnings ? EXIT_WARNING : EXIT_SUCCESS;
+        }
+        catch (int code)
+        {
+            result = code != 0 ? code : EXIT_FAILURE;
+        }
+        jpeg_destroy_decompress(&srcinfo);
+        jpeg_destroy_compress(&dstinfo);
+        return result;
+    }
+
+    // Parses the switches once to check them for the batch, where argv should have no file names; the switches such as
+    // output_policy are set. Returns false if they are invalid.
+    bool parse_batch_switches()
+    {
+        jpeg_compress_struct cinfo;
+        memset(&cinfo, 0, sizeof(cinfo));
+        jpeg_error_mgr jerr;
+        cinfo.err = debug_foward_error(&jerr);
+        bool ok = true;
+        try
+        {
+            jpeg_create_compress(&cinfo);
+            if (parse_switches(&cinfo, argv.size(), &argv[0], 0, FALSE) < argv.size())
+            {
+                debug_printf("%s: no file names are allowed for the batch\n", progname);
+                ok = false;
+            }
+        }
+        catch (int code)
+        {
+            ok = false;
+        }
+        jpeg_destroy_compress(&cinfo);
+        return ok;
+    }
+
     int jpegtran()
     {
         std::vector<unsigned char> inbuffer;
         int result = 0;
+        int outfd = -1;
+        std::string tmpfilename; /* the output is streamed into it, then renamed to outfilename */
 
         /* Initialize the JPEG decompression object with default error handling. */
         jpeg_decompress_struct srcinfo;
@@ -502,35 +887,20 @@ public:
                 mem_src_ok = true;
             }
 
-            /* Enable saving of extra markers that we want to copy */
-            jcopy_markers_setup(&srcinfo, copyoption);
-
-            /* Read file header */
-            jpeg_read_header(&srcinfo, TRUE);
-
-            /* Any space needed by a transform option must be requested before
-             * jpeg_read_coefficients so that memory allocation will be done right.
-             */
-            /* Fail right away if -perfect is given and transformation is not perfect. */
-            if (!jtransform_request_workspace(&srcinfo, &transformoption))
+            /* The output may be served from the persistent cache keyed by the input content and the switches */
+            std::string cache_key;
+            const unsigned char *input = buf_address ? (const unsigned char *)buf_address : &inbuffer[0];
+            const size_t input_size = buf_address ? (size_t)buf_size : inbuffer.size();
+            if (JpegCache::shared().enabled())
             {
-                debug_printf("%s: transformation is not perfect\n", progname);
-                jt_exit(EXIT_FAILURE);
+                Sha256 hash;
+                hash.update_string(cache_params);
+                hash.update(input, input_size);
+                cache_key = "jpegtran-" + hash.hex();
+                if (serve_from_cache((j_common_ptr)&dstinfo, cache_key, input, input_size, buf_address, (size_t)buf_size))
+                    jt_exit(EXIT_SUCCESS);
             }
 
-            /* Read source file as DCT coefficients */
-            jvirt_barray_ptr *src_coef_arrays = jpeg_read_coefficients(&srcinfo);
-
-            /* Initialize destination compression parameters from source values */
-            jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
-
-            /* Adjust destination parameters if required by transform options;
-             * also find out which set of coefficient arrays will hold the output.
-             */
-            jvirt_barray_ptr *dst_coef_arrays = jtransform_adjust_parameters(&srcinfo, &dstinfo,
-                                                                             src_coef_arrays,
-                                                                             &transformoption);
-
             /* Open the output file. */
             if (!buf_address && !outfilename)
             {
@@ -538,27 +908,37 @@ public:
                 jt_exit(EXIT_FAILURE);
             }
 
-            /* Adjust default compression parameters by re-parsing the options */
-            file_index = parse_switches(&dstinfo, argv.size(), &argv[0], 0, TRUE);
-
-            /* Specify data destination for compression */
+            /* Specify data destination for compression; the output file is written while compressing */
             std::vector<unsigned char> outbuffer;
-            vector_dest_mgr::init(&dstinfo, outbuffer);
-
-            // Start compressor (note no image data is actually written here)
-            jpeg_write_coefficients(&dstinfo, dst_coef_arrays);
-
-            // Copy to the output file any extra markers that we want to preserve
-            jcopy_markers_execute(&srcinfo, &dstinfo, copyoption);
-
-            // Execute image transformation, if any
-            jtransform_execute_transformation(&srcinfo, &dstinfo, src_coef_arrays,
-                                              &transformoption);
-
-            jpeg_finish_compress(&dstinfo);
+            transcode(&srcinfo, &dstinfo, input, input_size, [&](j_compress_ptr dstinfo)
+                      {
+                if (buf_address && buf_size)
+                {
+                    vector_dest_mgr::init(dstinfo, outbuffer);
+                }
+                else
+                {
+                    tmpfilename = temp_path_for(outfilename);
+                    outfd = open(tmpfilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+                    if (outfd < 0)
+                    {
+                        tmpfilename.clear();
+                        debug_printf("%s: can't open %s for writing\n", progname, outfilename);
+                        jt_exit(EXIT_FAILURE);
+                    }
+                    fd_dest_mgr::init(dstinfo, outfd, fd_dest_mgr::DEFAULT_CHUNK_SIZE, output_policy);
+                } });
 
+            const bool cacheable = !cache_key.empty() && jsrcerr.num_warnings + jdsterr.num_warnings == 0;
             if (buf_address && buf_size)
             {
+                if (cacheable)
+                {
+                    if (outbuffer.size() < buf_size)
+                        JpegCache::shared().store(cache_key, &outbuffer[0], outbuffer.size());
+                    else
+                        JpegCache::shared().store(cache_key, input, input_size);
+                }
                 if (outbuffer.size() < buf_size)
                 {
                     memcpy(buf_address, &outbuffer[0], outbuffer.size());
@@ -571,20 +951,32 @@ public:
             }
             else
             {
-                const auto &resultBuffer = prefer_smallest && inbuffer.size() < outbuffer.size() ? inbuffer : outbuffer;
-                FILE *fp = fopen(outfilename, WRITE_BINARY);
-                if (!fp)
+                size_t outsize = fd_dest_mgr::bytes_written(&dstinfo);
+                if (prefer_smallest && !inbuffer.empty() && inbuffer.size() < outsize)
                 {
-                    debug_printf("%s: can't open %s for writing\n", progname, outfilename);
-                    jt_exit(EXIT_FAILURE);
+                    // The input is smaller than the result; the temporary file gets a copy of the input instead
+                    if (lseek(outfd, 0, SEEK_SET) != 0 || !write_fully(outfd, &inbuffer[0], inbuffer.size()) ||
+                        ftruncate(outfd, (off_t)inbuffer.size()) != 0)
+                    {
+                        debug_printf("%s: can't write to %s\n", progname, outfilename);
+                        jt_exit(EXIT_FAILURE);
+                    }
+                    post_progress_monitor((j_common_ptr)&dstinfo, PROGRESS_PASS_OUTPUT_FILESIZE, PROGRESS_TPASS_ORIGINAL, inbuffer.size());
                 }
-                size_t ret = fwrite(&resultBuffer[0], resultBuffer.size(), 1, fp);
-                fclose(fp);
-                if (ret != 1)
+                else
+                {
+                    post_progress_monitor((j_common_ptr)&dstinfo, PROGRESS_PASS_OUTPUT_FILESIZE, PROGRESS_TPASS_OPTIMIZED, outsize);
+                }
+                int fd = outfd;
+                outfd = -1;
+                if (close(fd) != 0 || rename(tmpfilename.c_str(), outfilename) != 0)
                 {
-                    debug_printf("%s: can't write to %s\n", progname, input_filename);
+                    debug_printf("%s: can't write to %s\n", progname, outfilename);
                     jt_exit(EXIT_FAILURE);
                 }
+                tmpfilename.clear();
+                if (cacheable)
+                    JpegCache::shared().store_file(cache_key, outfilename);
             }
             result = jsrcerr.num_warnings + jdsterr.num_warnings ? EXIT_WARNING : EXIT_SUCCESS;
         }
@@ -593,6 +985,12 @@ public:
             result = code;
         }
 
+        // Don't leave the partially written output; the existing output file is untouched
+        if (outfd >= 0)
+            close(outfd);
+        if (!tmpfilename.empty())
+            unlink(tmpfilename.c_str());
+
         jpeg_destroy_decompress(&srcinfo);
         jpeg_destroy_compress(&dstinfo);
         post_progress_monitor((j_common_ptr)&dstinfo, PROGRESS_PASS_EXITCODE, 0, result);
@@ -626,3 +1024,205 @@ extern "C" __attribute__((visibility("default"))) __attribute__((used)) int jpeg
     }
     return 0;
 }
+
+/// Transforms the JPEG files inputs[i] into outputs[i] (i < count) by the jpegtran switches in argv (without file
+/// names; argv[0] is the program name) using the I/O threads and the worker pool; an output may be the input itself as
+/// it's replaced only when the file is done. For each file, PROGRESS_PASS_OUTPUT_FILESIZE is notified with totalPass set
+/// to the index and the output size ((size_t)-1 if failed), followed by the (done, count, 100) progress.
+/// The aggregate result is stored to *stats (can be NULL) and PROGRESS_PASS_EXITCODE is notified last (non-zero if any
+/// of the files failed). Returns the exit code.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int jpegtran_batch(int argc, char **argv, const char **inputs, const char **outputs, int count, jpeg_batch_stats *stats, void *context)
+{
+    JpegTran switches(argc, argv, context);
+    if (!switches.parse_batch_switches())
+    {
+        if (stats)
+        {
+            *stats = {};
+            stats->files_failed = count;
+        }
+        notify_progress(context, PROGRESS_PASS_EXITCODE, 0, EXIT_FAILURE);
+        return EXIT_FAILURE;
+    }
+
+    std::atomic<int> done_count(0);
+    BatchFileProcessor batch(inputs, outputs, count > 0 ? count : 0, switches.output_policy);
+    const jpeg_batch_stats result = batch.run(
+        [&](size_t, const unsigned char *input, size_t size, std::vector<unsigned char> &output)
+        {
+            // the switches are parsed into each instance; they can't be shared among the workers
+            return JpegTran(argc, argv, NULL).transcode_buffer(input, size, output);
+        },
+        [&](size_t index, int, int64_t size)
+        {
+            notify_progress(context, PROGRESS_PASS_OUTPUT_FILESIZE, (int)index, size >= 0 ? (size_t)size : (size_t)-1);
+            notify_progress(context, ++done_count, count, 100);
+        });
+    if (stats)
+        *stats = result;
+    const int code = result.files_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    notify_progress(context, PROGRESS_PASS_EXITCODE, 0, code);
+    return code;
+}
+
+/// Runs jpegtran_batch on a detached thread; *stats (if not NULL) should be kept valid until PROGRESS_PASS_EXITCODE.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int jpegtran_batch_threaded(int argc, char **argv, const char **inputs, const char **outputs, int count, jpeg_batch_stats *stats, void *context)
+{
+    // The strings are copied as the caller may release them as soon as this returns
+    auto args = std::make_shared<std::vector<std::string>>(argv, argv + argc);
+    auto paths = std::make_shared<std::vector<std::string>>();
+    for (int i = 0; i < count; i++)
+    {
+        paths->push_back(inputs[i]);
+        paths->push_back(outputs[i]);
+    }
+    if (!run_detached([=]()
+                      {
+        std::vector<char *> a;
+        for (auto &s : *args)
+            a.push_back((char *)s.c_str());
+        std::vector<const char *> in, out;
+        for (int i = 0; i < count; i++)
+        {
+            in.push_back((*paths)[i * 2].c_str());
+            out.push_back((*paths)[i * 2 + 1].c_str());
+        }
+        jpegtran_batch(argc, a.data(), in.data(), out.data(), count, stats, context); }))
+    {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, -1, -1); // error
+        return -1;
+    }
+    return 0;
+}
+
+// A file of the manifest of jpegtran_manifest.
+struct ManifestEntry
+{
+    std::string input;
+    std::string output;
+    std::vector<std::string> switches; // appended to the common switches
+};
+
+// Parses the manifest: a line per file, "input<TAB>output<TAB>switches" where the output (empty to replace the input)
+// and the switches separated by spaces are optional. Empty lines and the lines starting with '#' are ignored.
+static std::vector<ManifestEntry> parse_manifest(const char *manifest)
+{
+    std::vector<ManifestEntry> entries;
+    const char *p = manifest;
+    while (*p)
+    {
+        const char *eol = strchr(p, '\n');
+        if (!eol)
+            eol = p + strlen(p);
+        std::string line(p, eol);
+        p = *eol ? eol + 1 : eol;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        ManifestEntry entry;
+        size_t tab = line.find('\t');
+        entry.input = line.substr(0, tab);
+        if (tab != std::string::npos)
+        {
+            size_t tab2 = line.find('\t', tab + 1);
+            entry.output = line.substr(tab + 1, tab2 == std::string::npos ? std::string::npos : tab2 - tab - 1);
+            if (tab2 != std::string::npos)
+            {
+                const std::string &s = line;
+                size_t i = tab2 + 1;
+                while (i < s.size())
+                {
+                    size_t j = s.find(' ', i);
+                    if (j == std::string::npos)
+                        j = s.size();
+                    if (j > i)
+                        entry.switches.push_back(s.substr(i, j - i));
+                    i = j + 1;
+                }
+            }
+        }
+        if (entry.output.empty())
+            entry.output = entry.input;
+        entries.push_back(std::move(entry));
+    }
+    return entries;
+}
+
+/// Transforms the JPEG files listed in [manifest] (see parse_manifest) by jpegtran; each file is transformed by the
+/// common switches in argv (without file names; argv[0] is the program name) followed by its own switches.
+/// Up to [concurrency] files are transformed at the same time on the worker pool (0 for the number of the CPU cores)
+/// while the I/O threads read and write the others.
+/// Nothing is notified per file; the summary, jpeg_batch_stats followed by jpeg_batch_file_summary for each file in
+/// the order of the manifest, is notified once by PROGRESS_PASS_VECTOR_PTR with totalPass set to the number of the files
+/// (see jpeg_compress_get_ptr/jpeg_compress_release), followed by PROGRESS_PASS_EXITCODE (non-zero if any of the files
+/// failed or the common switches are invalid). Returns the exit code.
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int jpegtran_manifest(int argc, char **argv, const char *manifest, int concurrency, void *context)
+{
+    JpegTran switches(argc, argv, context);
+    if (!switches.parse_batch_switches())
+    {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, 0, EXIT_FAILURE);
+        return EXIT_FAILURE;
+    }
+
+    const std::vector<ManifestEntry> entries = parse_manifest(manifest);
+    const size_t count = entries.size();
+    std::vector<const char *> inputs, outputs;
+    for (auto &entry : entries)
+    {
+        inputs.push_back(entry.input.c_str());
+        outputs.push_back(entry.output.c_str());
+    }
+
+    std::vector<unsigned char> summary(sizeof(jpeg_batch_stats) + count * sizeof(jpeg_batch_file_summary));
+    jpeg_batch_file_summary *files = (jpeg_batch_file_summary *)(summary.data() + sizeof(jpeg_batch_stats));
+    std::vector<std::chrono::steady_clock::time_point> started(count);
+
+    BatchFileProcessor batch(inputs.data(), outputs.data(), count, switches.output_policy, concurrency > 0 ? concurrency : 0);
+    const jpeg_batch_stats stats = batch.run(
+        [&](size_t index, const unsigned char *input, size_t size, std::vector<unsigned char> &output)
+        {
+            started[index] = std::chrono::steady_clock::now();
+            files[index].bytes_in = (int64_t)size;
+            std::vector<char *> args(switches.argv);
+            for (auto &s : entries[index].switches)
+                args.push_back((char *)s.c_str());
+            JpegTran jt((int)args.size(), args.data(), NULL);
+            if (!jt.parse_batch_switches())
+                return EXIT_FAILURE;
+            return jt.transcode_buffer(input, size, output);
+        },
+        [&](size_t index, int code, int64_t size)
+        {
+            files[index].code = size >= 0 ? code : (code != 0 ? code : EXIT_FAILURE);
+            files[index].bytes_out = size >= 0 ? size : 0;
+            if (files[index].bytes_in > 0)
+                files[index].elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started[index]).count();
+        });
+    memcpy(summary.data(), &stats, sizeof(stats));
+
+    const int code = stats.files_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    notify_progress_v(context, PROGRESS_PASS_VECTOR_PTR, (int)count, new SharedBuffer(std::make_shared<VectorEncodedData>(std::move(summary))));
+    notify_progress(context, PROGRESS_PASS_EXITCODE, 0, code);
+    return code;
+}
+
+extern "C" __attribute__((visibility("default"))) __attribute__((used)) int jpegtran_manifest_threaded(int argc, char **argv, const char *manifest, int concurrency, void *context)
+{
+    // The strings are copied as the caller may release them as soon as this returns
+    auto args = std::make_shared<std::vector<std::string>>(argv, argv + argc);
+    auto text = std::make_shared<std::string>(manifest);
+    if (!run_detached([=]()
+                      {
+        std::vector<char *> a;
+        for (auto &s : *args)
+            a.push_back((char *)s.c_str());
+        jpegtran_manifest(argc, a.data(), text->c_str(), concurrency, context); }))
+    {
+        notify_progress(context, PROGRESS_PASS_EXITCODE, -1, -1); // error
+        return -1;
+    }
+    return 0;
+}
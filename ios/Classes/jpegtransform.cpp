@@ -0,0 +1,218 @@
+#include "cdjpeg.h"
+#include "cdjapi.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "jpegtransform.h"
+#include "worker_pool.h"
+
+// Bands per worker; the bands near the edges may cost more (the edge blocks are handled separately).
+static const size_t BANDS_PER_THREAD = 4;
+
+// Row pointers of the first rows of the array; libjpeg's memory manager is built without a backing store, so the whole
+// array is on memory and the pointers stay valid until the array is freed. The rows are accessed one by one from the
+// top, so that any maxaccess of the array is satisfied and the writable rows are defined in order.
+static std::vector<JBLOCKROW> block_rows(j_decompress_ptr cinfo, jvirt_barray_ptr array, JDIMENSION rows, boolean writable)
+{
+    std::vector<JBLOCKROW> result(rows);
+    for (JDIMENSION row = 0; row < rows; row++)
+        result[row] = (*cinfo->mem->access_virt_barray)((j_common_ptr)cinfo, array, row, 1, writable)[0];
+    return result;
+}
+
+static JDIMENSION round_up(JDIMENSION a, JDIMENSION b)
+{
+    return (a + b - 1) / b * b;
+}
+
+// Copies the block; mirroring horizontally changes the signs of the odd columns, and vertically, the odd rows.
+static void copy_block(JCOEFPTR dst, const JCOEF *src, bool mirror_h, bool mirror_v)
+{
+    for (int i = 0; i < DCTSIZE; i++)
+        for (int j = 0; j < DCTSIZE; j++)
+            dst[i * DCTSIZE + j] = ((mirror_v && (i & 1)) != (mirror_h && (j & 1))) ? -src[i * DCTSIZE + j] : src[i * DCTSIZE + j];
+}
+
+// Transposes the block, then mirrors the result as copy_block does.
+static void transpose_block(JCOEFPTR dst, const JCOEF *src, bool mirror_h, bool mirror_v)
+{
+    for (int i = 0; i < DCTSIZE; i++)
+        for (int j = 0; j < DCTSIZE; j++)
+            dst[j * DCTSIZE + i] = ((mirror_v && (j & 1)) != (mirror_h && (i & 1))) ? -src[i * DCTSIZE + j] : src[i * DCTSIZE + j];
+}
+
+// The rows of every component and the geometry of the transform; the rules on the edge blocks (the partial iMCUs that
+// can't be mirrored) and the crop offsets are the same as transupp's.
+struct BandTransform
+{
+    JXFORM_CODE transform;
+    bool in_place; // horizontal flip without the crop from the top; the source arrays are mirrored in place
+    int num_components;
+    struct Component
+    {
+        std::vector<JBLOCKROW> src, dst;
+        JDIMENSION x_crop_blocks, y_crop_blocks;
+        JDIMENSION comp_width, comp_height; // of the mirrorable area in blocks
+        JDIMENSION width;                   // of the destination rows to fill in blocks
+        JDIMENSION rows;                    // of the destination to fill
+        int v_samp_factor;
+    } comps[MAX_COMPONENTS];
+
+    void transform_row(const Component &c, JDIMENSION y) const
+    {
+        const JDIMENSION xc = c.x_crop_blocks, yc = c.y_crop_blocks, w = c.comp_width, h = c.comp_height;
+        switch (transform)
+        {
+        case JXFORM_FLIP_H:
+            if (in_place)
+            {
+                JBLOCKROW row = c.src[y];
+                for (JDIMENSION x = 0; x * 2 < w; x++)
+                {
+                    JBLOCK temp;
+                    memcpy(temp, row[x], sizeof(JBLOCK));
+                    copy_block(row[x], row[w - x - 1], true, false);
+                    copy_block(row[w - x - 1], temp, true, false);
+                }
+                // Left-justify the portion of the data to be kept
+                for (JDIMENSION x = 0; xc > 0 && x < c.width; x++)
+                    memcpy(row[x], row[x + xc], sizeof(JBLOCK));
+            }
+            else
+            {
+                const JBLOCKROW src = c.src[y + yc];
+                for (JDIMENSION x = 0; x < c.width; x++)
+                {
+                    if (xc + x < w)
+                        copy_block(c.dst[y][x], src[w - xc - x - 1], true, false);
+                    else
+                        memcpy(c.dst[y][x], src[x + xc], sizeof(JBLOCK)); // the partial blocks are copied verbatim
+                }
+            }
+            break;
+        case JXFORM_FLIP_V:
+            if (yc + y < h)
+            {
+                const JBLOCKROW src = c.src[h - yc - y - 1];
+                for (JDIMENSION x = 0; x < c.width; x++)
+                    copy_block(c.dst[y][x], src[x + xc], false, true);
+            }
+            else
+            {
+                memcpy(c.dst[y], c.src[y + yc] + xc, c.width * sizeof(JBLOCK));
+            }
+            break;
+        case JXFORM_ROT_180:
+            for (JDIMENSION x = 0; x < c.width; x++)
+            {
+                const bool mirror_h = xc + x < w, mirror_v = yc + y < h;
+                const JBLOCKROW src = c.src[mirror_v ? h - yc - y - 1 : y + yc];
+                copy_block(c.dst[y][x], src[mirror_h ? w - xc - x - 1 : x + xc], mirror_h, mirror_v);
+            }
+            break;
+        case JXFORM_TRANSPOSE:
+            for (JDIMENSION x = 0; x < c.width; x++)
+                transpose_block(c.dst[y][x], c.src[x + xc][y + yc], false, false);
+            break;
+        case JXFORM_ROT_90:
+            for (JDIMENSION x = 0; x < c.width; x++)
+            {
+                const bool mirror_h = xc + x < w;
+                transpose_block(c.dst[y][x], c.src[mirror_h ? w - xc - x - 1 : x + xc][y + yc], mirror_h, false);
+            }
+            break;
+        case JXFORM_ROT_270:
+            for (JDIMENSION x = 0; x < c.width; x++)
+            {
+                const bool mirror_v = yc + y < h;
+                transpose_block(c.dst[y][x], c.src[x + xc][mirror_v ? h - yc - y - 1 : y + yc], false, mirror_v);
+            }
+            break;
+        case JXFORM_TRANSVERSE:
+            for (JDIMENSION x = 0; x < c.width; x++)
+            {
+                const bool mirror_h = xc + x < w, mirror_v = yc + y < h;
+                transpose_block(c.dst[y][x], c.src[mirror_h ? w - xc - x - 1 : x + xc][mirror_v ? h - yc - y - 1 : y + yc], mirror_h, mirror_v);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Transforms the destination iMCU rows [first, end).
+    void transform_band(JDIMENSION first, JDIMENSION end) const
+    {
+        for (int ci = 0; ci < num_components; ci++)
+        {
+            const Component &c = comps[ci];
+            const JDIMENSION last = std::min(end * c.v_samp_factor, c.rows);
+            for (JDIMENSION y = first * c.v_samp_factor; y < last; y++)
+                transform_row(c, y);
+        }
+    }
+};
+
+void jtransform_execute_transformation_parallel(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+                                                jvirt_barray_ptr *src_coef_arrays, jpeg_transform_info *info)
+{
+    bool transposed;
+    switch (info->transform)
+    {
+    case JXFORM_FLIP_H:
+    case JXFORM_FLIP_V:
+    case JXFORM_ROT_180:
+        transposed = false;
+        break;
+    case JXFORM_TRANSPOSE:
+    case JXFORM_TRANSVERSE:
+    case JXFORM_ROT_90:
+    case JXFORM_ROT_270:
+        transposed = true;
+        break;
+    default:
+        jtransform_execute_transformation(srcinfo, dstinfo, src_coef_arrays, info);
+        return;
+    }
+    const bool in_place = info->transform == JXFORM_FLIP_H && info->y_crop_offset == 0 && !info->slow_hflip;
+    // With -maxmemory, the arrays are not on memory at once
+    if (WorkerPool::shared().thread_count() < 2 || srcinfo->mem->max_memory_to_use > 0 ||
+        (!in_place && !info->workspace_coef_arrays) || dstinfo->total_iMCU_rows < 2)
+    {
+        jtransform_execute_transformation(srcinfo, dstinfo, src_coef_arrays, info);
+        return;
+    }
+
+    // The mirrorable area in iMCUs; the partial iMCUs on the right/bottom edges of the output are not mirrored
+    const JDIMENSION mcu_cols = (transposed ? srcinfo->output_height : srcinfo->output_width) / (dstinfo->max_h_samp_factor * DCTSIZE);
+    const JDIMENSION mcu_rows = (transposed ? srcinfo->output_width : srcinfo->output_height) / (dstinfo->max_v_samp_factor * DCTSIZE);
+    BandTransform t;
+    t.transform = info->transform;
+    t.in_place = in_place;
+    t.num_components = dstinfo->num_components;
+    for (int ci = 0; ci < dstinfo->num_components; ci++)
+    {
+        const jpeg_component_info *compptr = &dstinfo->comp_info[ci];
+        const jpeg_component_info *srccomp = &srcinfo->comp_info[ci];
+        BandTransform::Component &c = t.comps[ci];
+        c.x_crop_blocks = info->x_crop_offset * compptr->h_samp_factor;
+        c.y_crop_blocks = info->y_crop_offset * compptr->v_samp_factor;
+        c.comp_width = mcu_cols * compptr->h_samp_factor;
+        c.comp_height = mcu_rows * compptr->v_samp_factor;
+        // The transposing transforms fill the whole iMCUs including the dummy blocks at the right edge
+        c.width = transposed ? round_up(compptr->width_in_blocks, compptr->h_samp_factor) : compptr->width_in_blocks;
+        c.rows = round_up(compptr->height_in_blocks, compptr->v_samp_factor);
+        c.v_samp_factor = compptr->v_samp_factor;
+        c.src = block_rows(srcinfo, src_coef_arrays[ci], round_up(srccomp->height_in_blocks, srccomp->v_samp_factor), in_place);
+        if (!in_place)
+            c.dst = block_rows(srcinfo, info->workspace_coef_arrays[ci], c.rows, TRUE);
+    }
+
+    const JDIMENSION imcu_rows = dstinfo->total_iMCU_rows;
+    const size_t bands = std::min((size_t)imcu_rows, (size_t)WorkerPool::shared().thread_count() * BANDS_PER_THREAD);
+    WorkerPool::shared().parallel_for(bands, [&](size_t b)
+                                      { t.transform_band((JDIMENSION)(imcu_rows * b / bands), (JDIMENSION)(imcu_rows * (b + 1) / bands)); });
+}
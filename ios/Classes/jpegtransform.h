@@ -0,0 +1,14 @@
+#ifndef _jpegtransform_h_
+#define _jpegtransform_h_
+
+#include "jpeglib.h"
+#include "transupp.h"
+
+// Executes the transform like jtransform_execute_transformation, splitting the destination into MCU-row bands that are
+// transformed on the worker pool; each band writes its own rows of the destination arrays, so the result is identical
+// to the sequential one. The rotations, flips, transpose and transverse (with -crop/-trim) are done by bands; the others
+// (none, -wipe, -drop) and the jobs with -maxmemory are passed to jtransform_execute_transformation.
+void jtransform_execute_transformation_parallel(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+                                                jvirt_barray_ptr *src_coef_arrays, jpeg_transform_info *info);
+
+#endif /* _jpegtransform_h_ */
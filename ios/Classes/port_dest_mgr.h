@@ -0,0 +1,71 @@
+#include <vector>
+
+// Destination manager that posts each completed chunk of the encoded data to Dart (notify_chunk with PROGRESS_PASS_CHUNK)
+// as soon as the encoder fills it; the consumer can start using the data before the compression finishes.
+struct port_dest_mgr
+{
+public:
+    static const size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+    // WARNING: lifetime of the buffer (and posted) should be equal to or longer than cinfo.
+    // If posted is not NULL, the total bytes posted are accumulated to it; it's still available after cinfo is destroyed.
+    static void init(j_compress_ptr cinfo, void *context, std::vector<unsigned char> &buffer, size_t chunk_size = DEFAULT_CHUNK_SIZE, size_t *posted = NULL)
+    {
+        if (cinfo->dest == NULL)
+        { /* first time for this JPEG object? */
+            cinfo->dest = (jpeg_destination_mgr *)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT, sizeof(port_dest_mgr));
+        }
+        else if (cinfo->dest->init_destination != init_port_destination)
+        {
+            throw JERR_BUFFER_SIZE;
+        }
+
+        port_dest_mgr *dest = (port_dest_mgr *)cinfo->dest;
+        dest->pub.init_destination = init_port_destination;
+        dest->pub.empty_output_buffer = empty_port_output_buffer;
+        dest->pub.term_destination = term_port_destination;
+        dest->context = context;
+        dest->buffer = &buffer;
+        buffer.resize(chunk_size > 0 ? chunk_size : DEFAULT_CHUNK_SIZE);
+        dest->chunks = 0;
+        dest->posted = posted;
+    }
+
+private:
+    struct jpeg_destination_mgr pub;
+    void *context;
+    std::vector<unsigned char> *buffer;
+    int chunks;
+    size_t *posted;
+
+    static void post_chunk(port_dest_mgr *dest, size_t size)
+    {
+        notify_chunk(dest->context, PROGRESS_PASS_CHUNK, dest->chunks++, dest->buffer->data(), size);
+        if (dest->posted)
+            *dest->posted += size;
+    }
+
+    static void init_port_destination(j_compress_ptr cinfo)
+    {
+        port_dest_mgr *dest = (port_dest_mgr *)cinfo->dest;
+        dest->pub.next_output_byte = dest->buffer->data();
+        dest->pub.free_in_buffer = dest->buffer->size();
+    }
+
+    static boolean empty_port_output_buffer(j_compress_ptr cinfo)
+    {
+        port_dest_mgr *dest = (port_dest_mgr *)cinfo->dest;
+        post_chunk(dest, dest->buffer->size());
+        dest->pub.next_output_byte = dest->buffer->data();
+        dest->pub.free_in_buffer = dest->buffer->size();
+        return TRUE;
+    }
+
+    static void term_port_destination(j_compress_ptr cinfo)
+    {
+        port_dest_mgr *dest = (port_dest_mgr *)cinfo->dest;
+        size_t size = dest->buffer->size() - dest->pub.free_in_buffer;
+        if (size > 0)
+            post_chunk(dest, size);
+    }
+};
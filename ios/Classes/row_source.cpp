@@ -0,0 +1,506 @@
+#include "row_source.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define ROW_SOURCE_NEON
+#endif
+
+// acc[i] += src[i] * w
+static void accumulate_row(float *acc, const float *src, float w, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 vw = _mm_set1_ps(w);
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(_mm_loadu_ps(src + i), vw)));
+#elif defined(ROW_SOURCE_NEON)
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(acc + i, vmlaq_n_f32(vld1q_f32(acc + i), vld1q_f32(src + i), w));
+#endif
+    for (; i < n; i++)
+        acc[i] += src[i] * w;
+}
+
+// dst[i] = saturate(round(acc[i] * scale))
+static void store_row(unsigned char *dst, const float *acc, float scale, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 vs = _mm_set1_ps(scale);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(acc + i), vs));
+        __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(acc + i + 4), vs));
+        __m128i c = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(acc + i + 8), vs));
+        __m128i d = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(acc + i + 12), vs));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+    }
+#elif defined(ROW_SOURCE_NEON)
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8)
+    {
+        uint32x4_t a = vcvtq_u32_f32(vmaxq_f32(vmlaq_n_f32(half, vld1q_f32(acc + i), scale), zero));
+        uint32x4_t b = vcvtq_u32_f32(vmaxq_f32(vmlaq_n_f32(half, vld1q_f32(acc + i + 4), scale), zero));
+        vst1_u8(dst + i, vqmovn_u16(vcombine_u16(vqmovn_u32(a), vqmovn_u32(b))));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        float v = acc[i] * scale + 0.5f;
+        dst[i] = v <= 0.0f ? 0 : v >= 255.0f ? 255 : (unsigned char)v;
+    }
+}
+
+// round(x / 255) for x in [0, 65535]
+static inline unsigned int div255(unsigned int x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+#if defined(__SSE2__)
+template <int A, bool PREMUL>
+static inline __m128i blend_sse2(__m128i c, __m128i bg)
+{
+    const __m128i a = A == 0 ? _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, 0x00), 0x00)
+                             : _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, 0xff), 0xff);
+    const __m128i ia = _mm_sub_epi16(_mm_set1_epi16(255), a);
+    // the products fit in 16-bit unsigned: c * a + bg * (255 - a) <= 255 * 255
+    __m128i x = _mm_mullo_epi16(bg, ia);
+    if (!PREMUL)
+        x = _mm_add_epi16(x, _mm_mullo_epi16(c, a));
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    x = _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+    return PREMUL ? _mm_add_epi16(x, c) : x; // saturated on packing
+}
+
+template <int A, bool PREMUL>
+static size_t flatten_row_simd(unsigned char *dst, const unsigned char *src, size_t pixels, const unsigned char bg[4])
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bg16 = _mm_setr_epi16(bg[0], bg[1], bg[2], bg[3], bg[0], bg[1], bg[2], bg[3]);
+    size_t i = 0;
+    for (; i + 4 <= pixels; i += 4)
+    {
+        const __m128i px = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        const __m128i lo = blend_sse2<A, PREMUL>(_mm_unpacklo_epi8(px, zero), bg16);
+        const __m128i hi = blend_sse2<A, PREMUL>(_mm_unpackhi_epi8(px, zero), bg16);
+        _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_packus_epi16(lo, hi));
+    }
+    return i;
+}
+#elif defined(ROW_SOURCE_NEON)
+// round(x / 255) on 16-bit lanes, narrowed to 8-bit
+static inline uint8x8_t div255_neon(uint16x8_t x)
+{
+    x = vaddq_u16(x, vdupq_n_u16(128));
+    return vaddhn_u16(x, vshrq_n_u16(x, 8));
+}
+
+template <int A, bool PREMUL>
+static size_t flatten_row_simd(unsigned char *dst, const unsigned char *src, size_t pixels, const unsigned char bg[4])
+{
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16)
+    {
+        uint8x16x4_t px = vld4q_u8(src + i * 4); // deinterleaved into 4 planes
+        const uint8x16_t a = px.val[A];
+        const uint8x16_t ia = vmvnq_u8(a);
+        for (int k = 0; k < 4; k++)
+        {
+            if (k == A)
+                continue;
+            const uint8x8_t b = vdup_n_u8(bg[k]);
+            uint16x8_t lo = vmull_u8(b, vget_low_u8(ia));
+            uint16x8_t hi = vmull_u8(b, vget_high_u8(ia));
+            if (PREMUL)
+            {
+                px.val[k] = vqaddq_u8(px.val[k], vcombine_u8(div255_neon(lo), div255_neon(hi)));
+            }
+            else
+            {
+                lo = vmlal_u8(lo, vget_low_u8(px.val[k]), vget_low_u8(a));
+                hi = vmlal_u8(hi, vget_high_u8(px.val[k]), vget_high_u8(a));
+                px.val[k] = vcombine_u8(div255_neon(lo), div255_neon(hi));
+            }
+        }
+        vst4q_u8(dst + i * 4, px);
+    }
+    return i;
+}
+#else
+template <int A, bool PREMUL>
+static size_t flatten_row_simd(unsigned char *dst, const unsigned char *src, size_t pixels, const unsigned char bg[4])
+{
+    return 0;
+}
+#endif
+
+template <int A, bool PREMUL>
+static void flatten_row(unsigned char *dst, const unsigned char *src, size_t pixels, const unsigned char bg[4])
+{
+    size_t i = flatten_row_simd<A, PREMUL>(dst, src, pixels, bg);
+    for (; i < pixels; i++)
+    {
+        const unsigned char *s = src + i * 4;
+        unsigned char *d = dst + i * 4;
+        const unsigned int a = s[A];
+        for (int k = 0; k < 4; k++)
+        {
+            if (PREMUL)
+            {
+                unsigned int v = s[k] + div255(bg[k] * (255 - a));
+                d[k] = v > 255 ? 255 : v;
+            }
+            else
+            {
+                d[k] = div255(s[k] * a + bg[k] * (255 - a));
+            }
+        }
+    }
+}
+
+FlattenAlphaRowSource::FlattenAlphaRowSource(RowSource &src, int alpha_offset, const unsigned char bg[4], bool premultiplied)
+    : RowSource(src.width, src.height, src.components), src(src), alpha_offset(alpha_offset), premultiplied(premultiplied),
+      out((size_t)src.width * 4)
+{
+    memcpy(this->bg, bg, 4);
+}
+
+const unsigned char *FlattenAlphaRowSource::next_row()
+{
+    const unsigned char *row = src.next_row();
+    if (alpha_offset == 0)
+    {
+        if (premultiplied)
+            flatten_row<0, true>(out.data(), row, width, bg);
+        else
+            flatten_row<0, false>(out.data(), row, width, bg);
+    }
+    else
+    {
+        if (premultiplied)
+            flatten_row<3, true>(out.data(), row, width, bg);
+        else
+            flatten_row<3, false>(out.data(), row, width, bg);
+    }
+    return out.data();
+}
+
+AreaDownscaleRowSource::AreaDownscaleRowSource(RowSource &src, int width, int height)
+    : RowSource(width, height, src.components), src(src),
+      scale_x((double)src.width / width), scale_y((double)src.height / height),
+      x_start(width), w_offset(width + 1), hrow((size_t)width * src.components), src_y(-1),
+      acc((size_t)width * src.components), out((size_t)width * src.components), y(0)
+{
+    // Precalculate the horizontal weights; the weights for each output pixel are normalized to 1.
+    for (int ox = 0; ox < width; ox++)
+    {
+        const double x0 = ox * scale_x;
+        const double x1 = ox + 1 == width ? src.width : (ox + 1) * scale_x;
+        const int first = (int)x0;
+        x_start[ox] = first;
+        w_offset[ox] = (int)weights.size();
+        double sum = 0;
+        for (int ix = first; ix < src.width && ix < x1; ix++)
+        {
+            double w = fmin(ix + 1, x1) - fmax(ix, x0);
+            weights.push_back((float)w);
+            sum += w;
+        }
+        for (size_t i = w_offset[ox]; i < weights.size(); i++)
+            weights[i] = (float)(weights[i] / sum);
+    }
+    w_offset[width] = (int)weights.size();
+}
+
+void AreaDownscaleRowSource::load_row(int sy)
+{
+    const unsigned char *row = NULL;
+    while (src_y < sy)
+    {
+        row = src.next_row();
+        src_y++;
+    }
+
+    const int comps = components;
+    float *dst = hrow.data();
+    for (int ox = 0; ox < width; ox++, dst += comps)
+    {
+        const unsigned char *p = row + (size_t)x_start[ox] * comps;
+        const float *w = weights.data() + w_offset[ox];
+        const int count = w_offset[ox + 1] - w_offset[ox];
+        if (comps == 4)
+        {
+#if defined(__SSE2__)
+            __m128 sum = _mm_setzero_ps();
+            const __m128i zero = _mm_setzero_si128();
+            for (int k = 0; k < count; k++, p += 4)
+            {
+                int px;
+                memcpy(&px, p, 4);
+                __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(px), zero), zero);
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(w[k])));
+            }
+            _mm_storeu_ps(dst, sum);
+            continue;
+#elif defined(ROW_SOURCE_NEON)
+            float32x4_t sum = vdupq_n_f32(0.0f);
+            for (int k = 0; k < count; k++, p += 4)
+            {
+                uint32_t px;
+                memcpy(&px, p, 4);
+                uint16x8_t v = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(px)));
+                sum = vmlaq_n_f32(sum, vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))), w[k]);
+            }
+            vst1q_f32(dst, sum);
+            continue;
+#endif
+        }
+        for (int c = 0; c < comps; c++)
+            dst[c] = 0;
+        for (int k = 0; k < count; k++, p += comps)
+        {
+            for (int c = 0; c < comps; c++)
+                dst[c] += p[c] * w[k];
+        }
+    }
+}
+
+const unsigned char *AreaDownscaleRowSource::next_row()
+{
+    const double y0 = y * scale_y;
+    const double y1 = y + 1 == height ? src.height : (y + 1) * scale_y;
+    y++;
+
+    // rows are consumed sequentially; only the boundary row can be shared by two output rows
+    memset(acc.data(), 0, acc.size() * sizeof(float));
+    double sum = 0;
+    for (int sy = (int)y0; sy < src.height && sy < y1; sy++)
+    {
+        double w = fmin(sy + 1, y1) - fmax(sy, y0);
+        if (sy != src_y)
+            load_row(sy);
+        accumulate_row(acc.data(), hrow.data(), (float)w, acc.size());
+        sum += w;
+    }
+    store_row(out.data(), acc.data(), (float)(1.0 / sum), out.size());
+    return out.data();
+}
+
+// Transposes 8x8 pixels of C bytes: the r-th row of dst (dst + r * dst_stride) receives the pixels at column offset + r
+// of rows[0..7].
+template <int C>
+static inline void transpose_tile(const unsigned char *const *rows, size_t offset, unsigned char *dst, size_t dst_stride)
+{
+    for (int r = 0; r < 8; r++)
+        for (int i = 0; i < 8; i++)
+            memcpy(dst + r * dst_stride + i * C, rows[i] + (offset + r) * C, C);
+}
+
+#if defined(__SSE2__)
+static inline void transpose4x4_epi32(__m128i &a, __m128i &b, __m128i &c, __m128i &d)
+{
+    const __m128i t0 = _mm_unpacklo_epi32(a, b), t1 = _mm_unpacklo_epi32(c, d);
+    const __m128i t2 = _mm_unpackhi_epi32(a, b), t3 = _mm_unpackhi_epi32(c, d);
+    a = _mm_unpacklo_epi64(t0, t1);
+    b = _mm_unpackhi_epi64(t0, t1);
+    c = _mm_unpacklo_epi64(t2, t3);
+    d = _mm_unpackhi_epi64(t2, t3);
+}
+
+template <>
+inline void transpose_tile<4>(const unsigned char *const *rows, size_t offset, unsigned char *dst, size_t dst_stride)
+{
+    // four 4x4 transposes of 32-bit pixels; the quadrants are swapped on storing
+    for (int h = 0; h < 8; h += 4)
+    {
+        __m128i a[4], b[4];
+        for (int i = 0; i < 4; i++)
+        {
+            a[i] = _mm_loadu_si128((const __m128i *)(rows[h + i] + offset * 4));
+            b[i] = _mm_loadu_si128((const __m128i *)(rows[h + i] + offset * 4 + 16));
+        }
+        transpose4x4_epi32(a[0], a[1], a[2], a[3]);
+        transpose4x4_epi32(b[0], b[1], b[2], b[3]);
+        for (int r = 0; r < 4; r++)
+        {
+            _mm_storeu_si128((__m128i *)(dst + r * dst_stride + h * 4), a[r]);
+            _mm_storeu_si128((__m128i *)(dst + (r + 4) * dst_stride + h * 4), b[r]);
+        }
+    }
+}
+
+template <>
+inline void transpose_tile<1>(const unsigned char *const *rows, size_t offset, unsigned char *dst, size_t dst_stride)
+{
+    __m128i r[8];
+    for (int i = 0; i < 8; i++)
+        r[i] = _mm_loadl_epi64((const __m128i *)(rows[i] + offset));
+    const __m128i t0 = _mm_unpacklo_epi8(r[0], r[1]), t1 = _mm_unpacklo_epi8(r[2], r[3]);
+    const __m128i t2 = _mm_unpacklo_epi8(r[4], r[5]), t3 = _mm_unpacklo_epi8(r[6], r[7]);
+    const __m128i u0 = _mm_unpacklo_epi16(t0, t1), u1 = _mm_unpackhi_epi16(t0, t1);
+    const __m128i u2 = _mm_unpacklo_epi16(t2, t3), u3 = _mm_unpackhi_epi16(t2, t3);
+    // each of v holds two output rows
+    const __m128i v[4] = {_mm_unpacklo_epi32(u0, u2), _mm_unpackhi_epi32(u0, u2), _mm_unpacklo_epi32(u1, u3), _mm_unpackhi_epi32(u1, u3)};
+    for (int k = 0; k < 4; k++)
+    {
+        _mm_storel_epi64((__m128i *)(dst + 2 * k * dst_stride), v[k]);
+        _mm_storel_epi64((__m128i *)(dst + (2 * k + 1) * dst_stride), _mm_unpackhi_epi64(v[k], v[k]));
+    }
+}
+#elif defined(ROW_SOURCE_NEON)
+template <>
+inline void transpose_tile<4>(const unsigned char *const *rows, size_t offset, unsigned char *dst, size_t dst_stride)
+{
+    for (int h = 0; h < 8; h += 4)
+    {
+        for (int q = 0; q < 8; q += 4)
+        {
+            uint32x4_t a[4];
+            for (int i = 0; i < 4; i++)
+                a[i] = vld1q_u32((const uint32_t *)(rows[h + i] + (offset + q) * 4));
+            const uint32x4x2_t x = vtrnq_u32(a[0], a[1]), y = vtrnq_u32(a[2], a[3]);
+            const uint32x4_t r[4] = {vcombine_u32(vget_low_u32(x.val[0]), vget_low_u32(y.val[0])),
+                                     vcombine_u32(vget_low_u32(x.val[1]), vget_low_u32(y.val[1])),
+                                     vcombine_u32(vget_high_u32(x.val[0]), vget_high_u32(y.val[0])),
+                                     vcombine_u32(vget_high_u32(x.val[1]), vget_high_u32(y.val[1]))};
+            for (int k = 0; k < 4; k++)
+                vst1q_u32((uint32_t *)(dst + (q + k) * dst_stride + h * 4), r[k]);
+        }
+    }
+}
+
+template <>
+inline void transpose_tile<1>(const unsigned char *const *rows, size_t offset, unsigned char *dst, size_t dst_stride)
+{
+    uint8x8_t r[8];
+    for (int i = 0; i < 8; i++)
+        r[i] = vld1_u8(rows[i] + offset);
+    const uint8x8x2_t b0 = vtrn_u8(r[0], r[1]), b1 = vtrn_u8(r[2], r[3]), b2 = vtrn_u8(r[4], r[5]), b3 = vtrn_u8(r[6], r[7]);
+    const uint16x4x2_t c0 = vtrn_u16(vreinterpret_u16_u8(b0.val[0]), vreinterpret_u16_u8(b1.val[0]));
+    const uint16x4x2_t c1 = vtrn_u16(vreinterpret_u16_u8(b0.val[1]), vreinterpret_u16_u8(b1.val[1]));
+    const uint16x4x2_t c2 = vtrn_u16(vreinterpret_u16_u8(b2.val[0]), vreinterpret_u16_u8(b3.val[0]));
+    const uint16x4x2_t c3 = vtrn_u16(vreinterpret_u16_u8(b2.val[1]), vreinterpret_u16_u8(b3.val[1]));
+    // d[k] holds the output rows k and k + 4
+    const uint32x2x2_t d[4] = {vtrn_u32(vreinterpret_u32_u16(c0.val[0]), vreinterpret_u32_u16(c2.val[0])),
+                               vtrn_u32(vreinterpret_u32_u16(c1.val[0]), vreinterpret_u32_u16(c3.val[0])),
+                               vtrn_u32(vreinterpret_u32_u16(c0.val[1]), vreinterpret_u32_u16(c2.val[1])),
+                               vtrn_u32(vreinterpret_u32_u16(c1.val[1]), vreinterpret_u32_u16(c3.val[1]))};
+    for (int k = 0; k < 4; k++)
+    {
+        vst1_u8(dst + k * dst_stride, vreinterpret_u8_u32(d[k].val[0]));
+        vst1_u8(dst + (k + 4) * dst_stride, vreinterpret_u8_u32(d[k].val[1]));
+    }
+}
+#endif
+
+TransformedRowSource::TransformedRowSource(const unsigned char *p0, int width, int height, int stride, int components, bool transpose, bool flip_x, bool flip_y)
+    : RowSource(transpose ? height : width, transpose ? width : height, components), p0(p0), stride(stride),
+      src_width(width), src_height(height), transpose(transpose), flip_x(flip_x), flip_y(flip_y),
+      band((size_t)(transpose ? BAND_ROWS : 1) * this->width * components), band_y(0), band_rows(0), y(0)
+{
+}
+
+template <int C>
+void TransformedRowSource::mirror_row(unsigned char *dst, const unsigned char *src) const
+{
+    int x = 0;
+#if defined(__SSE2__) || defined(ROW_SOURCE_NEON)
+    if (C == 4)
+    {
+        for (; x + 4 <= width; x += 4)
+        {
+            const unsigned char *s = src + (size_t)(width - x - 4) * 4;
+#if defined(__SSE2__)
+            const __m128i v = _mm_loadu_si128((const __m128i *)s);
+            _mm_storeu_si128((__m128i *)(dst + x * 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+#else
+            const uint32x4_t v = vrev64q_u32(vld1q_u32((const uint32_t *)s));
+            vst1q_u32((uint32_t *)(dst + x * 4), vcombine_u32(vget_high_u32(v), vget_low_u32(v)));
+#endif
+        }
+    }
+#endif
+    for (; x < width; x++)
+        memcpy(dst + (size_t)x * C, src + (size_t)(width - 1 - x) * C, C);
+}
+
+template <int C>
+void TransformedRowSource::fill_band()
+{
+    // The band holds the output rows [band_y, band_y + band_rows) in the order of the source columns
+    band_y = y;
+    band_rows = height - y < BAND_ROWS ? height - y : BAND_ROWS;
+    const int first_column = flip_y ? src_width - band_y - band_rows : band_y;
+    const size_t row_bytes = (size_t)width * C;
+
+    const unsigned char *rows[8];
+    for (int x0 = 0; x0 < width; x0 += 8)
+    {
+        // the source rows that become the output pixels [x0, x0 + 8)
+        const int n = width - x0 < 8 ? width - x0 : 8;
+        for (int i = 0; i < n; i++)
+            rows[i] = p0 + stride * (flip_x ? src_height - 1 - (x0 + i) : x0 + i) + (size_t)first_column * C;
+
+        unsigned char *dst = band.data() + (size_t)x0 * C;
+        int c = 0;
+        if (n == 8)
+        {
+            for (; c + 8 <= band_rows; c += 8)
+                transpose_tile<C>(rows, c, dst + c * row_bytes, row_bytes);
+        }
+        for (; c < band_rows; c++)
+            for (int i = 0; i < n; i++)
+                memcpy(dst + c * row_bytes + i * C, rows[i] + c * C, C);
+    }
+}
+
+const unsigned char *TransformedRowSource::next_row()
+{
+    if (!transpose)
+    {
+        const unsigned char *row = p0 + stride * (flip_y ? height - 1 - y : y);
+        y++;
+        if (!flip_x)
+            return row;
+        switch (components)
+        {
+        case 4:
+            mirror_row<4>(band.data(), row);
+            break;
+        case 3:
+            mirror_row<3>(band.data(), row);
+            break;
+        default:
+            mirror_row<1>(band.data(), row);
+            break;
+        }
+        return band.data();
+    }
+
+    if (y >= band_y + band_rows)
+    {
+        switch (components)
+        {
+        case 4:
+            fill_band<4>();
+            break;
+        case 3:
+            fill_band<3>();
+            break;
+        default:
+            fill_band<1>();
+            break;
+        }
+    }
+    const int r = flip_y ? band_rows - 1 - (y - band_y) : y - band_y;
+    y++;
+    return band.data() + (size_t)r * width * components;
+}
@@ -0,0 +1,116 @@
+#ifndef _row_source_h_
+#define _row_source_h_
+
+#include <stddef.h>
+#include <vector>
+
+// Pull-style source of pixel rows that are fed to jpeg_write_scanlines.
+// Stages are chained so that each row is processed on the fly without materializing the whole image.
+class RowSource
+{
+public:
+    RowSource(int width, int height, int components) : width(width), height(height), components(components) {}
+    virtual ~RowSource() {}
+
+    // Returns the next row; the pointer is valid until the next call.
+    virtual const unsigned char *next_row() = 0;
+
+    const int width;
+    const int height;
+    const int components;
+};
+
+// Rows on memory.
+class MemoryRowSource : public RowSource
+{
+public:
+    MemoryRowSource(const unsigned char *p0, int width, int height, int stride, int components)
+        : RowSource(width, height, components), p0(p0), stride(stride), y(0) {}
+
+    const unsigned char *next_row() override
+    {
+        return p0 + (ptrdiff_t)stride * y++;
+    }
+
+private:
+    const unsigned char *p0;
+    ptrdiff_t stride;
+    int y;
+};
+
+// Rows on memory transposed and/or mirrored on the fly; the image is transposed first (if requested), then mirrored
+// horizontally (flip_x) and/or vertically (flip_y), which covers all the 8 orientations.
+// The transposed rows are produced by bands of BAND_ROWS rows: each band is made of as many source columns by 8x8 pixel
+// tile transposes, so the rotated image is never materialized and the source is read by cache line sized pieces.
+class TransformedRowSource : public RowSource
+{
+public:
+    // width/height are of the source; the output size is swapped if transpose is true.
+    TransformedRowSource(const unsigned char *p0, int width, int height, int stride, int components, bool transpose, bool flip_x, bool flip_y);
+
+    const unsigned char *next_row() override;
+
+    static const int BAND_ROWS = 16;
+
+private:
+    const unsigned char *p0;
+    ptrdiff_t stride;
+    int src_width, src_height;
+    bool transpose, flip_x, flip_y;
+    std::vector<unsigned char> band; // BAND_ROWS rows in the order of the source columns, or a mirrored row
+    int band_y;                      // output y of the first row of the band
+    int band_rows;                   // number of valid rows in the band; 0 if not filled yet
+    int y;
+
+    template <int C>
+    void fill_band();
+    template <int C>
+    void mirror_row(unsigned char *dst, const unsigned char *src) const;
+};
+
+// Composites 4-byte pixels with alpha over a solid background color; the output keeps the input pixel layout
+// and the alpha byte of the output is undefined (it should be ignored by the encoder).
+class FlattenAlphaRowSource : public RowSource
+{
+public:
+    // alpha_offset is the byte offset of the alpha in a pixel (0 or 3); bg is the background color in the pixel layout.
+    FlattenAlphaRowSource(RowSource &src, int alpha_offset, const unsigned char bg[4], bool premultiplied);
+
+    const unsigned char *next_row() override;
+
+private:
+    RowSource &src;
+    int alpha_offset;
+    unsigned char bg[4];
+    bool premultiplied;
+    std::vector<unsigned char> out;
+};
+
+// Area-averaging (box filter with fractional pixel coverage) downscaler.
+// It keeps only one row of horizontally downscaled input and one output row accumulator.
+class AreaDownscaleRowSource : public RowSource
+{
+public:
+    // The source should be larger than or equal to the target size in both directions.
+    AreaDownscaleRowSource(RowSource &src, int width, int height);
+
+    const unsigned char *next_row() override;
+
+private:
+    RowSource &src;
+    double scale_x, scale_y;
+    // horizontal filter: for each output x, the first input x and the range in weights
+    std::vector<int> x_start;
+    std::vector<int> w_offset;
+    std::vector<float> weights;
+
+    std::vector<float> hrow; // horizontally downscaled row of src_y
+    int src_y;               // index of the input row currently on hrow; -1 if none
+    std::vector<float> acc;
+    std::vector<unsigned char> out;
+    int y;
+
+    void load_row(int sy);
+};
+
+#endif /* _row_source_h_ */
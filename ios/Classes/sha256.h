@@ -0,0 +1,35 @@
+#ifndef _sha256_h_
+#define _sha256_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+// SHA-256 (FIPS 180-4) to identify the inputs of the persistent cache; unlike ContentHash, two different inputs can't
+// be made to share a key. The update_* helpers feed the values in a fixed encoding so that the digest of a sequence of
+// fields is unambiguous.
+class Sha256
+{
+public:
+    Sha256();
+
+    void update(const void *data, size_t size);
+    // 8 bytes in little endian
+    void update_int(uint64_t v);
+    // the length (update_int) followed by the bytes
+    void update_string(const std::string &s);
+
+    // Finishes the hash and returns the 64 hex digits of the digest; the object can't be updated afterwards.
+    std::string hex();
+
+private:
+    uint32_t state[8];
+    uint64_t total; // in bytes
+    unsigned char block[64];
+    size_t used; // bytes in block
+
+    void compress(const unsigned char *p);
+};
+
+#endif /* _sha256_h_ */
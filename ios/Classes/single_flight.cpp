@@ -0,0 +1,117 @@
+#include "single_flight.h"
+#include "content_hash.h"
+#include "sha256.h"
+
+#include <string.h>
+
+SingleFlight &SingleFlight::shared()
+{
+    static SingleFlight instance;
+    return instance;
+}
+
+void SingleFlight::compute_hash(FlightKey &key)
+{
+    ContentHash h;
+    if (!key.key.empty())
+    {
+        h.update_string(key.key);
+    }
+    else
+    {
+        for (int y = 0; y < key.height; y++)
+            h.update(key.p0 + (ptrdiff_t)key.stride * y, key.row_bytes);
+    }
+    h.update_int((uint64_t)key.width << 32 | (uint32_t)key.height);
+    h.update_int((uint64_t)key.input_cs);
+    for (int v : key.params)
+        h.update_int((uint32_t)v);
+    key.hash = h.digest64();
+}
+
+std::string SingleFlight::compute_digest(const FlightKey &key)
+{
+    Sha256 h;
+    if (!key.key.empty())
+    {
+        h.update_int(1);
+        h.update_string(key.key);
+    }
+    else
+    {
+        h.update_int(0);
+        for (int y = 0; y < key.height; y++)
+            h.update(key.p0 + (ptrdiff_t)key.stride * y, key.row_bytes);
+    }
+    h.update_int((uint64_t)key.width << 32 | (uint32_t)key.height);
+    h.update_int((uint64_t)key.input_cs);
+    h.update_int(key.params.size());
+    for (int v : key.params)
+        h.update_int((uint32_t)v);
+    return h.hex();
+}
+
+bool SingleFlight::same_request(const FlightKey &a, const FlightKey &b)
+{
+    if (a.hash != b.hash || a.width != b.width || a.height != b.height || a.input_cs != b.input_cs ||
+        a.params != b.params || a.key != b.key)
+        return false;
+    if (!a.key.empty() || (a.p0 == b.p0 && a.stride == b.stride))
+        return true;
+    // same hash on different buffers; confirm the content
+    for (int y = 0; y < a.height; y++)
+    {
+        if (memcmp(a.p0 + (ptrdiff_t)a.stride * y, b.p0 + (ptrdiff_t)b.stride * y, a.row_bytes) != 0)
+            return false;
+    }
+    return true;
+}
+
+bool SingleFlight::join(const FlightKey &key, std::shared_ptr<Flight> &flight)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto range = flights.equal_range(key.hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        // The leader's input is valid while the flight is registered; it's removed before the leader returns.
+        if (same_request(key, it->second->key))
+        {
+            flight = it->second;
+            return false;
+        }
+    }
+    flight = std::make_shared<Flight>();
+    flight->key = key;
+    flights.emplace(key.hash, flight);
+    return true;
+}
+
+void SingleFlight::finish(const std::shared_ptr<Flight> &flight, int code, const SharedBuffer &result)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto range = flights.equal_range(flight->key.hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (it->second == flight)
+            {
+                flights.erase(it);
+                break;
+            }
+        }
+    }
+    std::lock_guard<std::mutex> lock(flight->mutex);
+    flight->code = code;
+    flight->result = result;
+    flight->done = true;
+    flight->cond.notify_all();
+}
+
+int SingleFlight::wait(Flight &flight, SharedBuffer &result)
+{
+    std::unique_lock<std::mutex> lock(flight.mutex);
+    flight.cond.wait(lock, [&]
+                     { return flight.done; });
+    result = flight.result;
+    return flight.code;
+}
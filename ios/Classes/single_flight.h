@@ -0,0 +1,69 @@
+#ifndef _single_flight_h_
+#define _single_flight_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "encoded_data.h"
+
+// Identity of an encode request; two requests with the same identity produce exactly the same output.
+struct FlightKey
+{
+    // Input; if key is empty, the pixels are compared byte by byte to confirm the match.
+    const unsigned char *p0;
+    int width, height, stride, input_cs;
+    size_t row_bytes;
+    std::string key; // caller-supplied identity of the input
+    // Encode parameters; every int that affects the output.
+    std::vector<int> params;
+
+    uint64_t hash; // to find the candidates; the matches are confirmed by same_request
+};
+
+// Coalesces concurrent identical encode requests onto one in-flight job.
+// The first request (the leader) encodes the image and the others wait for its result.
+class SingleFlight
+{
+public:
+    struct Flight
+    {
+        FlightKey key;
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool done = false;
+        int code = 0;
+        SharedBuffer result;
+    };
+
+    static SingleFlight &shared();
+
+    // Calculates FlightKey::hash from the pixels (or the caller key) and the parameters.
+    static void compute_hash(FlightKey &key);
+    // SHA-256 of the same identity in hex; the key of the persistent cache, whose hits are not confirmed.
+    static std::string compute_digest(const FlightKey &key);
+
+    // Registers the request; returns true if the caller becomes the leader of the flight and should call finish
+    // after the job. Otherwise, the caller should call wait on the flight.
+    bool join(const FlightKey &key, std::shared_ptr<Flight> &flight);
+
+    // Publishes the result to the waiters and removes the flight; the subsequent requests start new jobs.
+    void finish(const std::shared_ptr<Flight> &flight, int code, const SharedBuffer &result);
+
+    // Waits for the leader to finish; returns the exit code of the job.
+    static int wait(Flight &flight, SharedBuffer &result);
+
+private:
+    std::mutex mutex;
+    std::unordered_multimap<uint64_t, std::shared_ptr<Flight>> flights;
+
+    static bool same_request(const FlightKey &a, const FlightKey &b);
+};
+
+#endif /* _single_flight_h_ */
@@ -0,0 +1,185 @@
+#include "cdjpeg.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include "spill_mem_mgr.h"
+
+struct spill_mem_mgr::barray
+{
+    j_common_ptr owner;
+    int pool_id;
+    boolean pre_zero;
+    JDIMENSION blocksperrow;
+    JDIMENSION numrows;
+    std::vector<JBLOCKROW> rows; // empty until realized
+    void *memory;                // the array on memory; or
+    void *map;                   // the mapped range of the file
+    size_t size;
+    JDIMENSION first_row; // rows accessed last; the others are released from the process when the access moves
+    JDIMENSION end_row;
+};
+
+spill_mem_mgr::spill_mem_mgr(const char *temp_dir)
+    : temp_dir(temp_dir && *temp_dir ? temp_dir : "/tmp"), fd(-1), file_size(0), spilled_count(0), spilled_bytes(0),
+      memory_bytes(0), realize_virt_arrays_orig(NULL), free_pool_orig(NULL), self_destruct_orig(NULL)
+{
+}
+
+spill_mem_mgr::~spill_mem_mgr()
+{
+    for (auto &a : arrays)
+    {
+        if (a->memory)
+            free(a->memory);
+        if (a->map)
+            munmap(a->map, a->size);
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+void spill_mem_mgr::install(j_common_ptr cinfo)
+{
+    // Every object has the same methods of libjpeg's memory manager
+    realize_virt_arrays_orig = cinfo->mem->realize_virt_arrays;
+    free_pool_orig = cinfo->mem->free_pool;
+    self_destruct_orig = cinfo->mem->self_destruct;
+    cinfo->mem->request_virt_barray = request_virt_barray;
+    cinfo->mem->realize_virt_arrays = realize_virt_arrays;
+    cinfo->mem->access_virt_barray = access_virt_barray;
+    cinfo->mem->free_pool = free_pool;
+    cinfo->mem->self_destruct = self_destruct;
+    cinfo->client_data = this;
+}
+
+void spill_mem_mgr::realize(j_common_ptr cinfo)
+{
+    const long max_memory = cinfo->mem->max_memory_to_use;
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    for (auto &a : arrays)
+    {
+        if (a->owner != cinfo || !a->rows.empty())
+            continue;
+        a->size = (size_t)a->blocksperrow * a->numrows * sizeof(JBLOCK);
+        JBLOCKROW base;
+        if (max_memory <= 0 || memory_bytes + (int64_t)a->size <= max_memory)
+        {
+            a->memory = a->pre_zero ? calloc(1, a->size) : malloc(a->size);
+            if (!a->memory)
+                ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+            memory_bytes += a->size;
+            base = (JBLOCKROW)a->memory;
+        }
+        else
+        {
+            if (fd < 0)
+            {
+                std::string path = temp_dir + "/jpegspillXXXXXX";
+                fd = mkstemp(&path[0]);
+                if (fd < 0)
+                    ERREXITS(cinfo, JERR_TFILE_CREATE, path.c_str());
+                unlink(path.c_str());
+            }
+            // The file is extended with zeros, so pre_zero is always satisfied
+            const int64_t offset = file_size;
+            const int64_t new_size = offset + (int64_t)((a->size + page_size - 1) / page_size * page_size);
+            if (ftruncate(fd, (off_t)new_size) != 0)
+                ERREXIT(cinfo, JERR_TFILE_WRITE);
+            void *map = mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)offset);
+            if (map == MAP_FAILED)
+                ERREXIT(cinfo, JERR_TFILE_WRITE);
+            a->map = map;
+            file_size = new_size;
+            spilled_count++;
+            spilled_bytes += a->size;
+            base = (JBLOCKROW)map;
+        }
+        a->rows.resize(a->numrows);
+        for (JDIMENSION row = 0; row < a->numrows; row++)
+            a->rows[row] = base + (size_t)row * a->blocksperrow;
+    }
+}
+
+void spill_mem_mgr::release(j_common_ptr cinfo, int pool_id)
+{
+    auto end = std::remove_if(arrays.begin(), arrays.end(), [&](const std::unique_ptr<barray> &a)
+                              {
+        if (a->owner != cinfo || (pool_id >= 0 && a->pool_id != pool_id))
+            return false;
+        if (a->memory)
+        {
+            free(a->memory);
+            memory_bytes -= a->size;
+        }
+        if (a->map)
+            munmap(a->map, a->size);
+        return true; });
+    arrays.erase(end, arrays.end());
+}
+
+jvirt_barray_ptr spill_mem_mgr::request_virt_barray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                                                    JDIMENSION blocksperrow, JDIMENSION numrows, JDIMENSION maxaccess)
+{
+    (void)maxaccess; // the whole array is addressable
+    if (pool_id != JPOOL_IMAGE)
+        ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+    spill_mem_mgr *mgr = (spill_mem_mgr *)cinfo->client_data;
+    std::unique_ptr<barray> a(new barray());
+    a->owner = cinfo;
+    a->pool_id = pool_id;
+    a->pre_zero = pre_zero;
+    a->blocksperrow = blocksperrow;
+    a->numrows = numrows;
+    mgr->arrays.push_back(std::move(a));
+    return (jvirt_barray_ptr)mgr->arrays.back().get();
+}
+
+void spill_mem_mgr::realize_virt_arrays(j_common_ptr cinfo)
+{
+    spill_mem_mgr *mgr = (spill_mem_mgr *)cinfo->client_data;
+    mgr->realize(cinfo);
+    mgr->realize_virt_arrays_orig(cinfo); // the sample arrays
+}
+
+JBLOCKARRAY spill_mem_mgr::access_virt_barray(j_common_ptr cinfo, jvirt_barray_ptr ptr, JDIMENSION start_row,
+                                              JDIMENSION num_rows, boolean writable)
+{
+    (void)writable; // the mapped pages are written back by the system
+    barray *a = (barray *)ptr;
+    const JDIMENSION end_row = start_row + num_rows;
+    if (end_row > a->numrows || num_rows == 0)
+        ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+    if (a->rows.empty())
+        ERREXIT(cinfo, JERR_VIRTUAL_BUG);
+    if (a->map && a->end_row > a->first_row && (end_row <= a->first_row || start_row >= a->end_row))
+    {
+        // Release the rows accessed last; the pages stay dirty on the page cache (not discarded) until written back
+        const uintptr_t page_mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+        const uintptr_t first = (uintptr_t)a->rows[a->first_row] & ~page_mask;
+        const uintptr_t end = std::min((uintptr_t)(a->rows[a->end_row - 1] + a->blocksperrow),
+                                       (uintptr_t)a->map + a->size);
+        madvise((void *)first, end - first, MADV_DONTNEED);
+    }
+    a->first_row = start_row;
+    a->end_row = end_row;
+    return &a->rows[start_row];
+}
+
+void spill_mem_mgr::free_pool(j_common_ptr cinfo, int pool_id)
+{
+    spill_mem_mgr *mgr = (spill_mem_mgr *)cinfo->client_data;
+    mgr->release(cinfo, pool_id);
+    mgr->free_pool_orig(cinfo, pool_id);
+}
+
+void spill_mem_mgr::self_destruct(j_common_ptr cinfo)
+{
+    spill_mem_mgr *mgr = (spill_mem_mgr *)cinfo->client_data;
+    mgr->release(cinfo, -1);
+    mgr->self_destruct_orig(cinfo);
+}
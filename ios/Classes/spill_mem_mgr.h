@@ -0,0 +1,60 @@
+#ifndef _spill_mem_mgr_h_
+#define _spill_mem_mgr_h_
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Virtual block arrays (the whole-image coefficient buffers of jpeg_read_coefficients and the transform workspaces)
+// that don't fit in max_memory_to_use are backed by a memory-mapped temporary file; libjpeg's own memory manager is
+// built without a backing store, so such jobs would fail with JERR_NO_BACKING_STORE.
+// The mapped ranges out of the accessed rows are released from the process, so the memory usage stays bounded
+// however large the image is; the data is kept on the page cache and the file.
+// The manager replaces the virtual block array methods of the memory managers it's installed on, and uses client_data
+// of the objects. The arrays requested on one object can be accessed by the others installed with the same manager
+// (the transcoder writes the arrays of the decompressor).
+class spill_mem_mgr
+{
+public:
+    // The temporary file is created in temp_dir and removed from the directory as soon as it's opened.
+    explicit spill_mem_mgr(const char *temp_dir);
+    ~spill_mem_mgr();
+
+    // Installs the manager on the object; it should outlive jpeg_destroy of the object.
+    void install(j_common_ptr cinfo);
+
+    int arrays_spilled() const { return spilled_count; }
+    int64_t bytes_spilled() const { return spilled_bytes; }
+    int64_t bytes_in_memory() const { return memory_bytes; }
+
+private:
+    struct barray;
+
+    std::string temp_dir;
+    int fd;
+    int64_t file_size;
+    std::vector<std::unique_ptr<barray>> arrays;
+    int spilled_count;
+    int64_t spilled_bytes;
+    int64_t memory_bytes;
+
+    // The original methods of libjpeg's memory manager
+    void (*realize_virt_arrays_orig)(j_common_ptr cinfo);
+    void (*free_pool_orig)(j_common_ptr cinfo, int pool_id);
+    void (*self_destruct_orig)(j_common_ptr cinfo);
+
+    void realize(j_common_ptr cinfo);
+    void release(j_common_ptr cinfo, int pool_id);
+
+    static jvirt_barray_ptr request_virt_barray(j_common_ptr cinfo, int pool_id, boolean pre_zero, JDIMENSION blocksperrow,
+                                                JDIMENSION numrows, JDIMENSION maxaccess);
+    static void realize_virt_arrays(j_common_ptr cinfo);
+    static JBLOCKARRAY access_virt_barray(j_common_ptr cinfo, jvirt_barray_ptr ptr, JDIMENSION start_row,
+                                          JDIMENSION num_rows, boolean writable);
+    static void free_pool(j_common_ptr cinfo, int pool_id);
+    static void self_destruct(j_common_ptr cinfo);
+};
+
+#endif /* _spill_mem_mgr_h_ */
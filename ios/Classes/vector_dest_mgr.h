@@ -38,9 +38,9 @@ private:
 
     static boolean empty_vector_output_buffer(j_compress_ptr cinfo)
     {
+        // NOTE: the entropy encoders may call this without updating pub.free_in_buffer;
+        // the buffer is always full here and the current pointer/count should be ignored.
         vector_dest_mgr *dest = (vector_dest_mgr *)cinfo->dest;
-        if (dest->pub.free_in_buffer > 0)
-            return TRUE;
         size_t curSize = dest->buffer->size();
         dest->buffer->resize(curSize * 2);
         dest->pub.next_output_byte = dest->buffer->data() + curSize;
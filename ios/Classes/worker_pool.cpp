@@ -0,0 +1,106 @@
+#include "worker_pool.h"
+
+#include <pthread.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+WorkerPool &WorkerPool::shared()
+{
+    // Intentionally never destroyed; the threads live until the process exits.
+    static WorkerPool *pool = new WorkerPool(std::thread::hardware_concurrency());
+    return *pool;
+}
+
+WorkerPool::WorkerPool(unsigned threads) : threads(threads > 0 ? threads : 1)
+{
+    for (unsigned i = 0; i < this->threads; i++)
+        std::thread([this]()
+                    { run(); })
+            .detach();
+}
+
+void WorkerPool::run()
+{
+    for (;;)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this]()
+                    { return !jobs.empty(); });
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+void WorkerPool::post(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        jobs.push_back(std::move(job));
+    }
+    cv.notify_one();
+}
+
+void WorkerPool::parallel_for(size_t count, const std::function<void(size_t)> &fn)
+{
+    if (count == 0)
+        return;
+
+    struct State
+    {
+        std::atomic<size_t> next{0};
+        size_t count;
+        size_t done = 0;
+        const std::function<void(size_t)> *fn;
+        std::mutex mtx;
+        std::condition_variable cv;
+    };
+    auto state = std::make_shared<State>();
+    state->count = count;
+    state->fn = &fn;
+
+    // Helpers that start after all the items are taken just return without touching fn.
+    auto work = [state]()
+    {
+        size_t i;
+        while ((i = state->next++) < state->count)
+        {
+            (*state->fn)(i);
+            std::lock_guard<std::mutex> lock(state->mtx);
+            if (++state->done == state->count)
+                state->cv.notify_all();
+        }
+    };
+
+    const size_t helpers = count - 1 < threads ? count - 1 : threads;
+    for (size_t i = 0; i < helpers; i++)
+        post(work);
+    work();
+
+    std::unique_lock<std::mutex> lock(state->mtx);
+    state->cv.wait(lock, [&]()
+                   { return state->done == state->count; });
+}
+
+bool run_detached(std::function<void()> fn)
+{
+    std::function<void()> *pfn = new std::function<void()>(std::move(fn));
+    pthread_t t;
+    if (pthread_create(&t, NULL, [](void *param) -> void *
+                       {
+                           std::unique_ptr<std::function<void()>> fn((std::function<void()> *)param);
+                           (*fn)();
+                           return 0; },
+                       pfn) != 0)
+    {
+        delete pfn;
+        return false;
+    }
+    pthread_detach(t);
+    return true;
+}
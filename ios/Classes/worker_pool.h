@@ -0,0 +1,40 @@
+#ifndef _worker_pool_h_
+#define _worker_pool_h_
+
+#include <stddef.h>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+// Process-wide pool of worker threads shared by the parallel encoders/transformers.
+class WorkerPool
+{
+public:
+    // The shared pool; it has as many threads as the CPU cores.
+    static WorkerPool &shared();
+
+    // Queues the job; it should not throw.
+    void post(std::function<void()> job);
+
+    // Runs fn(0) ... fn(count - 1) on the pool threads and the calling thread and waits for all of them.
+    // The calling thread also takes the work, so it's safe to call from a pool thread (nested calls never deadlock).
+    // fn should not throw.
+    void parallel_for(size_t count, const std::function<void(size_t)> &fn);
+
+    unsigned thread_count() const { return threads; }
+
+private:
+    WorkerPool(unsigned threads);
+    void run();
+
+    unsigned threads;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> jobs;
+};
+
+// Runs fn on a new detached thread (for the *_threaded entry points); returns false if the thread could not be created.
+bool run_detached(std::function<void()> fn);
+
+#endif /* _worker_pool_h_ */
@@ -1,15 +1,41 @@
 import 'dart:async';
+import 'dart:convert';
 import 'dart:ffi';
 import 'dart:io';
 import 'dart:isolate';
+import 'dart:math';
 import 'dart:typed_data';
 import 'dart:ui' as ui;
 
 import 'package:ffi/ffi.dart';
 
 typedef _Dart_InitializeApiDLFunc = Pointer<Void> Function(Pointer<Void>);
-typedef _JpegCompressFunc = void Function(
-    Pointer<Uint8>, int, int, int, int, int, int, int);
+typedef _JpegCompressExFunc = void Function(
+    Pointer<Uint8>, int, int, int, int, Pointer<_JpegCompressOptions>, int);
+typedef _JpegCompressLadderFunc = void Function(Pointer<Uint8>, int, int, int,
+    int, Pointer<_JpegCompressOptions>, int, int);
+typedef _JpegRecompressFunc = void Function(
+    Pointer<Uint8>, int, Pointer<_JpegCompressOptions>, int);
+typedef _JpegTileGridFunc = void Function(
+    Pointer<Uint8>, int, Pointer<_JpegTileOptions>, int);
+typedef _JpegPyramidFunc = void Function(
+    Pointer<Uint8>, int, int, int, int, Pointer<_JpegPyramidOptions>, int);
+typedef _JpegPyramidFromJpegFunc = void Function(
+    Pointer<Uint8>, int, Pointer<_JpegPyramidOptions>, int);
+typedef _JpegSequenceCreateFunc = Pointer<Void> Function(
+    int, int, int, int, Pointer<_JpegCompressOptions>, int);
+typedef _JpegFrameEncoderCreateFunc = Pointer<Void> Function(
+    int, int, int, int, Pointer<_JpegCompressOptions>);
+typedef _JpegCompressBeginFunc = Pointer<Void> Function(
+    Pointer<Uint8>, int, int, int, int, Pointer<_JpegCompressOptions>);
+typedef _JpegtranBatchFunc = int Function(
+    int,
+    Pointer<Pointer<Utf8>>,
+    Pointer<Pointer<Utf8>>,
+    Pointer<Pointer<Utf8>>,
+    int,
+    Pointer<_JpegBatchStats>,
+    int);
 typedef _SetDartPortFunc = void Function(int port);
 
 typedef MessageCallback = void Function(String);
@@ -41,9 +67,19 @@ abstract class FlutterMozjpeg {
   static const int _progressPassExitCode = -1;
   static const int _progressPassOutputFileSize = -2;
   static const int _progressPassVectorPointer = -3;
+  static const int _progressPassChunk = -4;
   static const int _progressTPassOptimized = 1;
   static const int _progressTPassNoChange = 2;
 
+  /// Values for `jpeg_compress_options.output`.
+  static const int _outputVector = 0;
+  static const int _outputFile = 1;
+  static const int _outputStream = 2;
+
+  /// Flags for `fd_dest_mgr` output policy.
+  static const int _outputPolicyDontNeed = 1;
+  static const int _outputPolicyDataSync = 2;
+
   static void _ensureDartApiInitialized() {
     if (cookie != null) return;
     cookie = _Dart_InitializeApiDL(NativeApi.initializeApiDLData);
@@ -57,11 +93,17 @@ abstract class FlutterMozjpeg {
           // 0:context, 1:pass, 2:totalPass, 3:percentage
           int context = message[0] as int;
           int pass = message[1] as int;
+          if (pass == _progressPassChunk) {
+            // 2:chunk index, 3:chunk data
+            _chunkCallbacks[context]?.call(message[3] as Uint8List);
+            return;
+          }
           // lookup progress callback associated to the context value and invoke it with the parameters
           _progressCallbacks[context]
               ?.call(pass, message[2] as int, message[3] as int);
           if (pass == _progressPassExitCode) {
             _progressCallbacks.remove(context);
+            _chunkCallbacks.remove(context);
           }
           return;
         }
@@ -77,6 +119,9 @@ abstract class FlutterMozjpeg {
   static final _progressCallbacks = <int, ProgressCallback?>{};
   static int _pcnIndex = 0;
 
+  /// context value to chunk callback map; used by the streaming APIs.
+  static final _chunkCallbacks = <int, void Function(Uint8List)>{};
+
   /// register a progress callback and return it's context value that is used as key of [_progressCallbacks].
   static int _addProgressCallback(ProgressCallback? progressCallback) {
     final int context = ++_pcnIndex;
@@ -84,11 +129,108 @@ abstract class FlutterMozjpeg {
     return context;
   }
 
-  static final _JpegCompressFunc _jpegCompress = mozJpegLib
+  static final _JpegCompressExFunc _jpegCompressEx = mozJpegLib
+      .lookup<
+          NativeFunction<
+              Void Function(Pointer<Uint8>, Int32, Int32, Int32, Int32,
+                  Pointer<_JpegCompressOptions>, IntPtr)>>(
+          "jpeg_compress_ex_threaded")
+      .asFunction();
+
+  /// Call `jpeg_compress_ex_threaded`; the result is notified to the progress callback associated to [context].
+  static void _compressEx(
+    Pointer<Uint8> src,
+    int width,
+    int height,
+    int stride,
+    MozJpegColorSpace colorSpace,
+    int context, {
+    required int quality,
+    required int dpi,
+    int output = _outputVector,
+    String? outputPath,
+    int outputPolicy = 0,
+    int chunkSize = 0,
+    bool singlePass = false,
+    int? targetWidth,
+    int? targetHeight,
+    MozJpegAlphaMode alphaMode = MozJpegAlphaMode.ignore,
+    ui.Color? backgroundColor,
+    String? dedupeKey,
+    MozJpegTransform transform = MozJpegTransform.none,
+    Rectangle<int>? crop,
+  }) {
+    using((arena) {
+      final options = arena<_JpegCompressOptions>();
+      _fillOptions(options.ref, arena,
+          quality: quality,
+          dpi: dpi,
+          output: output,
+          outputPath: outputPath,
+          outputPolicy: outputPolicy,
+          chunkSize: chunkSize,
+          singlePass: singlePass,
+          targetWidth: targetWidth,
+          targetHeight: targetHeight,
+          alphaMode: alphaMode,
+          backgroundColor: backgroundColor,
+          dedupeKey: dedupeKey,
+          transform: transform,
+          crop: crop);
+      _jpegCompressEx(src, width, height, stride, _cs2int[colorSpace]!,
+          options, context);
+    });
+  }
+
+  static void _fillOptions(
+    _JpegCompressOptions options,
+    Arena arena, {
+    required int quality,
+    required int dpi,
+    int output = _outputVector,
+    String? outputPath,
+    int outputPolicy = 0,
+    int chunkSize = 0,
+    bool singlePass = false,
+    int? targetWidth,
+    int? targetHeight,
+    MozJpegAlphaMode alphaMode = MozJpegAlphaMode.ignore,
+    ui.Color? backgroundColor,
+    String? dedupeKey,
+    MozJpegTransform transform = MozJpegTransform.none,
+    Rectangle<int>? crop,
+  }) {
+    options
+      ..quality = quality
+      ..dpi = dpi
+      ..output = output
+      ..outputPolicy = outputPolicy
+      ..outputPath = outputPath == null
+          ? nullptr
+          : outputPath.toNativeUtf8(allocator: arena)
+      ..chunkSize = chunkSize
+      ..singlePass = singlePass ? 1 : 0
+      ..targetWidth = targetWidth ?? 0
+      ..targetHeight = targetHeight ?? 0
+      ..alphaMode = alphaMode.index
+      ..background = (backgroundColor ?? const ui.Color(0xffffffff)).value &
+          0xffffff
+      ..dedupeKey = dedupeKey == null
+          ? nullptr
+          : dedupeKey.toNativeUtf8(allocator: arena)
+      ..transform = transform.index
+      ..cropX = crop?.left ?? 0
+      ..cropY = crop?.top ?? 0
+      ..cropWidth = crop?.width ?? 0
+      ..cropHeight = crop?.height ?? 0;
+  }
+
+  static final _JpegCompressLadderFunc _jpegCompressLadder = mozJpegLib
       .lookup<
           NativeFunction<
-              Void Function(Pointer<Uint8>, Int32, Int32, Int32, Int32, Int32,
-                  Int32, IntPtr)>>("jpeg_compress_threaded")
+              Void Function(Pointer<Uint8>, Int32, Int32, Int32, Int32,
+                  Pointer<_JpegCompressOptions>, Int32, IntPtr)>>(
+          "jpeg_compress_ladder_threaded")
       .asFunction();
   static final Pointer<Uint8> Function(int) _jpegCompressGetPtr = mozJpegLib
       .lookup<NativeFunction<Pointer<Uint8> Function(IntPtr)>>(
@@ -100,12 +242,46 @@ abstract class FlutterMozjpeg {
   static final void Function(int) _jpegCompressRelease = mozJpegLib
       .lookup<NativeFunction<Void Function(IntPtr)>>("jpeg_compress_release")
       .asFunction();
+  static final void Function(Pointer<Utf8>, int) _jpegCacheConfigure =
+      mozJpegLib
+          .lookup<NativeFunction<Void Function(Pointer<Utf8>, Int64)>>(
+              "jpeg_cache_configure")
+          .asFunction();
+
+  /// Enable the persistent cache of the compression results on [directory]; null disables the cache.
+  /// The results are keyed by the image content (or `dedupeKey`) and the parameters, and the least recently used
+  /// ones are removed when the total size exceeds [maxBytes]. The cached results are returned without encoding
+  /// and the in-memory results are mapped directly from the cache files.
+  static void configureCache(Directory? directory,
+      {int maxBytes = 256 * 1024 * 1024}) {
+    using((arena) {
+      _jpegCacheConfigure(
+          directory == null
+              ? nullptr
+              : directory.path.toNativeUtf8(allocator: arena),
+          maxBytes);
+    });
+  }
 
   /// Compress the raw image data on memory.
   /// [stride], a.k.a. bytes-per-line, is depending on the pixel layout. If the data is RGBA,
-  /// [stride] is typically `width * 4` unless there are any trailing padding bytes.
+  /// [stride] is typically `width * 4` unless there are any trailing padding bytes. For a bottom-up buffer, [stride]
+  /// can be negative with [src] pointing to the top row of the image (the last row on memory).
   /// [quality] is JPEG compression quality in [0 - 100]; the default is 75.
   /// [dpi] is just an additional metadata, dot-per-inch; the default is 96.
+  /// If [crop] is specified, only the rectangle of the image is encoded; the rows are read in place without copying.
+  /// If [targetWidth] and/or [targetHeight] are specified, the image is downscaled to the size while encoding;
+  /// if only one of them is specified, the other is calculated to keep the aspect ratio. Upscaling is not supported.
+  /// [alphaMode] specifies how to handle the 4th byte of the 4-byte RGB layouts (extRGBX, extRGBA, extARGB, ...);
+  /// unless it is [MozJpegAlphaMode.ignore] (default), the byte is treated as alpha and the pixels are composited
+  /// over [backgroundColor] (default is white) while encoding.
+  /// [transform] rotates/mirrors the image while encoding (e.g. [MozJpegTransform.rotate90] for a camera buffer of
+  /// a portrait shot); the rows are transposed by small tiles on the fly, so no rotated copy of the image is made.
+  /// [targetWidth] and [targetHeight] are of the transformed image.
+  /// If the same image is being compressed with the same parameters by another call, the call waits for and shares
+  /// the result of it instead of compressing the image again. The images are compared by their pixels unless
+  /// [dedupeKey], which identifies the image content (e.g. URL or file path with its timestamp), is specified.
+  /// If the cache is enabled by [configureCache], [dedupeKey] is also used as the cache key.
   /// [progressCallback] receives progress percentage during the conversion.
   static Future<MozJpegEncodedResult?> jpegCompress(
     Pointer<Uint8> src,
@@ -115,13 +291,18 @@ abstract class FlutterMozjpeg {
     MozJpegColorSpace colorSpace, {
     int quality = 75,
     int dpi = 96,
+    int? targetWidth,
+    int? targetHeight,
+    MozJpegAlphaMode alphaMode = MozJpegAlphaMode.ignore,
+    ui.Color? backgroundColor,
+    String? dedupeKey,
+    MozJpegTransform transform = MozJpegTransform.none,
+    Rectangle<int>? crop,
     ProgressCallback? progressCallback,
   }) async {
     _ensureDartApiInitialized();
     final comp = Completer<MozJpegEncodedResult?>();
-    _jpegCompress(
-        src, width, height, stride, _cs2int[colorSpace]!, quality, dpi,
-        _addProgressCallback(
+    final context = _addProgressCallback(
       (pass, totalPass, percentage) {
         if (pass == _progressPassExitCode) {
           if (percentage != 0) comp.complete(null);
@@ -134,22 +315,233 @@ abstract class FlutterMozjpeg {
 
         progressCallback?.call(pass, totalPass, percentage);
       },
-    ));
+    );
+    _compressEx(src, width, height, stride, colorSpace, context,
+        quality: quality,
+        dpi: dpi,
+        targetWidth: targetWidth,
+        targetHeight: targetHeight,
+        alphaMode: alphaMode,
+        backgroundColor: backgroundColor,
+        dedupeKey: dedupeKey,
+        transform: transform,
+        crop: crop);
+    return await comp.future;
+  }
+
+  /// Compress the raw image data on memory into multiple JPEGs of different sizes/qualities at once.
+  /// The source is read only once and the smaller images are cascaded from the larger ones;
+  /// all the outputs are encoded in parallel.
+  /// [stride], a.k.a. bytes-per-line, is depending on the pixel layout. If the data is RGBA,
+  /// [stride] is typically `width * 4` unless there are any trailing padding bytes.
+  /// [dpi] is just an additional metadata, dot-per-inch; the default is 96.
+  /// [alphaMode], [backgroundColor], [transform] and [crop] work as same as [jpegCompress]; the sizes of [steps] are
+  /// of the cropped and transformed image.
+  /// [progressCallback] receives the number of finished outputs as `pass` and the number of [steps] as `totalPass`.
+  /// The function returns the results in the same order as [steps]; an element is null if the corresponding output failed.
+  static Future<List<MozJpegEncodedResult?>> jpegCompressLadder(
+    Pointer<Uint8> src,
+    int width,
+    int height,
+    int stride,
+    MozJpegColorSpace colorSpace,
+    List<MozJpegLadderStep> steps, {
+    int dpi = 96,
+    MozJpegAlphaMode alphaMode = MozJpegAlphaMode.ignore,
+    ui.Color? backgroundColor,
+    MozJpegTransform transform = MozJpegTransform.none,
+    Rectangle<int>? crop,
+    ProgressCallback? progressCallback,
+  }) async {
+    _ensureDartApiInitialized();
+    final results = List<MozJpegEncodedResult?>.filled(steps.length, null);
+    final comp = Completer<List<MozJpegEncodedResult?>>();
+    final context = _addProgressCallback(
+      (pass, totalPass, percentage) {
+        if (pass == _progressPassExitCode) {
+          comp.complete(results);
+          return;
+        }
+        if (pass == _progressPassVectorPointer) {
+          results[totalPass] = MozJpegEncodedResult._(percentage);
+          return;
+        }
+
+        progressCallback?.call(pass, totalPass, percentage);
+      },
+    );
+    using((arena) {
+      final options = arena<_JpegCompressOptions>(steps.length);
+      for (int i = 0; i < steps.length; i++) {
+        _fillOptions(options[i], arena,
+            quality: steps[i].quality,
+            dpi: dpi,
+            targetWidth: steps[i].width,
+            targetHeight: steps[i].height,
+            alphaMode: alphaMode,
+            backgroundColor: backgroundColor,
+            transform: transform,
+            crop: crop);
+      }
+      _jpegCompressLadder(src, width, height, stride, _cs2int[colorSpace]!,
+          options, steps.length, context);
+    });
+    return await comp.future;
+  }
+
+  /// Compress the raw image data on memory directly into [output] file.
+  /// Unlike [jpegCompress], the encoded data is written to the file while encoding and the whole output is never kept on memory.
+  /// [stride], a.k.a. bytes-per-line, is depending on the pixel layout. If the data is RGBA,
+  /// [stride] is typically `width * 4` unless there are any trailing padding bytes.
+  /// [quality] is JPEG compression quality in [0 - 100]; the default is 75.
+  /// [dpi] is just an additional metadata, dot-per-inch; the default is 96.
+  /// If [dropCache] is true, the written data is dropped from the OS page cache as soon as possible.
+  /// If [sync] is true, the file data is flushed to the storage before the function returns.
+  /// [targetWidth], [targetHeight], [alphaMode], [backgroundColor], [transform] and [crop] work as same as
+  /// [jpegCompress].
+  /// [progressCallback] receives progress percentage during the conversion.
+  /// The function returns the output file size or null if the compression failed.
+  static Future<int?> jpegCompressToFile(
+    Pointer<Uint8> src,
+    int width,
+    int height,
+    int stride,
+    MozJpegColorSpace colorSpace,
+    File output, {
+    int quality = 75,
+    int dpi = 96,
+    bool dropCache = false,
+    bool sync = false,
+    int? targetWidth,
+    int? targetHeight,
+    MozJpegAlphaMode alphaMode = MozJpegAlphaMode.ignore,
+    ui.Color? backgroundColor,
+    MozJpegTransform transform = MozJpegTransform.none,
+    Rectangle<int>? crop,
+    ProgressCallback? progressCallback,
+  }) async {
+    _ensureDartApiInitialized();
+    final comp = Completer<int?>();
+    int? size;
+    final context = _addProgressCallback(
+      (pass, totalPass, percentage) {
+        if (pass == _progressPassExitCode) {
+          comp.complete(percentage == 0 ? size : null);
+          return;
+        }
+        if (pass == _progressPassOutputFileSize) {
+          size = percentage;
+          return;
+        }
+
+        progressCallback?.call(pass, totalPass, percentage);
+      },
+    );
+    _compressEx(src, width, height, stride, colorSpace, context,
+        quality: quality,
+        dpi: dpi,
+        output: _outputFile,
+        outputPath: output.path,
+        outputPolicy: (dropCache ? _outputPolicyDontNeed : 0) |
+            (sync ? _outputPolicyDataSync : 0),
+        targetWidth: targetWidth,
+        targetHeight: targetHeight,
+        alphaMode: alphaMode,
+        backgroundColor: backgroundColor,
+        transform: transform,
+        crop: crop);
     return await comp.future;
   }
 
+  /// Compress the raw image data on memory and deliver the encoded data by chunks while encoding.
+  /// The encoding starts when the stream is listened; [src] must be kept valid until the stream is done.
+  /// [stride], a.k.a. bytes-per-line, is depending on the pixel layout. If the data is RGBA,
+  /// [stride] is typically `width * 4` unless there are any trailing padding bytes.
+  /// [quality] is JPEG compression quality in [0 - 100]; the default is 75.
+  /// [dpi] is just an additional metadata, dot-per-inch; the default is 96.
+  /// [chunkSize] is the size of each chunk in bytes except the last one; the default is 64KB.
+  /// If [progressive] is false (default), the output is a baseline JPEG and the chunks come while encoding;
+  /// otherwise mozjpeg's progressive/optimized output is generated and the chunks come at the end of the encoding.
+  /// [targetWidth], [targetHeight], [alphaMode], [backgroundColor], [transform] and [crop] work as same as
+  /// [jpegCompress].
+  /// [progressCallback] receives progress percentage during the conversion.
+  /// If the compression fails, the stream emits an error.
+  static Stream<Uint8List> jpegCompressStream(
+    Pointer<Uint8> src,
+    int width,
+    int height,
+    int stride,
+    MozJpegColorSpace colorSpace, {
+    int quality = 75,
+    int dpi = 96,
+    int chunkSize = 64 * 1024,
+    bool progressive = false,
+    int? targetWidth,
+    int? targetHeight,
+    MozJpegAlphaMode alphaMode = MozJpegAlphaMode.ignore,
+    ui.Color? backgroundColor,
+    MozJpegTransform transform = MozJpegTransform.none,
+    Rectangle<int>? crop,
+    ProgressCallback? progressCallback,
+  }) {
+    late final StreamController<Uint8List> controller;
+    controller = StreamController<Uint8List>(onListen: () {
+      _ensureDartApiInitialized();
+      final context = _addProgressCallback(
+        (pass, totalPass, percentage) {
+          if (pass == _progressPassExitCode) {
+            if (percentage != 0) {
+              controller.addError(
+                  Exception('JPEG compression failed: exit code=$percentage'));
+            }
+            controller.close();
+            return;
+          }
+          if (pass == _progressPassOutputFileSize) return;
+
+          progressCallback?.call(pass, totalPass, percentage);
+        },
+      );
+      _chunkCallbacks[context] = controller.add;
+      _compressEx(src, width, height, stride, colorSpace, context,
+          quality: quality,
+          dpi: dpi,
+          output: _outputStream,
+          chunkSize: chunkSize,
+          singlePass: !progressive,
+          targetWidth: targetWidth,
+          targetHeight: targetHeight,
+          alphaMode: alphaMode,
+          backgroundColor: backgroundColor,
+          transform: transform,
+          crop: crop);
+    });
+    return controller.stream;
+  }
+
   /// [quality] is JPEG compression quality in [0 - 100]; the default is 75.
   /// [dpi] is just an additional metadata, dot-per-inch; the default is 96.
+  /// [targetWidth] and [targetHeight] work as same as [jpegCompress].
+  /// If [backgroundColor] is specified, transparent pixels are composited over the color.
+  /// [dedupeKey] works as same as [jpegCompress].
   /// [progressCallback] receives progress percentage during the conversion.
   static Future<MozJpegEncodedResult?> jpegCompressImage(
     ui.Image image, {
     int quality = 75,
     int dpi = 96,
+    int? targetWidth,
+    int? targetHeight,
+    ui.Color? backgroundColor,
+    String? dedupeKey,
     ProgressCallback? progressCallback,
   }) =>
       image.compressWithMozJpeg(
         quality: quality,
         dpi: dpi,
+        targetWidth: targetWidth,
+        targetHeight: targetHeight,
+        backgroundColor: backgroundColor,
+        dedupeKey: dedupeKey,
         progressCallback: progressCallback,
       );
 
@@ -191,6 +583,10 @@ abstract class FlutterMozjpeg {
   /// [stride] is typically `width * 4` unless there are any trailing padding bytes.
   /// [quality] is JPEG compression quality in [0 - 100]; the default is 75.
   /// [dpi] is just an additional metadata, dot-per-inch; the default is 96.
+  /// [targetWidth] and [targetHeight] work as same as [jpegCompress].
+  /// If [backgroundColor] is specified, transparent pixels are composited over the color; the alpha is considered
+  /// to be premultiplied if [premultipliedAlpha] is true. Otherwise, the alpha is just ignored.
+  /// [dedupeKey] works as same as [jpegCompress].
   /// [progressCallback] receives progress percentage during the conversion.
   static Future<MozJpegEncodedResult?> jpegCompressRgbaBytes(
     Uint8List rgba,
@@ -199,14 +595,17 @@ abstract class FlutterMozjpeg {
     int? stride,
     int quality = 75,
     int dpi = 96,
+    int? targetWidth,
+    int? targetHeight,
+    ui.Color? backgroundColor,
+    bool premultipliedAlpha = false,
+    String? dedupeKey,
     ProgressCallback? progressCallback,
   }) =>
       using((arena) async {
         final buffer = arena.allocate<Uint8>(rgba.lengthInBytes);
-        final length = rgba.lengthInBytes;
-        for (int i = 0; i < length; i++) {
-          buffer[i] = rgba[i];
-        }
+        // setAll on the typed data view is done by a single memmove
+        buffer.asTypedList(rgba.lengthInBytes).setAll(0, rgba);
         return await FlutterMozjpeg.jpegCompress(
           buffer,
           width,
@@ -215,6 +614,11 @@ abstract class FlutterMozjpeg {
           MozJpegColorSpace.extRGBX,
           quality: quality,
           dpi: dpi,
+          targetWidth: targetWidth,
+          targetHeight: targetHeight,
+          alphaMode: _alphaModeFor(backgroundColor, premultipliedAlpha),
+          backgroundColor: backgroundColor,
+          dedupeKey: dedupeKey,
           progressCallback: progressCallback,
         );
       });
@@ -229,21 +633,14 @@ abstract class FlutterMozjpeg {
     int dpi = 96,
     ProgressCallback? progressCallback,
   }) async {
-    final result = await jpegCompressFileBytes(
-      fileBytes,
+    final image = await loadImageFromBytes(fileBytes);
+    final size = await image.compressWithMozJpegToFile(
+      output,
       quality: quality,
       dpi: dpi,
       progressCallback: progressCallback,
     );
-    if (result == null) return false;
-    try {
-      await result.save(output);
-      return true;
-    } catch (e) {
-      return false;
-    } finally {
-      result.dispose();
-    }
+    return size != null;
   }
 
   /// [quality] is JPEG compression quality in [0 - 100]; the default is 75.
@@ -264,104 +661,1789 @@ abstract class FlutterMozjpeg {
       progressCallback: progressCallback,
     );
   }
-}
 
-/// JPEG compression result.
-/// You must call [dispose] after using it.
-class MozJpegEncodedResult {
-  int? _vectorAddress;
-  MozJpegEncodedResult._(this._vectorAddress);
+  static final int Function(Pointer<Uint8>, int, Pointer<_JpegProbeInfo>)
+      _jpegProbe = mozJpegLib
+          .lookup<
+              NativeFunction<
+                  Int32 Function(Pointer<Uint8>, IntPtr,
+                      Pointer<_JpegProbeInfo>)>>("jpeg_probe")
+          .asFunction();
+  static final int Function(Pointer<Utf8>, Pointer<_JpegProbeInfo>)
+      _jpegProbeFile = mozJpegLib
+          .lookup<
+              NativeFunction<
+                  Int32 Function(
+                      Pointer<Utf8>, Pointer<_JpegProbeInfo>)>>("jpeg_probe_file")
+          .asFunction();
 
-  /// Buffer that contains the compressed result.
-  Uint8List get buffer => pointer.asTypedList(size);
+  static final _JpegRecompressFunc _jpegRecompress = mozJpegLib
+      .lookup<
+          NativeFunction<
+              Void Function(Pointer<Uint8>, IntPtr,
+                  Pointer<_JpegCompressOptions>, IntPtr)>>(
+          "jpeg_recompress_threaded")
+      .asFunction();
 
-  /// Pointer to the buffer that contains the compressed result.
-  Pointer<Uint8> get pointer =>
-      FlutterMozjpeg._jpegCompressGetPtr(_vectorAddress!);
+  /// Recompress the JPEG data with [quality].
+  /// The IJG quality of the input is estimated from its quantization tables first; if it is at or below [quality] and
+  /// the image is not resized, recompressing it only loses the quality, so the image is not decoded and only the
+  /// entropy coding is optimized losslessly (like jpegtran).
+  /// If the result is still larger than the input, the input itself is returned.
+  /// [targetWidth] and [targetHeight] work as same as [jpegCompress]; the image is always recompressed when resized.
+  /// If [progressive] is true (default), the output is progressive.
+  /// The markers of the input such as EXIF and ICC profile are kept.
+  /// [progressCallback] receives progress percentage during the conversion.
+  /// The function returns null if the data is not a valid JPEG or the compression failed.
+  static Future<MozJpegRecompressResult?> jpegRecompress(
+    Uint8List jpeg, {
+    int quality = 75,
+    int dpi = 96,
+    int? targetWidth,
+    int? targetHeight,
+    bool progressive = true,
+    ProgressCallback? progressCallback,
+  }) async {
+    _ensureDartApiInitialized();
+    // The input must be valid until the native side finishes
+    final data = malloc.allocate<Uint8>(jpeg.length);
+    data.asTypedList(jpeg.length).setAll(0, jpeg);
+    final comp = Completer<MozJpegRecompressResult?>();
+    MozJpegRecompressResult? result;
+    final context = _addProgressCallback(
+      (pass, totalPass, percentage) {
+        if (pass == _progressPassExitCode) {
+          malloc.free(data);
+          comp.complete(percentage == 0 ? result : null);
+          return;
+        }
+        if (pass == _progressPassVectorPointer) {
+          result = MozJpegRecompressResult._(
+              MozJpegEncodedResult._(percentage),
+              switch (totalPass) {
+                _progressTPassOptimized => MozJpegRecompressOutcome.optimized,
+                _progressTPassNoChange => MozJpegRecompressOutcome.original,
+                _ => MozJpegRecompressOutcome.recompressed,
+              });
+          return;
+        }
 
-  /// Size in bytes of the compressed result.
-  int get size => FlutterMozjpeg._jpegCompressGetSize(_vectorAddress!);
+        progressCallback?.call(pass, totalPass, percentage);
+      },
+    );
+    using((arena) {
+      final options = arena<_JpegCompressOptions>();
+      _fillOptions(options.ref, arena,
+          quality: quality,
+          dpi: dpi,
+          singlePass: !progressive,
+          targetWidth: targetWidth,
+          targetHeight: targetHeight);
+      _jpegRecompress(data, jpeg.length, options, context);
+    });
+    return await comp.future;
+  }
 
-  /// Save the compressed result JPEG data to file.
-  Future<void> save(File file) => file.writeAsBytes(buffer);
+  /// Recompress the JPEG file; see [jpegRecompress].
+  static Future<MozJpegRecompressResult?> jpegRecompressFile(
+    File file, {
+    int quality = 75,
+    int dpi = 96,
+    int? targetWidth,
+    int? targetHeight,
+    bool progressive = true,
+    ProgressCallback? progressCallback,
+  }) async =>
+      jpegRecompress(
+        await file.readAsBytes(),
+        quality: quality,
+        dpi: dpi,
+        targetWidth: targetWidth,
+        targetHeight: targetHeight,
+        progressive: progressive,
+        progressCallback: progressCallback,
+      );
 
-  /// Create image object from the compressed result.
-  Future<ui.Image> createImage() => loadImageFromBytes(buffer);
+  static final _JpegTileGridFunc _jpegTileGrid = mozJpegLib
+      .lookup<
+          NativeFunction<
+              Void Function(Pointer<Uint8>, IntPtr, Pointer<_JpegTileOptions>,
+                  IntPtr)>>("jpeg_tile_grid_threaded")
+      .asFunction();
 
-  /// Release the resources used by the object.
-  void dispose() {
-    FlutterMozjpeg._jpegCompressRelease(_vectorAddress!);
-    _vectorAddress = null;
+  /// Split the JPEG data into the grid of [tileWidth] x [tileHeight] tiles without decoding the image; each tile is
+  /// a lossless crop of the image. The tile size is rounded up to the multiple of the MCU size (8 or 16 pixels typically)
+  /// and the tiles on the right/bottom edges may be smaller. The image data is read only once and the tiles are
+  /// encoded in parallel.
+  /// If [outputDirectory] is specified, the tiles are written to `<column>_<row>.jpg` in the directory and
+  /// [MozJpegTileGrid.tiles] is empty; otherwise, the tiles are returned on memory.
+  /// If [copyMarkers] is true, the APPn/COM markers (EXIF, ICC profile, ...) are copied to every tile.
+  /// If [progressive] is true, the tiles are progressive JPEGs.
+  /// [progressCallback] receives the number of finished tiles as `pass` and the number of tiles as `totalPass`.
+  /// The function returns null if the data is not a valid JPEG or any of the tiles failed.
+  static Future<MozJpegTileGrid?> jpegTileGrid(
+    Uint8List jpeg, {
+    required int tileWidth,
+    required int tileHeight,
+    Directory? outputDirectory,
+    bool copyMarkers = false,
+    bool progressive = false,
+    ProgressCallback? progressCallback,
+  }) async {
+    final info = jpegProbe(jpeg);
+    if (info == null || tileWidth <= 0 || tileHeight <= 0) return null;
+    // Same as the native side; the tile size is aligned to the iMCU
+    final mcuWidth =
+        info.numComponents == 1 ? 8 : info.hSampFactors.reduce(max) * 8;
+    final mcuHeight =
+        info.numComponents == 1 ? 8 : info.vSampFactors.reduce(max) * 8;
+    final tw = (tileWidth + mcuWidth - 1) ~/ mcuWidth * mcuWidth;
+    final th = (tileHeight + mcuHeight - 1) ~/ mcuHeight * mcuHeight;
+    final columns = (info.width + tw - 1) ~/ tw;
+    final rows = (info.height + th - 1) ~/ th;
+
+    _ensureDartApiInitialized();
+    // The input must be valid until the native side finishes
+    final data = malloc.allocate<Uint8>(jpeg.length);
+    data.asTypedList(jpeg.length).setAll(0, jpeg);
+    final tiles = List<MozJpegEncodedResult?>.filled(
+        outputDirectory == null ? columns * rows : 0, null);
+    final comp = Completer<MozJpegTileGrid?>();
+    final context = _addProgressCallback(
+      (pass, totalPass, percentage) {
+        if (pass == _progressPassExitCode) {
+          malloc.free(data);
+          if (percentage == 0) {
+            comp.complete(MozJpegTileGrid._(columns, rows, tw, th, tiles));
+          } else {
+            for (final tile in tiles) {
+              tile?.dispose();
+            }
+            comp.complete(null);
+          }
+          return;
+        }
+        if (pass == _progressPassVectorPointer) {
+          tiles[totalPass] = MozJpegEncodedResult._(percentage);
+          return;
+        }
+        if (pass == _progressPassOutputFileSize) return;
+
+        progressCallback?.call(pass, totalPass, percentage);
+      },
+    );
+    using((arena) {
+      final options = arena<_JpegTileOptions>()
+        ..ref.tileWidth = tileWidth
+        ..ref.tileHeight = tileHeight
+        ..ref.output = outputDirectory == null ? _outputVector : _outputFile
+        ..ref.outputDir = outputDirectory == null
+            ? nullptr
+            : outputDirectory.path.toNativeUtf8(allocator: arena)
+        ..ref.outputPolicy = 0
+        ..ref.copyMarkers = copyMarkers ? 1 : 0
+        ..ref.progressive = progressive ? 1 : 0;
+      _jpegTileGrid(data, jpeg.length, options, context);
+    });
+    return await comp.future;
   }
-}
 
-final _cs2int = <MozJpegColorSpace, int>{
-  MozJpegColorSpace.unknown: 0,
-  MozJpegColorSpace.grayscale: 1,
-  MozJpegColorSpace.RGB: 2,
-  MozJpegColorSpace.YCbCr: 3,
-  MozJpegColorSpace.CMYK: 4,
-  MozJpegColorSpace.YCCK: 5,
-  MozJpegColorSpace.extRGB: 6,
-  MozJpegColorSpace.extRGBX: 7,
-  MozJpegColorSpace.extBGR: 8,
-  MozJpegColorSpace.extBGRX: 9,
-  MozJpegColorSpace.extXBGR: 10,
-  MozJpegColorSpace.extXRGB: 11,
-  MozJpegColorSpace.extRGBA: 12,
-  MozJpegColorSpace.extBGRA: 13,
-  MozJpegColorSpace.extABGR: 14,
-  MozJpegColorSpace.extARGB: 15,
-  MozJpegColorSpace.RGB565: 16
-};
+  static final _JpegPyramidFunc _jpegPyramid = mozJpegLib
+      .lookup<
+          NativeFunction<
+              Void Function(Pointer<Uint8>, Int32, Int32, Int32, Int32,
+                  Pointer<_JpegPyramidOptions>, IntPtr)>>(
+          "jpeg_pyramid_threaded")
+      .asFunction();
+  static final _JpegPyramidFromJpegFunc _jpegPyramidFromJpeg = mozJpegLib
+      .lookup<
+          NativeFunction<
+              Void Function(Pointer<Uint8>, IntPtr,
+                  Pointer<_JpegPyramidOptions>, IntPtr)>>(
+          "jpeg_pyramid_from_jpeg_threaded")
+      .asFunction();
 
-/// Input color space and pixel layout.
-enum MozJpegColorSpace {
-  unknown,
-  grayscale,
-  // ignore: constant_identifier_names
-  RGB,
-  // ignore: constant_identifier_names
-  YCbCr,
-  // ignore: constant_identifier_names
-  CMYK,
-  // ignore: constant_identifier_names
-  YCCK,
-  extRGB,
-  extRGBX,
-  extBGR,
-  extBGRX,
-  extXBGR,
-  extXRGB,
-  extRGBA,
-  extBGRA,
-  extABGR,
-  extARGB,
-  // ignore: constant_identifier_names
-  RGB565,
-}
+  /// Run the pyramid generator; [run] calls the native function with the options and the context.
+  static Future<bool> _deepZoom(
+    File dzi, {
+    required int tileSize,
+    required int overlap,
+    required int quality,
+    required bool progressive,
+    bool losslessTopLevel = false,
+    MozJpegAlphaMode alphaMode = MozJpegAlphaMode.ignore,
+    ui.Color? backgroundColor,
+    MozJpegTransform transform = MozJpegTransform.none,
+    ProgressCallback? progressCallback,
+    required void Function(Pointer<_JpegPyramidOptions>, int) run,
+  }) async {
+    _ensureDartApiInitialized();
+    final comp = Completer<bool>();
+    final context = _addProgressCallback(
+      (pass, totalPass, percentage) {
+        if (pass == _progressPassExitCode) {
+          comp.complete(percentage == 0);
+          return;
+        }
 
-/// Helper function to load image from data bytes. It's just a wrapper function for [ui.decodeImageFromList].
-Future<ui.Image> loadImageFromBytes(Uint8List byteData) {
-  final comp = Completer<ui.Image>();
-  ui.decodeImageFromList(byteData, (result) => comp.complete(result));
-  return comp.future;
-}
+        progressCallback?.call(pass, totalPass, percentage);
+      },
+    );
+    // <name>.dzi and <name>_files/ as the Deep Zoom viewers expect
+    final base = dzi.path.endsWith('.dzi')
+        ? dzi.path.substring(0, dzi.path.length - 4)
+        : dzi.path;
+    using((arena) {
+      final options = arena<_JpegPyramidOptions>();
+      options.ref
+        ..tileSize = tileSize
+        ..overlap = overlap
+        ..outputDir = '${base}_files'.toNativeUtf8(allocator: arena)
+        ..dziPath = dzi.path.toNativeUtf8(allocator: arena)
+        ..losslessTopLevel = losslessTopLevel ? 1 : 0;
+      _fillOptions(options.ref.compress, arena,
+          quality: quality,
+          dpi: 96,
+          singlePass: !progressive,
+          alphaMode: alphaMode,
+          backgroundColor: backgroundColor,
+          transform: transform);
+      run(options, context);
+    });
+    return await comp.future;
+  }
 
-extension FlutterMozjpegOnUiImage on ui.Image {
-  Future<MozJpegEncodedResult?> compressWithMozJpeg({
+  /// Generate the Deep Zoom (DZI) tile pyramid of the raw image data on memory; the descriptor is written to [dzi]
+  /// (e.g. `image.dzi`) and the tiles to `<level>/<column>_<row>.jpg` in the `image_files` directory next to it.
+  /// The levels are halved down to 1x1 and each level is split into [tileSize] tiles that share [overlap] pixels
+  /// with the adjacent ones. Only the rows needed for the current row of tiles are kept on memory on each level and
+  /// the tiles are encoded in parallel.
+  /// [stride], [alphaMode], [backgroundColor] and [transform] work as same as [jpegCompress]; [src] must be kept valid
+  /// until the function completes.
+  /// [progressCallback] receives the number of finished tiles as `pass` and the number of tiles as `totalPass`.
+  /// The function returns false if the generation failed.
+  static Future<bool> jpegDeepZoom(
+    Pointer<Uint8> src,
+    int width,
+    int height,
+    int stride,
+    MozJpegColorSpace colorSpace,
+    File dzi, {
+    int tileSize = 254,
+    int overlap = 1,
     int quality = 75,
-    int dpi = 96,
+    bool progressive = true,
+    MozJpegAlphaMode alphaMode = MozJpegAlphaMode.ignore,
+    ui.Color? backgroundColor,
+    MozJpegTransform transform = MozJpegTransform.none,
+    ProgressCallback? progressCallback,
+  }) =>
+      _deepZoom(dzi,
+          tileSize: tileSize,
+          overlap: overlap,
+          quality: quality,
+          progressive: progressive,
+          alphaMode: alphaMode,
+          backgroundColor: backgroundColor,
+          transform: transform,
+          progressCallback: progressCallback,
+          run: (options, context) => _jpegPyramid(src, width, height, stride,
+              _cs2int[colorSpace]!, options, context));
+
+  /// Generate the Deep Zoom (DZI) tile pyramid of the JPEG data; see [jpegDeepZoom].
+  /// If [losslessTopLevel] is true, [overlap] is 0 and [tileSize] is a multiple of the MCU size (16 works for any
+  /// JPEG), the full size tiles are cropped losslessly from the JPEG data without decoding (see [jpegTileGrid])
+  /// and the image is decoded only at the half size for the other levels. Note that it holds the whole compressed
+  /// coefficients on memory.
+  static Future<bool> jpegDeepZoomFromJpeg(
+    Uint8List jpeg,
+    File dzi, {
+    int tileSize = 254,
+    int overlap = 1,
+    int quality = 75,
+    bool progressive = true,
+    bool losslessTopLevel = false,
+    ProgressCallback? progressCallback,
+  }) async {
+    // The input must be valid until the native side finishes
+    final data = malloc.allocate<Uint8>(jpeg.length);
+    data.asTypedList(jpeg.length).setAll(0, jpeg);
+    try {
+      return await _deepZoom(dzi,
+          tileSize: tileSize,
+          overlap: overlap,
+          quality: quality,
+          progressive: progressive,
+          losslessTopLevel: losslessTopLevel,
+          progressCallback: progressCallback,
+          run: (options, context) =>
+              _jpegPyramidFromJpeg(data, jpeg.length, options, context));
+    } finally {
+      malloc.free(data);
+    }
+  }
+
+  static final _JpegSequenceCreateFunc _jpegSequenceCreate = mozJpegLib
+      .lookup<
+          NativeFunction<
+              Pointer<Void> Function(Int32, Int32, Int32, Int32,
+                  Pointer<_JpegCompressOptions>, IntPtr)>>(
+          "jpeg_sequence_create")
+      .asFunction();
+  static final int Function(Pointer<Void>) _jpegSequenceTables = mozJpegLib
+      .lookup<NativeFunction<IntPtr Function(Pointer<Void>)>>(
+          "jpeg_sequence_tables")
+      .asFunction();
+  static final int Function(Pointer<Void>, Pointer<Uint8>)
+      _jpegSequenceAddFrame = mozJpegLib
+          .lookup<NativeFunction<Int32 Function(Pointer<Void>, Pointer<Uint8>)>>(
+              "jpeg_sequence_add_frame")
+          .asFunction();
+  static final void Function(Pointer<Void>) _jpegSequenceFinish = mozJpegLib
+      .lookup<NativeFunction<Void Function(Pointer<Void>)>>(
+          "jpeg_sequence_finish_threaded")
+      .asFunction();
+
+  /// Start a sequence encoder for the frames of the same size and layout (burst shots, screen recording,
+  /// Motion-JPEG, ...). The quantization and Huffman tables are shared by all the frames: they are written once
+  /// as the tables-only JPEG ([MozJpegSequence.tables]) and every frame is an abbreviated JPEG without the tables,
+  /// which saves the table setup per frame and about 400-600 bytes per frame.
+  /// The frames are encoded in parallel; the output is always baseline with the standard Huffman tables.
+  /// If [output] is specified, the frames are written to the file in the order they are added just after the
+  /// tables-only JPEG (a raw concatenation of the JPEG datastreams); otherwise, the frames are returned on memory.
+  /// [dropCache] and [sync] work as same as [jpegCompressToFile].
+  /// [quality], [dpi], [targetWidth], [targetHeight], [alphaMode], [backgroundColor], [transform] and [crop] work as
+  /// same as [jpegCompress] and are applied to every frame.
+  /// The function returns null if the parameters are invalid or the output file can't be created.
+  static MozJpegSequence? jpegSequence(
+    int width,
+    int height,
+    int stride,
+    MozJpegColorSpace colorSpace, {
+    int quality = 75,
+    int dpi = 96,
+    File? output,
+    bool dropCache = false,
+    bool sync = false,
+    int? targetWidth,
+    int? targetHeight,
+    MozJpegAlphaMode alphaMode = MozJpegAlphaMode.ignore,
+    ui.Color? backgroundColor,
+    MozJpegTransform transform = MozJpegTransform.none,
+    Rectangle<int>? crop,
+  }) {
+    _ensureDartApiInitialized();
+    final sequence = MozJpegSequence._();
+    final context = _addProgressCallback(sequence._onProgress);
+    final handle = using((arena) {
+      final options = arena<_JpegCompressOptions>();
+      _fillOptions(options.ref, arena,
+          quality: quality,
+          dpi: dpi,
+          output: output == null ? _outputVector : _outputFile,
+          outputPath: output?.path,
+          outputPolicy: (dropCache ? _outputPolicyDontNeed : 0) |
+              (sync ? _outputPolicyDataSync : 0),
+          singlePass: true,
+          targetWidth: targetWidth,
+          targetHeight: targetHeight,
+          alphaMode: alphaMode,
+          backgroundColor: backgroundColor,
+          transform: transform,
+          crop: crop);
+      return _jpegSequenceCreate(width, height, stride,
+          _cs2int[colorSpace]!, options, context);
+    });
+    if (handle == nullptr) {
+      _progressCallbacks.remove(context);
+      return null;
+    }
+    sequence._handle = handle;
+    return sequence;
+  }
+
+  static final _JpegFrameEncoderCreateFunc _jpegFrameEncoderCreate = mozJpegLib
+      .lookup<
+          NativeFunction<
+              Pointer<Void> Function(Int32, Int32, Int32, Int32,
+                  Pointer<_JpegCompressOptions>)>>("jpeg_frame_encoder_create")
+      .asFunction();
+  static final void Function(Pointer<Void>, Pointer<Uint8>, Pointer<Utf8>, int)
+      _jpegFrameEncoderEncode = mozJpegLib
+          .lookup<
+              NativeFunction<
+                  Void Function(Pointer<Void>, Pointer<Uint8>, Pointer<Utf8>,
+                      IntPtr)>>("jpeg_frame_encoder_encode_threaded")
+          .asFunction();
+  static final void Function(Pointer<Void>) _jpegFrameEncoderRelease =
+      mozJpegLib
+          .lookup<NativeFunction<Void Function(Pointer<Void>)>>(
+              "jpeg_frame_encoder_release")
+          .asFunction();
+
+  /// Create an encoder for the successive frames that are mostly identical (e.g. screen capture).
+  /// The frames are compared with the previous one by MCUs (16x16 pixels for color images) and only the changed MCUs
+  /// are color converted, transformed and quantized again; the other MCUs reuse the coefficients of the previous
+  /// frame and only the entropy coding runs on them. The output is the same as [jpegCompress] with the same
+  /// parameters except that the DC coefficients are quantized without the trellis.
+  /// If [progressive] is false (default), the output is a baseline JPEG with the standard Huffman tables; otherwise,
+  /// it's a progressive JPEG with the optimized Huffman tables.
+  /// [quality], [dpi], [targetWidth], [targetHeight], [alphaMode], [backgroundColor], [transform] and [crop] work as
+  /// same as [jpegCompress] and are applied to every frame.
+  /// The function returns null if the parameters are invalid. The encoder must be disposed after use.
+  static MozJpegFrameEncoder? jpegFrameEncoder(
+    int width,
+    int height,
+    int stride,
+    MozJpegColorSpace colorSpace, {
+    int quality = 75,
+    int dpi = 96,
+    bool progressive = false,
+    bool dropCache = false,
+    bool sync = false,
+    int? targetWidth,
+    int? targetHeight,
+    MozJpegAlphaMode alphaMode = MozJpegAlphaMode.ignore,
+    ui.Color? backgroundColor,
+    MozJpegTransform transform = MozJpegTransform.none,
+    Rectangle<int>? crop,
+  }) {
+    final handle = using((arena) {
+      final options = arena<_JpegCompressOptions>();
+      _fillOptions(options.ref, arena,
+          quality: quality,
+          dpi: dpi,
+          outputPolicy: (dropCache ? _outputPolicyDontNeed : 0) |
+              (sync ? _outputPolicyDataSync : 0),
+          singlePass: !progressive,
+          targetWidth: targetWidth,
+          targetHeight: targetHeight,
+          alphaMode: alphaMode,
+          backgroundColor: backgroundColor,
+          transform: transform,
+          crop: crop);
+      return _jpegFrameEncoderCreate(
+          width, height, stride, _cs2int[colorSpace]!, options);
+    });
+    return handle == nullptr ? null : MozJpegFrameEncoder._(handle);
+  }
+
+  static final _JpegCompressBeginFunc _jpegCompressBegin = mozJpegLib
+      .lookup<
+          NativeFunction<
+              Pointer<Void> Function(Pointer<Uint8>, Int32, Int32, Int32, Int32,
+                  Pointer<_JpegCompressOptions>)>>("jpeg_compress_begin")
+      .asFunction();
+  static final int Function(Pointer<Void>, int) _jpegCompressStep = mozJpegLib
+      .lookup<NativeFunction<Int32 Function(Pointer<Void>, Int32)>>(
+          "jpeg_compress_step")
+      .asFunction();
+  static final int Function(Pointer<Void>, Pointer<IntPtr>, Pointer<IntPtr>)
+      _jpegCompressEnd = mozJpegLib
+          .lookup<
+              NativeFunction<
+                  Int32 Function(Pointer<Void>, Pointer<IntPtr>,
+                      Pointer<IntPtr>)>>("jpeg_compress_end")
+          .asFunction();
+
+  /// Value returned by `jpeg_compress_step` if there are more rows.
+  static const int _stepMore = 1;
+
+  /// Start a resumable compression that runs on the calling thread by [MozJpegSteppedEncoder.step]; it's for the
+  /// environments that can't spare a thread for the encoder. [src] must be kept valid until the encoder is ended.
+  /// If [output] is specified, the JPEG is written to the file; [dropCache] and [sync] work as same as
+  /// [jpegCompressToFile]. Otherwise, the JPEG is built on memory.
+  /// If [progressive] is false (default), the output is a baseline JPEG and every step takes time proportional to
+  /// its rows; otherwise, the last step also runs the progressive/optimized entropy coding of the whole image.
+  /// [quality], [dpi], [targetWidth], [targetHeight], [alphaMode], [backgroundColor], [transform] and [crop] work as
+  /// same as [jpegCompress].
+  /// The function returns null if the parameters are invalid or the output file can't be created.
+  static MozJpegSteppedEncoder? jpegCompressBegin(
+    Pointer<Uint8> src,
+    int width,
+    int height,
+    int stride,
+    MozJpegColorSpace colorSpace, {
+    int quality = 75,
+    int dpi = 96,
+    bool progressive = false,
+    File? output,
+    bool dropCache = false,
+    bool sync = false,
+    int? targetWidth,
+    int? targetHeight,
+    MozJpegAlphaMode alphaMode = MozJpegAlphaMode.ignore,
+    ui.Color? backgroundColor,
+    MozJpegTransform transform = MozJpegTransform.none,
+    Rectangle<int>? crop,
+  }) {
+    final handle = using((arena) {
+      final options = arena<_JpegCompressOptions>();
+      _fillOptions(options.ref, arena,
+          quality: quality,
+          dpi: dpi,
+          output: output == null ? _outputVector : _outputFile,
+          outputPath: output?.path,
+          outputPolicy: (dropCache ? _outputPolicyDontNeed : 0) |
+              (sync ? _outputPolicyDataSync : 0),
+          singlePass: !progressive,
+          targetWidth: targetWidth,
+          targetHeight: targetHeight,
+          alphaMode: alphaMode,
+          backgroundColor: backgroundColor,
+          transform: transform,
+          crop: crop);
+      return _jpegCompressBegin(
+          src, width, height, stride, _cs2int[colorSpace]!, options);
+    });
+    return handle == nullptr ? null : MozJpegSteppedEncoder._(handle);
+  }
+
+  /// Compress the raw image data on memory on the calling (UI) isolate without any background thread; the encoding is
+  /// split into the slices of [rowsPerSlice] rows and the other events are processed between the slices.
+  /// The parameters work as same as [jpegCompressBegin].
+  /// The function returns null if the compression failed.
+  static Future<MozJpegEncodedResult?> jpegCompressCooperative(
+    Pointer<Uint8> src,
+    int width,
+    int height,
+    int stride,
+    MozJpegColorSpace colorSpace, {
+    int quality = 75,
+    int dpi = 96,
+    bool progressive = false,
+    int? targetWidth,
+    int? targetHeight,
+    MozJpegAlphaMode alphaMode = MozJpegAlphaMode.ignore,
+    ui.Color? backgroundColor,
+    MozJpegTransform transform = MozJpegTransform.none,
+    Rectangle<int>? crop,
+    int rowsPerSlice = 64,
+  }) async {
+    final encoder = jpegCompressBegin(src, width, height, stride, colorSpace,
+        quality: quality,
+        dpi: dpi,
+        progressive: progressive,
+        targetWidth: targetWidth,
+        targetHeight: targetHeight,
+        alphaMode: alphaMode,
+        backgroundColor: backgroundColor,
+        transform: transform,
+        crop: crop);
+    if (encoder == null) return null;
+    while (encoder.step(rowsPerSlice)) {
+      await Future<void>.delayed(Duration.zero);
+    }
+    return encoder.end() == null ? null : encoder.result;
+  }
+
+  static final _JpegtranBatchFunc _jpegtranBatch = mozJpegLib
+      .lookup<
+          NativeFunction<
+              Int32 Function(
+                  Int32,
+                  Pointer<Pointer<Utf8>>,
+                  Pointer<Pointer<Utf8>>,
+                  Pointer<Pointer<Utf8>>,
+                  Int32,
+                  Pointer<_JpegBatchStats>,
+                  IntPtr)>>("jpegtran_batch_threaded")
+      .asFunction();
+
+  /// Transform the JPEG files [inputs] into [outputs] (of the same length) by jpegtran losslessly; an output may be
+  /// the input itself as the file is replaced only when it's done.
+  /// [switches] are the jpegtran switches without the file names, such as `['-optimize', '-copy', 'none']` (default)
+  /// or `['-rotate', '90']`. `['-fastdecode', '1']` converts the files to baseline with the optimized Huffman tables
+  /// and a restart marker on every MCU row, which decode faster than progressive ones and can be decoded in parallel.
+  /// The files are read ahead and written behind by the I/O threads while the transformations run in parallel, so
+  /// the storage and the CPUs are kept busy at the same time.
+  /// [dropCache] and [sync] work as same as [jpegCompressToFile].
+  /// [progressCallback] receives the number of the files done (pass) and the number of the files (totalPass).
+  /// The function returns null if the switches are invalid.
+  static Future<MozJpegBatchResult?> jpegtranBatch(
+    List<File> inputs,
+    List<File> outputs, {
+    List<String> switches = const ['-optimize', '-copy', 'none'],
+    bool dropCache = false,
+    bool sync = false,
+    ProgressCallback? progressCallback,
+  }) async {
+    assert(inputs.length == outputs.length);
+    _ensureDartApiInitialized();
+    final comp = Completer<MozJpegBatchResult?>();
+    final sizes = List<int?>.filled(inputs.length, null);
+    var reported = false;
+    // The stats are filled on the native side until the exit code is notified
+    final stats = malloc<_JpegBatchStats>();
+    final context = _addProgressCallback(
+      (pass, totalPass, percentage) {
+        if (pass == _progressPassExitCode) {
+          final s = stats.ref;
+          comp.complete(totalPass < 0 || (percentage != 0 && !reported)
+              ? null
+              : MozJpegBatchResult._(
+                  sizes,
+                  s.filesSucceeded,
+                  s.filesFailed,
+                  s.bytesRead,
+                  s.bytesWritten,
+                  Duration(microseconds: s.elapsedUs)));
+          malloc.free(stats);
+          return;
+        }
+        if (pass == _progressPassOutputFileSize) {
+          reported = true;
+          sizes[totalPass] = percentage < 0 ? null : percentage;
+          return;
+        }
+
+        progressCallback?.call(pass, totalPass, percentage);
+      },
+    );
+    using((arena) {
+      final args = [
+        'jpegtran',
+        // for -maxmemory; the app's own temporary directory
+        '-tempdir',
+        Directory.systemTemp.path,
+        ...switches,
+        if (dropCache) '-dropcache',
+        if (sync) '-fsync',
+      ];
+      Pointer<Pointer<Utf8>> toNative(List<String> strings) {
+        final p = arena<Pointer<Utf8>>(max(strings.length, 1));
+        for (int i = 0; i < strings.length; i++) {
+          p[i] = strings[i].toNativeUtf8(allocator: arena);
+        }
+        return p;
+      }
+
+      // The strings are copied by the native side
+      _jpegtranBatch(
+          args.length,
+          toNative(args),
+          toNative(inputs.map((f) => f.path).toList()),
+          toNative(outputs.map((f) => f.path).toList()),
+          inputs.length,
+          stats,
+          context);
+    });
+    return await comp.future;
+  }
+
+  static final int Function(int, Pointer<Pointer<Utf8>>, Pointer<Utf8>, int, int)
+      _jpegtranManifest = mozJpegLib
+          .lookup<
+              NativeFunction<
+                  Int32 Function(Int32, Pointer<Pointer<Utf8>>, Pointer<Utf8>,
+                      Int32, IntPtr)>>("jpegtran_manifest_threaded")
+          .asFunction();
+
+  /// Transform the JPEG files of [entries] by jpegtran losslessly in a single native call; each file is transformed
+  /// by [switches] followed by its own [MozJpegBatchEntry.switches].
+  /// Up to [concurrency] files are transformed at the same time (0 for the number of the CPU cores) while the other
+  /// files are read and written. Nothing is reported until the end; the summary of all the files is returned at once.
+  /// [dropCache] and [sync] work as same as [jpegCompressToFile].
+  /// The function returns null if [switches] are invalid; the paths should not contain tabs or newlines.
+  static Future<MozJpegManifestResult?> jpegtranManifest(
+    List<MozJpegBatchEntry> entries, {
+    List<String> switches = const ['-optimize', '-copy', 'none'],
+    int concurrency = 0,
+    bool dropCache = false,
+    bool sync = false,
+  }) async {
+    _ensureDartApiInitialized();
+    final comp = Completer<MozJpegManifestResult?>();
+    MozJpegManifestResult? result;
+    final context = _addProgressCallback(
+      (pass, totalPass, percentage) {
+        if (pass == _progressPassExitCode) {
+          comp.complete(result);
+          return;
+        }
+        if (pass == _progressPassVectorPointer) {
+          final summary = MozJpegEncodedResult._(percentage);
+          result = MozJpegManifestResult._fromSummary(
+              summary.pointer.cast<_JpegBatchStats>(), totalPass);
+          summary.dispose();
+        }
+      },
+    );
+    final manifest = entries
+        .map((e) =>
+            '${e.input.path}\t${e.output?.path ?? ''}\t${e.switches.join(' ')}')
+        .join('\n');
+    using((arena) {
+      final args = [
+        'jpegtran',
+        // for -maxmemory; the app's own temporary directory
+        '-tempdir',
+        Directory.systemTemp.path,
+        ...switches,
+        if (dropCache) '-dropcache',
+        if (sync) '-fsync',
+      ];
+      final argv = arena<Pointer<Utf8>>(args.length);
+      for (int i = 0; i < args.length; i++) {
+        argv[i] = args[i].toNativeUtf8(allocator: arena);
+      }
+      // The strings are copied by the native side
+      _jpegtranManifest(args.length, argv,
+          manifest.toNativeUtf8(allocator: arena), concurrency, context);
+    });
+    return await comp.future;
+  }
+
+  /// Transform the JPEG files (*.jpg and *.jpeg) directly under [input] into the files of the same names in
+  /// [output] by [jpegtranManifest]; if [output] is null, the files are replaced.
+  static Future<MozJpegManifestResult?> jpegtranDirectory(
+    Directory input, {
+    Directory? output,
+    List<String> switches = const ['-optimize', '-copy', 'none'],
+    int concurrency = 0,
+    bool dropCache = false,
+    bool sync = false,
+  }) async {
+    final entries = <MozJpegBatchEntry>[];
+    await for (final entity in input.list()) {
+      if (entity is! File) continue;
+      final name = entity.uri.pathSegments.last;
+      final lower = name.toLowerCase();
+      if (!lower.endsWith('.jpg') && !lower.endsWith('.jpeg')) continue;
+      entries.add(MozJpegBatchEntry(entity,
+          output: output == null ? null : File('${output.path}/$name')));
+    }
+    return await jpegtranManifest(entries,
+        switches: switches,
+        concurrency: concurrency,
+        dropCache: dropCache,
+        sync: sync);
+  }
+
+  static final int Function(Pointer<Uint8>, int, Pointer<_JpegMarkerPolicy>,
+          Pointer<IntPtr>) _jpegRewriteMarkers =
+      mozJpegLib
+          .lookup<
+              NativeFunction<
+                  Int32 Function(Pointer<Uint8>, IntPtr,
+                      Pointer<_JpegMarkerPolicy>, Pointer<IntPtr>)>>(
+              "jpeg_rewrite_markers")
+          .asFunction();
+  static final int Function(
+          Pointer<Utf8>, Pointer<Utf8>, Pointer<_JpegMarkerPolicy>)
+      _jpegRewriteMarkersFile = mozJpegLib
+          .lookup<
+              NativeFunction<
+                  Int32 Function(Pointer<Utf8>, Pointer<Utf8>,
+                      Pointer<_JpegMarkerPolicy>)>>("jpeg_rewrite_markers_file")
+          .asFunction();
+
+  static Pointer<Uint8> _toNativeBytes(List<int>? bytes, Arena arena) {
+    if (bytes == null || bytes.isEmpty) return nullptr;
+    final p = arena.allocate<Uint8>(bytes.length);
+    p.asTypedList(bytes.length).setAll(0, bytes);
+    return p;
+  }
+
+  static Pointer<_JpegMarkerPolicy> _toNativePolicy(
+      MozJpegMarkerPolicy policy, Arena arena) {
+    final rules = arena<_JpegMarkerRule>(max(policy.rules.length, 1));
+    for (int i = 0; i < policy.rules.length; i++) {
+      final rule = policy.rules[i];
+      rules[i]
+        ..marker = rule.marker ?? -1
+        ..signature = _toNativeBytes(rule.signature, arena)
+        ..signatureLength = rule.signature?.length ?? 0
+        ..action = rule.action.index
+        ..data = _toNativeBytes(rule.data, arena)
+        ..size = rule.data?.length ?? 0;
+    }
+    final inserts = arena<_JpegMarkerSegment>(max(policy.inserts.length, 1));
+    for (int i = 0; i < policy.inserts.length; i++) {
+      inserts[i]
+        ..marker = policy.inserts[i].marker
+        ..data = _toNativeBytes(policy.inserts[i].data, arena)
+        ..size = policy.inserts[i].data.length;
+    }
+    return arena<_JpegMarkerPolicy>()
+      ..ref.defaultAction = policy.keepByDefault
+          ? MozJpegMarkerAction.keep.index
+          : MozJpegMarkerAction.drop.index
+      ..ref.rules = rules
+      ..ref.numRules = policy.rules.length
+      ..ref.inserts = inserts
+      ..ref.numInserts = policy.inserts.length;
+  }
+
+  /// Rewrite the APPn/COM markers (EXIF, XMP, ICC profile, comments, ...) of the JPEG data by [policy].
+  /// The image is not decoded; the other markers and the compressed image data are copied as is, so it's as fast as
+  /// copying the data and the image quality never changes.
+  /// The function returns null if the data is not a valid JPEG.
+  static MozJpegEncodedResult? jpegRewriteMarkers(
+          Uint8List jpeg, MozJpegMarkerPolicy policy) =>
+      using((arena) {
+        final data = _toNativeBytes(jpeg, arena);
+        final result = arena<IntPtr>();
+        if (_jpegRewriteMarkers(
+                data, jpeg.length, _toNativePolicy(policy, arena), result) !=
+            0) {
+          return null;
+        }
+        return MozJpegEncodedResult._(result.value);
+      });
+
+  /// File version of [jpegRewriteMarkers]; [output] may be same as [input] to rewrite the file in place.
+  /// The output file is replaced only when the whole output is written.
+  /// The function returns false if the input is not a valid JPEG or the output can't be written.
+  static bool jpegRewriteMarkersFile(
+          File input, File output, MozJpegMarkerPolicy policy) =>
+      using((arena) =>
+          _jpegRewriteMarkersFile(
+              input.path.toNativeUtf8(allocator: arena),
+              output.path.toNativeUtf8(allocator: arena),
+              _toNativePolicy(policy, arena)) ==
+          0);
+
+  /// Read only the header of the JPEG data; the entropy-coded data is not decoded at all.
+  /// The function returns null if the data is not a valid JPEG.
+  static MozJpegProbeInfo? jpegProbe(Uint8List jpeg) => using((arena) {
+        final data = arena.allocate<Uint8>(jpeg.length);
+        data.asTypedList(jpeg.length).setAll(0, jpeg);
+        final info = arena<_JpegProbeInfo>();
+        if (_jpegProbe(data, jpeg.length, info) != 0) return null;
+        return MozJpegProbeInfo._(info.ref);
+      });
+
+  /// Read only the header of the JPEG file; only the beginning of the file is read.
+  /// The function returns null if the file is not a valid JPEG.
+  static MozJpegProbeInfo? jpegProbeFile(File file) => using((arena) {
+        final info = arena<_JpegProbeInfo>();
+        if (_jpegProbeFile(file.path.toNativeUtf8(allocator: arena), info) !=
+            0) {
+          return null;
+        }
+        return MozJpegProbeInfo._(info.ref);
+      });
+}
+
+/// An output of [FlutterMozjpeg.jpegCompressLadder].
+class MozJpegLadderStep {
+  /// Output width; if null, it's calculated from [height] keeping the aspect ratio.
+  final int? width;
+
+  /// Output height; if null, it's calculated from [width] keeping the aspect ratio.
+  /// If both [width] and [height] are null, the image is not resized.
+  final int? height;
+
+  /// JPEG compression quality in [0 - 100]; the default is 75.
+  final int quality;
+
+  const MozJpegLadderStep({this.width, this.height, this.quality = 75});
+}
+
+/// JPEG compression result.
+/// You must call [dispose] after using it.
+class MozJpegEncodedResult {
+  int? _vectorAddress;
+  MozJpegEncodedResult._(this._vectorAddress);
+
+  /// Buffer that contains the compressed result.
+  Uint8List get buffer => pointer.asTypedList(size);
+
+  /// Pointer to the buffer that contains the compressed result.
+  Pointer<Uint8> get pointer =>
+      FlutterMozjpeg._jpegCompressGetPtr(_vectorAddress!);
+
+  /// Size in bytes of the compressed result.
+  int get size => FlutterMozjpeg._jpegCompressGetSize(_vectorAddress!);
+
+  /// Save the compressed result JPEG data to file.
+  Future<void> save(File file) => file.writeAsBytes(buffer);
+
+  /// Create image object from the compressed result.
+  Future<ui.Image> createImage() => loadImageFromBytes(buffer);
+
+  /// Release the resources used by the object.
+  void dispose() {
+    FlutterMozjpeg._jpegCompressRelease(_vectorAddress!);
+    _vectorAddress = null;
+  }
+}
+
+/// How [FlutterMozjpeg.jpegRecompress] produced the output.
+enum MozJpegRecompressOutcome {
+  /// The image was decoded and compressed again.
+  recompressed,
+
+  /// The input was already compressed enough; only the entropy coding was optimized losslessly.
+  optimized,
+
+  /// The input is returned as is because the optimization could not make it smaller.
+  original,
+}
+
+/// Result of [FlutterMozjpeg.jpegRecompress].
+/// You must call [dispose] after using it.
+class MozJpegRecompressResult {
+  /// The output JPEG.
+  final MozJpegEncodedResult result;
+
+  final MozJpegRecompressOutcome outcome;
+
+  MozJpegRecompressResult._(this.result, this.outcome);
+
+  /// Release the resources used by the object.
+  void dispose() => result.dispose();
+}
+
+/// Result of [FlutterMozjpeg.jpegTileGrid].
+/// You must call [dispose] after using it.
+class MozJpegTileGrid {
+  final int columns;
+  final int rows;
+
+  /// Tile size in pixels; the tiles on the right/bottom edges may be smaller.
+  final int tileWidth;
+  final int tileHeight;
+
+  /// Tiles in raster order (`row * columns + column`); empty if the tiles were written to the directory.
+  final List<MozJpegEncodedResult?> tiles;
+
+  MozJpegTileGrid._(
+      this.columns, this.rows, this.tileWidth, this.tileHeight, this.tiles);
+
+  /// The tile at ([column], [row]) on memory.
+  MozJpegEncodedResult? tile(int column, int row) =>
+      tiles[row * columns + column];
+
+  /// The tile file at ([column], [row]) in the output directory.
+  static File tileFile(Directory directory, int column, int row) =>
+      File('${directory.path}/${column}_$row.jpg');
+
+  /// Release the resources used by the object.
+  void dispose() {
+    for (int i = 0; i < tiles.length; i++) {
+      tiles[i]?.dispose();
+      tiles[i] = null;
+    }
+  }
+}
+
+/// Resumable encoder created by [FlutterMozjpeg.jpegCompressBegin].
+/// You must call [end] even if the compression is abandoned.
+class MozJpegSteppedEncoder {
+  Pointer<Void>? _handle;
+
+  MozJpegSteppedEncoder._(this._handle);
+
+  /// The JPEG on memory after [end] succeeded; null if it's written to the file.
+  /// You must call [MozJpegEncodedResult.dispose] after using it.
+  MozJpegEncodedResult? result;
+
+  /// Encode up to [maxRows] rows of the output image; returns true if there are more rows to encode.
+  /// It returns false when the image is done or the compression failed.
+  bool step(int maxRows) =>
+      FlutterMozjpeg._jpegCompressStep(_handle!, maxRows) ==
+      FlutterMozjpeg._stepMore;
+
+  /// Release the encoder and return the output size; null if the compression failed or was abandoned before
+  /// encoding all the rows (the output file is removed then).
+  int? end() {
+    final handle = _handle;
+    if (handle == null) return null;
+    _handle = null;
+    return using((arena) {
+      final vector = arena<IntPtr>()..value = 0;
+      final size = arena<IntPtr>();
+      if (FlutterMozjpeg._jpegCompressEnd(handle, vector, size) != 0) {
+        return null;
+      }
+      if (vector.value != 0) result = MozJpegEncodedResult._(vector.value);
+      return size.value;
+    });
+  }
+}
+
+/// Frame encoder created by [FlutterMozjpeg.jpegFrameEncoder].
+/// You must call [dispose] after using it.
+class MozJpegFrameEncoder {
+  Pointer<Void>? _handle;
+
+  /// The frames are encoded one by one in the order of [encode].
+  Future<void> _last = Future.value();
+
+  MozJpegFrameEncoder._(this._handle);
+
+  /// Encode the frame; [src] must be kept valid until the returned future completes.
+  /// If [output] is specified, the JPEG is written to the file; [dropCache] and [sync] of
+  /// [FlutterMozjpeg.jpegFrameEncoder] apply to it. Otherwise, the JPEG is returned on memory.
+  /// The future completes with null if the compression failed.
+  Future<MozJpegFrameResult?> encode(Pointer<Uint8> src, {File? output}) {
+    final handle = _handle!;
+    final result = _last.then((_) => _encode(handle, src, output));
+    _last = result;
+    return result;
+  }
+
+  static Future<MozJpegFrameResult?> _encode(
+      Pointer<Void> handle, Pointer<Uint8> src, File? output) {
+    FlutterMozjpeg._ensureDartApiInitialized();
+    final comp = Completer<MozJpegFrameResult?>();
+    int changed = 0, total = 0, size = 0;
+    MozJpegEncodedResult? encoded;
+    final context = FlutterMozjpeg._addProgressCallback(
+      (pass, totalPass, percentage) {
+        if (pass == FlutterMozjpeg._progressPassExitCode) {
+          comp.complete(percentage == 0
+              ? MozJpegFrameResult._(encoded, size, changed, total)
+              : null);
+          return;
+        }
+        if (pass == FlutterMozjpeg._progressPassVectorPointer) {
+          encoded = MozJpegEncodedResult._(percentage);
+          size = encoded!.size;
+          return;
+        }
+        if (pass == FlutterMozjpeg._progressPassOutputFileSize) {
+          size = percentage;
+          return;
+        }
+        changed = pass;
+        total = totalPass;
+      },
+    );
+    using((arena) {
+      FlutterMozjpeg._jpegFrameEncoderEncode(
+          handle,
+          src,
+          output == null
+              ? nullptr
+              : output.path.toNativeUtf8(allocator: arena),
+          context);
+    });
+    return comp.future;
+  }
+
+  /// Release the encoder after the pending frames.
+  Future<void> dispose() async {
+    final handle = _handle;
+    if (handle == null) return;
+    _handle = null;
+    await _last;
+    FlutterMozjpeg._jpegFrameEncoderRelease(handle);
+  }
+}
+
+/// Result of [MozJpegFrameEncoder.encode].
+class MozJpegFrameResult {
+  /// The JPEG on memory; null if it's written to the file.
+  /// You must call [MozJpegEncodedResult.dispose] after using it.
+  final MozJpegEncodedResult? result;
+
+  /// Size in bytes of the JPEG.
+  final int size;
+
+  /// Number of the MCUs that were changed from the previous frame and encoded again.
+  final int changedMcus;
+
+  /// Number of all the MCUs of the frame.
+  final int totalMcus;
+
+  MozJpegFrameResult._(this.result, this.size, this.changedMcus, this.totalMcus);
+}
+
+/// Sequence encoder created by [FlutterMozjpeg.jpegSequence].
+/// You must call [finish] after adding the frames.
+class MozJpegSequence {
+  Pointer<Void>? _handle;
+  final _frames = <int, Completer<MozJpegSequenceFrame?>>{};
+  final _done = Completer<bool>();
+
+  MozJpegSequence._();
+
+  void _onProgress(int pass, int totalPass, int percentage) {
+    if (pass == FlutterMozjpeg._progressPassExitCode) {
+      _done.complete(percentage == 0);
+      return;
+    }
+    if (pass == FlutterMozjpeg._progressPassVectorPointer) {
+      _frames.remove(totalPass)?.complete(percentage == 0
+          ? null
+          : MozJpegSequenceFrame._(totalPass,
+              FlutterMozjpeg._jpegCompressGetSize(percentage),
+              MozJpegEncodedResult._(percentage)));
+      return;
+    }
+    if (pass == FlutterMozjpeg._progressPassOutputFileSize) {
+      _frames.remove(totalPass)?.complete(percentage < 0
+          ? null
+          : MozJpegSequenceFrame._(totalPass, percentage, null));
+    }
+  }
+
+  /// The tables-only JPEG that should be fed to the decoder before the frames; it's also the first datastream of
+  /// the output file. The returned object should be disposed by the caller.
+  MozJpegEncodedResult tables() => MozJpegEncodedResult._(
+      FlutterMozjpeg._jpegSequenceTables(_handle!));
+
+  /// Add the frame; [src] must be kept valid until the returned future completes.
+  /// The future completes with null if the frame failed.
+  Future<MozJpegSequenceFrame?> addFrame(Pointer<Uint8> src) {
+    final index = FlutterMozjpeg._jpegSequenceAddFrame(_handle!, src);
+    if (index < 0) return Future.value(null);
+    // The frame is notified asynchronously through the port, so the completer is registered in time
+    final comp = Completer<MozJpegSequenceFrame?>();
+    _frames[index] = comp;
+    return comp.future;
+  }
+
+  /// Wait for the frames and close the output; the object can't be used after the call.
+  /// The function returns false if any of the frames failed.
+  Future<bool> finish() {
+    if (_handle != null) {
+      FlutterMozjpeg._jpegSequenceFinish(_handle!);
+      _handle = null;
+    }
+    return _done.future;
+  }
+
+  /// Make a standalone JPEG from [tables] and an abbreviated [frame] of the sequence by inserting the tables into
+  /// the frame after its APPn markers; the result can be decoded by any JPEG decoder.
+  static Uint8List standalone(Uint8List tables, Uint8List frame) {
+    // tables: SOI, DQT/DHT..., EOI
+    final body = Uint8List.sublistView(tables, 2, tables.length - 2);
+    int pos = 2;
+    while (pos + 4 <= frame.length &&
+        frame[pos] == 0xff &&
+        frame[pos + 1] >= 0xe0 &&
+        frame[pos + 1] <= 0xef) {
+      pos += 2 + (frame[pos + 2] << 8 | frame[pos + 3]);
+    }
+    return Uint8List(frame.length + body.length)
+      ..setRange(0, pos, frame)
+      ..setRange(pos, pos + body.length, body)
+      ..setRange(pos + body.length, frame.length + body.length, frame, pos);
+  }
+}
+
+/// A frame encoded by [MozJpegSequence].
+class MozJpegSequenceFrame {
+  /// Index of the frame in the sequence, in the order of [MozJpegSequence.addFrame].
+  final int index;
+
+  /// Size in bytes of the abbreviated JPEG of the frame.
+  final int size;
+
+  /// The abbreviated JPEG of the frame; null if the frames are written to the file.
+  /// You must call [MozJpegEncodedResult.dispose] after using it.
+  final MozJpegEncodedResult? result;
+
+  MozJpegSequenceFrame._(this.index, this.size, this.result);
+}
+
+/// Result of [FlutterMozjpeg.jpegtranBatch].
+class MozJpegBatchResult {
+  /// Output size in bytes for each file; null if the file failed.
+  final List<int?> sizes;
+
+  final int filesSucceeded;
+  final int filesFailed;
+
+  /// Total size in bytes of the input files read.
+  final int bytesRead;
+
+  /// Total size in bytes of the output files written.
+  final int bytesWritten;
+
+  /// Wall clock time of the whole batch.
+  final Duration elapsed;
+
+  MozJpegBatchResult._(this.sizes, this.filesSucceeded, this.filesFailed,
+      this.bytesRead, this.bytesWritten, this.elapsed);
+
+  /// Throughput in bytes read per second.
+  double get bytesPerSecond => elapsed.inMicroseconds == 0
+      ? 0
+      : bytesRead * 1e6 / elapsed.inMicroseconds;
+}
+
+/// A file of [FlutterMozjpeg.jpegtranManifest].
+class MozJpegBatchEntry {
+  final File input;
+
+  /// The output file; null to replace [input].
+  final File? output;
+
+  /// jpegtran switches for the file, which follow the common switches.
+  final List<String> switches;
+
+  MozJpegBatchEntry(this.input, {this.output, this.switches = const []});
+}
+
+/// Result of a file of [FlutterMozjpeg.jpegtranManifest].
+class MozJpegBatchFileResult {
+  /// jpegtran exit code; 0 (or 2 with warnings) if the output is written.
+  final int code;
+
+  /// Size in bytes of the input; 0 if it can't be read.
+  final int bytesIn;
+
+  /// Size in bytes of the output; 0 if failed.
+  final int bytesOut;
+
+  /// Time from the start of the transform to the end of the write.
+  final Duration elapsed;
+
+  bool get succeeded => code == 0 || code == 2;
+
+  MozJpegBatchFileResult._(this.code, this.bytesIn, this.bytesOut, this.elapsed);
+}
+
+/// Result of [FlutterMozjpeg.jpegtranManifest].
+class MozJpegManifestResult {
+  /// Result of each file in the order of the entries.
+  final List<MozJpegBatchFileResult> files;
+
+  final int filesSucceeded;
+  final int filesFailed;
+  final int bytesRead;
+  final int bytesWritten;
+
+  /// Wall clock time of the whole batch.
+  final Duration elapsed;
+
+  MozJpegManifestResult._(this.files, this.filesSucceeded, this.filesFailed,
+      this.bytesRead, this.bytesWritten, this.elapsed);
+
+  /// Read the summary: `jpeg_batch_stats` followed by [count] `jpeg_batch_file_summary`.
+  factory MozJpegManifestResult._fromSummary(
+      Pointer<_JpegBatchStats> summary, int count) {
+    final stats = summary.ref;
+    final files = Pointer<_JpegBatchFileSummary>.fromAddress(
+        summary.address + sizeOf<_JpegBatchStats>());
+    return MozJpegManifestResult._(
+        List.generate(count, (i) {
+          final f = files[i];
+          return MozJpegBatchFileResult._(f.code, f.bytesIn, f.bytesOut,
+              Duration(microseconds: f.elapsedUs));
+        }),
+        stats.filesSucceeded,
+        stats.filesFailed,
+        stats.bytesRead,
+        stats.bytesWritten,
+        Duration(microseconds: stats.elapsedUs));
+  }
+}
+
+/// What to do on the markers that match a [MozJpegMarkerRule].
+enum MozJpegMarkerAction {
+  keep,
+  drop,
+
+  /// Replace the marker data with [MozJpegMarkerRule.data].
+  replace,
+}
+
+/// A rule of [MozJpegMarkerPolicy]; it matches the markers of the code [marker] whose data start with [signature].
+class MozJpegMarkerRule {
+  /// 0xE0 + n for APPn and 0xFE for COM; null matches any APPn/COM marker.
+  final int? marker;
+
+  /// Prefix of the marker data such as `Exif\0\0`; null matches any data.
+  final List<int>? signature;
+  final MozJpegMarkerAction action;
+
+  /// Replacement data for [MozJpegMarkerAction.replace]; up to 65533 bytes.
+  final List<int>? data;
+
+  const MozJpegMarkerRule(
+      {this.marker, this.signature, required this.action, this.data});
+
+  static const int app0 = 0xe0;
+  static const int app1 = 0xe1;
+  static const int app2 = 0xe2;
+  static const int app13 = 0xed;
+  static const int com = 0xfe;
+
+  /// EXIF (including GPS and the thumbnail).
+  static const exifSignature = [0x45, 0x78, 0x69, 0x66, 0, 0];
+
+  /// XMP; `http://ns.adobe.com/xap/1.0/\0`.
+  static final xmpSignature =
+      ascii.encode('http://ns.adobe.com/xap/1.0/\x00');
+
+  /// ICC color profile; `ICC_PROFILE\0`.
+  static final iccSignature = ascii.encode('ICC_PROFILE\x00');
+
+  /// Photoshop IPTC; `Photoshop 3.0\0`.
+  static final iptcSignature = ascii.encode('Photoshop 3.0\x00');
+
+  static const dropExif = MozJpegMarkerRule(
+      marker: app1, signature: exifSignature, action: MozJpegMarkerAction.drop);
+  static final keepIcc = MozJpegMarkerRule(
+      marker: app2, signature: iccSignature, action: MozJpegMarkerAction.keep);
+}
+
+/// A marker segment to insert by [MozJpegMarkerPolicy].
+class MozJpegMarkerSegment {
+  /// 0xE0 + n for APPn and 0xFE for COM.
+  final int marker;
+
+  /// Marker data; up to 65533 bytes.
+  final List<int> data;
+
+  const MozJpegMarkerSegment(this.marker, this.data);
+
+  /// COM marker with the text.
+  MozJpegMarkerSegment.comment(String text)
+      : marker = MozJpegMarkerRule.com,
+        data = utf8.encode(text);
+}
+
+/// Policy of [FlutterMozjpeg.jpegRewriteMarkers].
+/// Each APPn/COM marker is processed by the first matching rule in [rules]; the markers that match no rule are
+/// kept if [keepByDefault] is true or dropped otherwise. [inserts] are inserted after the remaining APPn/COM markers.
+/// The JFIF (APP0) and Adobe (APP14) markers are always kept because they affect the colors of the decoded image.
+class MozJpegMarkerPolicy {
+  final bool keepByDefault;
+  final List<MozJpegMarkerRule> rules;
+  final List<MozJpegMarkerSegment> inserts;
+
+  const MozJpegMarkerPolicy(
+      {this.keepByDefault = true,
+      this.rules = const [],
+      this.inserts = const []});
+
+  /// Drop all the metadata except the ICC color profile.
+  static final scrub = MozJpegMarkerPolicy(
+      keepByDefault: false, rules: [MozJpegMarkerRule.keepIcc]);
+}
+
+/// APPn/COM marker in [MozJpegProbeInfo].
+class MozJpegMarker {
+  /// Marker code; 0xE0 + n for APPn and 0xFE for COM.
+  final int marker;
+
+  /// Length of the marker data.
+  final int length;
+
+  /// The first (up to 32) bytes of the marker data; e.g. `Exif\0\0` for EXIF.
+  final Uint8List head;
+
+  const MozJpegMarker._(this.marker, this.length, this.head);
+
+  /// True if the marker is APPn.
+  bool get isApp => marker >= 0xe0 && marker <= 0xef;
+
+  /// True if the marker is COM.
+  bool get isComment => marker == 0xfe;
+}
+
+/// Header information of a JPEG; see [FlutterMozjpeg.jpegProbe].
+class MozJpegProbeInfo {
+  final int width;
+  final int height;
+  final int numComponents;
+
+  /// Color space of the JPEG data; typically [MozJpegColorSpace.YCbCr] or [MozJpegColorSpace.grayscale].
+  final MozJpegColorSpace colorSpace;
+
+  /// Bits per sample.
+  final int dataPrecision;
+  final bool progressive;
+  final bool arithmetic;
+
+  /// Restart interval in MCUs; 0 if there are no restart markers.
+  final int restartInterval;
+
+  /// Horizontal sampling factors of the components.
+  final List<int> hSampFactors;
+
+  /// Vertical sampling factors of the components.
+  final List<int> vSampFactors;
+
+  /// Index on [quantTables] for each component.
+  final List<int> quantTableIndices;
+
+  /// Quantization tables in natural (not zigzag) order; null for undefined slots.
+  final List<Uint16List?> quantTables;
+
+  /// JFIF density unit; 0: aspect ratio only, 1: dots per inch, 2: dots per cm.
+  final int densityUnit;
+  final int xDensity;
+  final int yDensity;
+
+  /// Adobe APP14 transform flag; null if there's no Adobe marker.
+  final int? adobeTransform;
+
+  /// Number of APPn/COM markers; [markers] may contain only the first 16 of them.
+  final int markerCount;
+  final List<MozJpegMarker> markers;
+
+  /// Estimated IJG quality (1 - 100) that produces the quantization tables; null if unknown.
+  /// For images by other encoders, it's just the closest one.
+  final int? quality;
+
+  MozJpegProbeInfo._(_JpegProbeInfo info)
+      : width = info.width,
+        height = info.height,
+        numComponents = info.numComponents,
+        colorSpace = _int2cs(info.colorSpace),
+        dataPrecision = info.dataPrecision,
+        progressive = info.progressive != 0,
+        arithmetic = info.arithmetic != 0,
+        restartInterval = info.restartInterval,
+        hSampFactors = List.generate(
+            min(info.numComponents, 4), (i) => info.hSampFactor[i]),
+        vSampFactors = List.generate(
+            min(info.numComponents, 4), (i) => info.vSampFactor[i]),
+        quantTableIndices = List.generate(
+            min(info.numComponents, 4), (i) => info.quantTblNo[i]),
+        quantTables = List.generate(
+            4,
+            (t) => info.quantTblDefined[t] == 0
+                ? null
+                : Uint16List.fromList(
+                    List.generate(64, (i) => info.quantTables[t][i]))),
+        densityUnit = info.densityUnit,
+        xDensity = info.xDensity,
+        yDensity = info.yDensity,
+        adobeTransform =
+            info.adobeTransform >= 0 ? info.adobeTransform : null,
+        markerCount = info.numMarkers,
+        markers = List.generate(
+            min(info.numMarkers, 16),
+            (i) => MozJpegMarker._(
+                info.markers[i].marker,
+                info.markers[i].length,
+                Uint8List.fromList(List.generate(
+                    min(info.markers[i].length, 32),
+                    (j) => info.markers[i].head[j])))),
+        quality = info.quality > 0 ? info.quality : null;
+
+  /// Chroma subsampling notation such as `4:2:0`; null for non-YCbCr or unusual layouts.
+  String? get subsampling {
+    if (numComponents != 3 ||
+        vSampFactors[1] != 1 ||
+        vSampFactors[2] != 1 ||
+        hSampFactors[1] != 1 ||
+        hSampFactors[2] != 1) {
+      return null;
+    }
+    return switch ((hSampFactors[0], vSampFactors[0])) {
+      (1, 1) => '4:4:4',
+      (2, 1) => '4:2:2',
+      (2, 2) => '4:2:0',
+      (1, 2) => '4:4:0',
+      (4, 1) => '4:1:1',
+      _ => null,
+    };
+  }
+}
+
+final class _JpegProbeMarker extends Struct {
+  @Int32()
+  external int marker;
+  @Uint32()
+  external int length;
+  @Array(32)
+  external Array<Uint8> head;
+}
+
+/// Mirror of `jpeg_probe_info` in jpegprobe.h.
+final class _JpegProbeInfo extends Struct {
+  @Int32()
+  external int width;
+  @Int32()
+  external int height;
+  @Int32()
+  external int numComponents;
+  @Int32()
+  external int colorSpace;
+  @Int32()
+  external int dataPrecision;
+  @Int32()
+  external int progressive;
+  @Int32()
+  external int arithmetic;
+  @Int32()
+  external int restartInterval;
+  @Array(4)
+  external Array<Int32> hSampFactor;
+  @Array(4)
+  external Array<Int32> vSampFactor;
+  @Array(4)
+  external Array<Int32> quantTblNo;
+  @Array(4)
+  external Array<Int32> quantTblDefined;
+  @Array(4, 64)
+  external Array<Array<Uint16>> quantTables;
+  @Int32()
+  external int densityUnit;
+  @Int32()
+  external int xDensity;
+  @Int32()
+  external int yDensity;
+  @Int32()
+  external int adobeTransform;
+  @Int32()
+  external int numMarkers;
+  @Array(16)
+  external Array<_JpegProbeMarker> markers;
+  @Int32()
+  external int quality;
+}
+
+/// Mirror of `jpeg_pyramid_options` in jpegpyramid.h.
+final class _JpegPyramidOptions extends Struct {
+  @Int32()
+  external int tileSize;
+  @Int32()
+  external int overlap;
+  external Pointer<Utf8> outputDir;
+  external Pointer<Utf8> dziPath;
+  @Int32()
+  external int losslessTopLevel;
+  external _JpegCompressOptions compress;
+}
+
+/// Mirror of `jpeg_tile_options` in jpegtiles.h.
+final class _JpegTileOptions extends Struct {
+  @Int32()
+  external int tileWidth;
+  @Int32()
+  external int tileHeight;
+  @Int32()
+  external int output;
+  external Pointer<Utf8> outputDir;
+  @Int32()
+  external int outputPolicy;
+  @Int32()
+  external int copyMarkers;
+  @Int32()
+  external int progressive;
+}
+
+/// Mirror of `jpeg_marker_rule` in jpegmarkers.h.
+final class _JpegMarkerRule extends Struct {
+  @Int32()
+  external int marker;
+  external Pointer<Uint8> signature;
+  @IntPtr()
+  external int signatureLength;
+  @Int32()
+  external int action;
+  external Pointer<Uint8> data;
+  @IntPtr()
+  external int size;
+}
+
+/// Mirror of `jpeg_marker_segment` in jpegmarkers.h.
+final class _JpegMarkerSegment extends Struct {
+  @Int32()
+  external int marker;
+  external Pointer<Uint8> data;
+  @IntPtr()
+  external int size;
+}
+
+/// Mirror of `jpeg_marker_policy` in jpegmarkers.h.
+final class _JpegMarkerPolicy extends Struct {
+  @Int32()
+  external int defaultAction;
+  external Pointer<_JpegMarkerRule> rules;
+  @Int32()
+  external int numRules;
+  external Pointer<_JpegMarkerSegment> inserts;
+  @Int32()
+  external int numInserts;
+}
+
+/// Mirror of `jpeg_batch_stats` in batch_io.h.
+final class _JpegBatchStats extends Struct {
+  @Int32()
+  external int filesSucceeded;
+  @Int32()
+  external int filesFailed;
+  @Int64()
+  external int bytesRead;
+  @Int64()
+  external int bytesWritten;
+  @Int64()
+  external int elapsedUs;
+}
+
+/// Mirror of `jpeg_batch_file_summary` in batch_io.h.
+final class _JpegBatchFileSummary extends Struct {
+  @Int32()
+  external int code;
+  @Int32()
+  external int reserved;
+  @Int64()
+  external int bytesIn;
+  @Int64()
+  external int bytesOut;
+  @Int64()
+  external int elapsedUs;
+}
+
+/// Mirror of `jpeg_compress_options` in jpegcompress.h.
+final class _JpegCompressOptions extends Struct {
+  @Int32()
+  external int quality;
+  @Int32()
+  external int dpi;
+  @Int32()
+  external int output;
+  @Int32()
+  external int outputPolicy;
+  external Pointer<Utf8> outputPath;
+  @Int32()
+  external int chunkSize;
+  @Int32()
+  external int singlePass;
+  @Int32()
+  external int targetWidth;
+  @Int32()
+  external int targetHeight;
+  @Int32()
+  external int alphaMode;
+  @Int32()
+  external int background;
+  external Pointer<Utf8> dedupeKey;
+  @Int32()
+  external int transform;
+  @Int32()
+  external int cropX;
+  @Int32()
+  external int cropY;
+  @Int32()
+  external int cropWidth;
+  @Int32()
+  external int cropHeight;
+}
+
+MozJpegAlphaMode _alphaModeFor(ui.Color? backgroundColor, bool premultiplied) =>
+    backgroundColor == null
+        ? MozJpegAlphaMode.ignore
+        : premultiplied
+            ? MozJpegAlphaMode.premultiplied
+            : MozJpegAlphaMode.straight;
+
+/// How to handle the alpha of the 4-byte RGB pixel layouts; the order should match `JPEG_COMPRESS_ALPHA_*`.
+enum MozJpegAlphaMode {
+  /// The 4th byte is ignored.
+  ignore,
+
+  /// The pixels are straight (non-premultiplied) alpha and composited over the background color.
+  straight,
+
+  /// The pixels are premultiplied alpha and composited over the background color.
+  premultiplied,
+}
+
+/// Rotation/mirroring applied to the raw pixels while encoding; the order should match `JPEG_COMPRESS_TRANSFORM_*`.
+enum MozJpegTransform {
+  /// The image is encoded as is.
+  none,
+
+  /// Mirror left-right.
+  flipHorizontal,
+
+  /// Mirror top-bottom.
+  flipVertical,
+
+  /// Mirror across the upper-left to lower-right axis.
+  transpose,
+
+  /// Mirror across the upper-right to lower-left axis.
+  transverse,
+
+  /// Rotate 90 degrees clockwise.
+  rotate90,
+
+  /// Rotate 180 degrees.
+  rotate180,
+
+  /// Rotate 270 degrees clockwise.
+  rotate270,
+}
+
+final _cs2int = <MozJpegColorSpace, int>{
+  MozJpegColorSpace.unknown: 0,
+  MozJpegColorSpace.grayscale: 1,
+  MozJpegColorSpace.RGB: 2,
+  MozJpegColorSpace.YCbCr: 3,
+  MozJpegColorSpace.CMYK: 4,
+  MozJpegColorSpace.YCCK: 5,
+  MozJpegColorSpace.extRGB: 6,
+  MozJpegColorSpace.extRGBX: 7,
+  MozJpegColorSpace.extBGR: 8,
+  MozJpegColorSpace.extBGRX: 9,
+  MozJpegColorSpace.extXBGR: 10,
+  MozJpegColorSpace.extXRGB: 11,
+  MozJpegColorSpace.extRGBA: 12,
+  MozJpegColorSpace.extBGRA: 13,
+  MozJpegColorSpace.extABGR: 14,
+  MozJpegColorSpace.extARGB: 15,
+  MozJpegColorSpace.RGB565: 16
+};
+
+MozJpegColorSpace _int2cs(int cs) => _cs2int.entries
+    .firstWhere((e) => e.value == cs,
+        orElse: () => const MapEntry(MozJpegColorSpace.unknown, 0))
+    .key;
+
+/// Input color space and pixel layout.
+enum MozJpegColorSpace {
+  unknown,
+  grayscale,
+  // ignore: constant_identifier_names
+  RGB,
+  // ignore: constant_identifier_names
+  YCbCr,
+  // ignore: constant_identifier_names
+  CMYK,
+  // ignore: constant_identifier_names
+  YCCK,
+  extRGB,
+  extRGBX,
+  extBGR,
+  extBGRX,
+  extXBGR,
+  extXRGB,
+  extRGBA,
+  extBGRA,
+  extABGR,
+  extARGB,
+  // ignore: constant_identifier_names
+  RGB565,
+}
+
+/// Helper function to load image from data bytes. It's just a wrapper function for [ui.decodeImageFromList].
+Future<ui.Image> loadImageFromBytes(Uint8List byteData) {
+  final comp = Completer<ui.Image>();
+  ui.decodeImageFromList(byteData, (result) => comp.complete(result));
+  return comp.future;
+}
+
+extension FlutterMozjpegOnUiImage on ui.Image {
+  /// Compress the image; see [FlutterMozjpeg.jpegCompress].
+  /// If [backgroundColor] is specified, transparent pixels are composited over the color.
+  Future<MozJpegEncodedResult?> compressWithMozJpeg({
+    int quality = 75,
+    int dpi = 96,
+    int? targetWidth,
+    int? targetHeight,
+    ui.Color? backgroundColor,
+    String? dedupeKey,
     ProgressCallback? progressCallback,
   }) =>
       using((arena) async {
         final data = (await toByteData())!;
         final buffer = arena.allocate<Uint8>(data.lengthInBytes);
-        final u8data = data.buffer.asUint8List();
-        final length = u8data.lengthInBytes;
-        for (int i = 0; i < length; i++) {
-          buffer[i] = u8data[i];
-        }
+        buffer.asTypedList(data.lengthInBytes).setAll(0,
+            data.buffer.asUint8List(data.offsetInBytes, data.lengthInBytes));
         return await FlutterMozjpeg.jpegCompress(
           buffer,
           width,
@@ -370,6 +2452,50 @@ extension FlutterMozjpegOnUiImage on ui.Image {
           MozJpegColorSpace.extRGBX,
           quality: quality,
           dpi: dpi,
+          targetWidth: targetWidth,
+          targetHeight: targetHeight,
+          // rawRgba of ui.Image is premultiplied
+          alphaMode: _alphaModeFor(backgroundColor, true),
+          backgroundColor: backgroundColor,
+          dedupeKey: dedupeKey,
+          progressCallback: progressCallback,
+        );
+      });
+
+  /// Compress the image directly into [output] file; see [FlutterMozjpeg.jpegCompressToFile].
+  /// If [backgroundColor] is specified, transparent pixels are composited over the color.
+  /// The function returns the output file size or null if the compression failed.
+  Future<int?> compressWithMozJpegToFile(
+    File output, {
+    int quality = 75,
+    int dpi = 96,
+    bool dropCache = false,
+    bool sync = false,
+    int? targetWidth,
+    int? targetHeight,
+    ui.Color? backgroundColor,
+    ProgressCallback? progressCallback,
+  }) =>
+      using((arena) async {
+        final data = (await toByteData())!;
+        final buffer = arena.allocate<Uint8>(data.lengthInBytes);
+        buffer.asTypedList(data.lengthInBytes).setAll(0,
+            data.buffer.asUint8List(data.offsetInBytes, data.lengthInBytes));
+        return await FlutterMozjpeg.jpegCompressToFile(
+          buffer,
+          width,
+          height,
+          width * 4,
+          MozJpegColorSpace.extRGBX,
+          output,
+          quality: quality,
+          dpi: dpi,
+          dropCache: dropCache,
+          sync: sync,
+          targetWidth: targetWidth,
+          targetHeight: targetHeight,
+          alphaMode: _alphaModeFor(backgroundColor, true),
+          backgroundColor: backgroundColor,
           progressCallback: progressCallback,
         );
       });